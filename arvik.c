@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
@@ -7,21 +8,712 @@
 #include <sys/types.h>
 #include <errno.h>
 #include <time.h>
+#include <signal.h>
 #include <zlib.h>
 #include <utime.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <sys/sendfile.h>
+#include <fnmatch.h>
+#include <getopt.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <dirent.h>
+#include <sys/syscall.h>
+#include <sys/sysmacros.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#include <linux/io_uring.h>
 
 #include "arvik.h"
+#include "libarvik_private.h"
 #define arvik_uname "shawno"
 #define arvik_gname "them"
+
+// Options this build adds on top of ARVIK_OPTIONS
+#define ARVIK_EXTRA_OPTIONS "Ij:zC:B:DruSRdm"
+
+// Long options have no short form; their codes sit above any char
+enum {
+    OPT_BASE = 256      // --base archive
+    , OPT_DEDUP         // --dedup
+    , OPT_URING         // --uring
+    , OPT_STATS         // --stats[=json]
+    , OPT_SHARDS        // --shards count
+    , OPT_SKIP          // --skip-unchanged[=crc]
+};
+
+static struct option arvik_long_options[] = {
+    { "base", required_argument, NULL, OPT_BASE },
+    { "dedup", no_argument, NULL, OPT_DEDUP },
+    { "uring", no_argument, NULL, OPT_URING },
+    { "stats", optional_argument, NULL, OPT_STATS },
+    { "shards", required_argument, NULL, OPT_SHARDS },
+    { "skip-unchanged", optional_argument, NULL, OPT_SKIP },
+    { NULL, 0, NULL, 0 }
+};
+
+// Running checksum of one member
+typedef struct csum_s {
+    arvik_csum_alg_t alg;
+    uLong value;
+    struct csum_s * also;   // fed the same bytes, when the algorithm is not known yet
+} csum_t;
+
+// Size of the buffers data is copied through (-B), and whether to bypass
+// the page cache with O_DIRECT (-D). Set once from the command line.
+#define IO_BLOCK_DEFAULT (1024 * 1024)
+#define IO_BLOCK_MAX (256 * 1024 * 1024)
+// O_DIRECT offsets and lengths must be multiples of this
+#define IO_ALIGN 4096
+
+static size_t io_block_size = IO_BLOCK_DEFAULT;
+static int io_direct = 0;
+// Batch the opens, reads, writes and closes of small members through
+// io_uring (--uring), when the kernel has it
+static int io_uring_wanted = 0;
+// Leave an extracted file alone when it already matches its member
+// (--skip-unchanged[=crc])
+#define SKIP_OFF 0
+#define SKIP_STAT 1     // same size and mtime
+#define SKIP_CRC 2      // and the CRC in the member's footer
+static int skip_unchanged = SKIP_OFF;
+// Page size for map_fault(), which cannot call sysconf()
+static size_t map_page_size = 0;
+
+// --stats: where a run's time went, by phase of the work. Calls in each
+// phase are timed, wall and thread CPU, only when stats_wanted. Counters
+// are updated from every thread, so phase times add up over threads.
+typedef enum {
+    PHASE_OPEN = 0      // open, stat, close and directory reads
+    , PHASE_READ        // reading member files or the archive
+    , PHASE_CRC         // checksums
+    , PHASE_ZLIB        // compressing and uncompressing
+    , PHASE_WRITE       // writing the archive or extracted files
+    , PHASE_META        // fchmod, utime and the like
+    , PHASE_URING       // io_uring batches, whatever they held
+    , PHASE_COUNT
+} stats_phase_t;
+
+typedef struct stats_counter_s {
+    uint64_t calls;     // system calls; for crc and zlib, library calls
+    uint64_t bytes;
+    uint64_t wall_ns;
+    uint64_t cpu_ns;
+} stats_counter_t;
+
+// Start of a timed call, from stats_mark()
+typedef struct stats_mark_s {
+    uint64_t wall_ns;
+    uint64_t cpu_ns;
+} stats_mark_t;
+
+// Slowest members kept for the report
+#define STATS_OUTLIERS 10
+
+typedef struct stats_member_s {
+    char name[256];
+    off_t size;
+    uint64_t wall_ns;
+} stats_member_t;
+
+static int stats_wanted = 0;
+static int stats_json = 0;
+static const char * stats_action = "none";
+static stats_mark_t stats_run_start;
+static stats_counter_t stats_phases[PHASE_COUNT];
+static uint64_t stats_members = 0;
+static stats_member_t stats_slowest[STATS_OUTLIERS]; // slowest first
+static size_t stats_slowest_count = 0;
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Sequential output to an archive or extracted file. When the file is in
+// O_DIRECT mode bytes are staged in an aligned block and only whole blocks
+// are written; io_out_finish() turns O_DIRECT off for the unaligned tail.
+// Otherwise small writes (headers, footers, padding, tiny members) are
+// gathered in batch, and go out with the next large write in one writev().
+typedef struct io_out_s {
+    int fd;         // -1 to discard the output, see io_out_discard()
+    char * block;   // staging block, NULL when writes go straight through
+    size_t len;     // bytes staged in block
+    char * batch;   // OUT_BATCH bytes of small writes not yet written
+    size_t batch_len;
+} io_out_t;
+
+// Size of the small-write batch, and the largest write that is copied
+// into it rather than written from where it is
+#define OUT_BATCH (1024 * 1024)
+#define OUT_SMALL (64 * 1024)
+
+// Members handled per io_uring batch, and the largest member whose data
+// goes through the ring in one read or write. Bigger members take the
+// usual path in their turn.
+#define URING_BATCH 64
+#define URING_SMALL (64 * 1024)
+
+// The rings of one io_uring instance, driven with the raw system calls.
+// Work goes in batches: queue up to URING_BATCH entries, then uring_run()
+// submits them all and waits for every completion.
+typedef struct uring_s {
+    int fd;
+    unsigned entries;
+    unsigned queued;        // entries taken since the last uring_run()
+    unsigned * sq_head;
+    unsigned * sq_tail;
+    unsigned * sq_mask;
+    unsigned * sq_array;
+    struct io_uring_sqe * sqes;
+    unsigned * cq_head;
+    unsigned * cq_tail;
+    unsigned * cq_mask;
+    struct io_uring_cqe * cqes;
+    void * ring;            // both rings, mapped together
+    size_t ring_size;
+    size_t sqes_size;
+} uring_t;
+
+// Buffered reader over an archive, a pipe as much as a file. Headers and
+// footers are parsed out of one large buffer, and data is skipped with
+// lseek() when the input can seek or by reading past it when it cannot. A
+// mapped archive is read straight from the mapping.
+typedef struct archive_reader_s {
+    int fd;
+    const char * buffer;    // owned, or the whole mapped archive
+    char * owned;           // io_block_size read buffer
+    size_t pos;             // next unread byte in buffer
+    size_t len;             // bytes in buffer
+    off_t offset;           // archive offset of buffer[pos]
+    int seekable;
+    int mapped;
+} archive_reader_t;
+
+// Settings for creating an archive, from the command line
+typedef struct create_options_s {
+    int verbose;
+    int write_index;    // -I
+    int jobs;           // -j, 0 when not given
+    int compress;       // -z
+    arvik_csum_alg_t csum;  // -C
+    int update;         // UPDATE_REPLACE for -r, UPDATE_NEWER for -u
+    char * base;        // --base, previous archive to copy unchanged members from
+    int dedup;          // --dedup, store repeated content once
+    int sparse;         // -S, store only the data extents of sparse files
+    int recursive;      // -R, archive what is below directory operands
+    int shards;         // --shards, archives to spread the members over, 0 for one
+} create_options_t;
+
+// How -r and -u treat a member already in the archive
+#define UPDATE_REPLACE 1    // always replace it
+#define UPDATE_NEWER 2      // replace it only with a newer file
+// Other changes to an existing archive
+#define UPDATE_DELETE 3     // -d: remove the named members
+#define UPDATE_MERGE 4      // -m: append the members of other archives
+
+// One record of an archive being compacted (-d) or merged (-m): a member,
+// long name record or index, header through footer. Records are moved
+// whole, so footers and their CRCs stay as they are.
+typedef struct archive_record_s {
+    arvik_header_t header;
+    off_t off;          // of the header
+    off_t len;          // header through footer
+    off_t ref_off;      // header of the member a dref repeats, or -1
+    int keep;
+    int hide;           // deleted, but kept as ARVIK_DELETED_NAME for a dref into it
+    off_t new_off;      // where it goes, if kept
+} archive_record_t;
+
+void csum_init(csum_t * sum, arvik_csum_alg_t alg);
+void csum_update(csum_t * sum, const void * buffer, size_t len);
+void csum_zeros(csum_t * sum, off_t len);
+int csum_file(int fd, arvik_csum_alg_t alg, off_t size, csum_t * sum);
+void * io_alloc(size_t len);
+int parse_size(const char * text, size_t * size);
+int set_direct(int fd);
+void drop_cache(int fd);
+int io_out_start(io_out_t * out, int fd);
+void io_out_discard(io_out_t * out);
+int io_out_write(io_out_t * out, const void * data, size_t len);
+int io_out_finish(io_out_t * out);
+int io_out_flush(io_out_t * out);
+off_t io_out_tell(io_out_t * out);
+int write_vec(int fd, struct iovec * iov, int count);
+int io_out_hole(io_out_t * out, off_t len);
+int uring_init(uring_t * ring, unsigned entries);
+void uring_exit(uring_t * ring);
+struct io_uring_sqe * uring_sqe(uring_t * ring, uint8_t opcode, int fd, unsigned index);
+int uring_run(uring_t * ring, int * results);
+void statx_to_stat(const struct statx * stx, struct stat * st);
+int reader_open(archive_reader_t * in, int fd);
+void reader_use_map(archive_reader_t * in, const char * map, off_t map_size);
+void reader_close(archive_reader_t * in);
+ssize_t reader_fill(archive_reader_t * in);
+ssize_t reader_next(archive_reader_t * in, const char ** data, size_t max);
+ssize_t reader_read(archive_reader_t * in, void * data, size_t len);
+int reader_skip(archive_reader_t * in, off_t count);
+int reader_seek(archive_reader_t * in, off_t offset);
 void show_help(void);
-void create_archive(char * archive_name, char ** members, int member_count, int verbose);
-void extract_archive(char * archive_name, int verbose, int validate);
-void list_archive( char * archive_name, int verbose, int validate);
-void write_header(int archive_fd, char * filename);
-void write_footer(int archive_fd, uLong crc, off_t file_size);
-void extract_file(int archive_fd, arvik_header_t header, int verbose, int validate);
-void process_archive(int archive_fd, int verbose, int extract, int validate);
+void stats_mark(stats_mark_t * mark);
+void stats_add(stats_phase_t phase, stats_mark_t * mark, uint64_t bytes, uint64_t calls);
+void stats_member(const char * name, off_t size, stats_mark_t * mark);
+void stats_report(void);
+ssize_t stats_read(int fd, void * buffer, size_t len);
+ssize_t stats_pread(int fd, void * buffer, size_t len, off_t offset);
+ssize_t stats_write(int fd, const void * buffer, size_t len);
+ssize_t stats_pwrite(int fd, const void * buffer, size_t len, off_t offset);
+int stats_open(const char * name, int flags, mode_t mode);
+int stats_fstat(int fd, struct stat * st);
+int stats_close(int fd);
+int create_archive(char * archive_name, char ** members, int member_count, create_options_t * opts);
+void update_archive(char * archive_name, char ** members, int member_count, create_options_t * opts);
+off_t find_members(int archive_fd, off_t archive_size, arvik_index_t * list, int * had_index);
+void delete_members(char * archive_name, char ** patterns, int pattern_count, create_options_t * opts);
+void merge_archives(char * archive_name, char ** sources, int source_count, create_options_t * opts);
+int open_existing(char * archive_name, int create, off_t * size);
+archive_record_t * scan_records(int archive_fd, off_t archive_size, size_t * count);
+archive_record_t * record_at(archive_record_t * records, size_t count, off_t off);
+void keep_ref_targets(archive_record_t * records, size_t count);
+off_t place_records(archive_record_t * records, size_t count, off_t off);
+int move_records(int from_fd, int to_fd, archive_record_t * records, size_t count);
+int copy_within(int from_fd, off_t from, int to_fd, off_t to, off_t len);
+int fix_records(int archive_fd, archive_record_t * records, size_t count);
+void finish_records(int archive_fd, off_t end, int write_index, arvik_csum_alg_t alg);
+int extract_archive(char * archive_name, int verbose, int validate, char ** patterns, int pattern_count, int jobs);
+int list_archive(char * archive_name, int verbose, int validate, int jobs);
+void write_header(io_out_t * out, char * filename, struct stat * st, arvik_header_t * header_out);
+int out_put(record_out_t * dest, const void * data, size_t len);
+void write_footer(io_out_t * out, arvik_csum_alg_t alg, uLong crc, off_t file_size);
+void write_bad_footer(io_out_t * out, off_t file_size);
+void extract_file(archive_reader_t * in, arvik_header_t header, const char * long_name, int verbose, int validate
+                  , const char * map, off_t map_size);
+int file_unchanged(const char * name, arvik_header_t * header, const char * data, off_t available);
+size_t process_archive(archive_reader_t * in, int verbose, int extract, int validate);
+int create_pipeline(int archive_fd, off_t archive_off, char ** members, int member_count, create_options_t * opts
+                    , arvik_index_t * index);
+void index_add(arvik_index_t * index, arvik_header_t * header, off_t data_off, arvik_footer_t * footer);
+arvik_index_entry_t * index_find(arvik_index_t * index, off_t data_off);
+void write_index_member(io_out_t * out, arvik_index_t * index, off_t index_off, arvik_csum_alg_t alg);
+int load_index(int archive_fd, arvik_index_entry_t ** entries, size_t * count);
+off_t write_long_name(io_out_t * out, char * filename, arvik_csum_alg_t alg, off_t header_off, arvik_index_t * index);
+int read_long_name(archive_reader_t * in, arvik_header_t * header, char * long_name);
+void entry_long_name(int archive_fd, arvik_index_entry_t * entry, char * long_name);
+int make_parents(const char * name);
+int extract_dir(const char * name, arvik_header_t * header);
+void finish_dirs(void);
+void print_member(arvik_header_t * header, const char * long_name, const arvik_footer_t * footer, int verbose
+                  , arvik_xheader_t * xheader);
+int member_selected(arvik_header_t * header, const char * long_name, char ** patterns, int pattern_count
+                    , char * matched);
+void skip_member(archive_reader_t * in, arvik_header_t * header);
+void * pipeline_reader(void * arg);
+int copy_range_direct(io_out_t * out, int in_fd, off_t in_base, const char * map, off_t length, csum_t * sum);
+
+// Count of the io_block_size buffers handed from the reader thread to the writer
+#define PIPE_BUF_COUNT 4
+// Bytes moved per copy_file_range/sendfile call on the zero-copy path
+#define DIRECT_CHUNK (8 * 1024 * 1024)
+
+// One member to be extracted by a worker in -j mode. Workers fill in the
+// result; the main thread reports results in member order.
+typedef struct extract_job_s {
+    arvik_header_t header;
+    char * name;        // full member name, malloc'd
+    off_t data_off;     // offset of member data in the archive
+    off_t file_size;
+    int dir;            // a directory, made by prepare_dirs() before any worker runs
+    int done;           // worker has finished with this member
+    int created;        // output file was opened, so "x - name" is reported
+    int unchanged;      // left as it was by --skip-unchanged, reported as "s - name"
+    int crc_passed;     // CRC was checked and matched
+    int status;         // 0, or the exit code of a fatal error
+    char message[512];  // text for stderr, printed in member order
+} extract_job_t;
+
+// Shared state of a parallel extraction
+typedef struct extract_pool_s {
+    extract_job_t * jobs;
+    size_t job_count;
+    size_t next_job;    // next member a worker should take
+    int archive_fd;
+    const char * map;   // whole archive, mapped read-only
+    off_t map_size;
+    int validate;
+    int verify;         // -t -V: check the members, write nothing
+    pthread_mutex_t lock;
+    pthread_cond_t job_done;
+} extract_pool_t;
+
+void extract_parallel(int archive_fd, const char * map, off_t map_size, int verbose, int validate, int jobs
+                      , char ** patterns, int pattern_count, char * matched);
+void * extract_worker(void * arg);
+void extract_job_run(extract_pool_t * pool, extract_job_t * job);
+void job_sum_init(extract_pool_t * pool, extract_job_t * job, csum_t * sum);
+void extract_job_finish(extract_pool_t * pool, extract_job_t * job, int file_fd, csum_t * sum);
+size_t scan_jobs(const char * map, off_t map_size, char ** patterns, int pattern_count, char * matched
+                 , extract_job_t ** jobs_out);
+void report_job(extract_job_t * job, int verbose);
+int extract_uring(int archive_fd, const char * map, off_t map_size, int verbose, int validate
+                  , char ** patterns, int pattern_count, char * matched);
+void job_note(extract_job_t * job, const char * fmt, ...);
+int compare_names(const void * a, const void * b);
+void prepare_dirs(extract_job_t * jobs, size_t count);
+void free_jobs(extract_job_t * jobs, size_t count);
+size_t verify_parallel(int archive_fd, const char * map, off_t map_size, int verbose, int jobs);
+size_t scan_verify(const char * map, off_t map_size, extract_job_t ** jobs_out, char * problem, size_t problem_len);
+void verify_job_run(extract_pool_t * pool, extract_job_t * job);
+void verify_name(arvik_header_t * header, const char * long_name, off_t header_off, char * name);
+int verify_stream_member(archive_reader_t * in, arvik_header_t * header, char * long_name, arvik_xheader_t * xheader
+                         , arvik_index_t * seen, arvik_footer_t * footer, char * problem, size_t problem_len);
+
+// Directories made while extracting. Their mode and mtime are set last,
+// by finish_dirs(), so that writing what is inside them neither fails on
+// a read-only mode nor moves the mtime on again.
+typedef struct dir_fixup_s {
+    char * name;
+    mode_t mode;
+    time_t mtime;
+} dir_fixup_t;
+
+typedef struct dir_fixups_s {
+    dir_fixup_t * dirs;
+    size_t count;
+    size_t capacity;
+} dir_fixups_t;
+
+static dir_fixups_t extracted_dirs = { NULL, 0, 0 };
+// Set in a shard's child process, where directories are left to the parent
+static int dirs_deferred = 0;
+
+// Bytes of a member copied by one worker in parallel create
+#define PARALLEL_CHUNK (64 * 1024 * 1024)
+
+// A member of a parallel create, with its place in the archive worked out
+// before any data is copied
+typedef struct create_member_s {
+    char * name;
+    arvik_header_t header;
+    off_t header_off;   // where the header goes
+    off_t data_off;     // where the data goes
+    off_t file_size;    // size from fstat when the plan was made
+    int chunks;         // PARALLEL_CHUNK pieces of the data, at least one
+    int chunks_left;    // pieces not yet copied
+    uLong * chunk_crc;  // checksum of each piece, combined when the last is done
+    uLong crc;
+    int failed;
+    char message[512];  // why the member failed
+    stats_mark_t started; // when its first piece was taken, for --stats
+} create_member_t;
+
+typedef struct create_chunk_s {
+    size_t member;      // index into the member plan
+    int chunk;          // which PARALLEL_CHUNK piece of the member
+} create_chunk_t;
+
+// Shared state of a parallel create
+typedef struct create_pool_s {
+    create_member_t * members;
+    size_t member_count;
+    create_chunk_t * chunks;
+    size_t chunk_count;
+    size_t next_chunk;  // next piece a worker should take
+    int archive_fd;
+    int failed;         // some member failed, stop taking work
+    arvik_csum_alg_t alg;
+    pthread_mutex_t lock;
+} create_pool_t;
+
+int create_parallel(int archive_fd, char * archive_name, char ** members, int member_count
+                    , create_options_t * opts);
+void * create_worker(void * arg);
+void create_chunk_run(create_pool_t * pool, create_chunk_t * chunk, char * buffer);
+
+// A previous archive (--base). Members whose file still has the same size
+// and mtime are copied from it as stored, CRC included, instead of being
+// read and checksummed again.
+typedef struct base_archive_s {
+    int fd;
+    const char * map;   // whole base archive, mapped read-only
+    off_t map_size;
+    arvik_index_t members;              // live members in archive order
+    arvik_index_entry_t ** by_name;     // the same, sorted by stored name
+} base_archive_t;
+
+void base_open(base_archive_t * base, const char * name);
+void base_close(base_archive_t * base);
+arvik_index_entry_t * base_lookup(base_archive_t * base, arvik_header_t * header, struct stat * st);
+int compare_entry_names(const void * a, const void * b);
+int write_reused_member(io_out_t * out, base_archive_t * base, arvik_index_entry_t * entry, char * filename
+                        , struct stat * st, arvik_header_t * header_out, off_t * stored_out, csum_t * sum);
+
+// Distinct member contents seen so far by --dedup, keyed on size and
+// checksum. Open addressing; a slot with member -1 is free.
+typedef struct dedup_entry_s {
+    int member;         // index into the members array
+    off_t size;
+    uLong crc;
+    dev_t dev;          // the file as it was when it was read, so a
+    ino_t ino;          // repeat is only compared against unchanged content
+    time_t mtime;
+} dedup_entry_t;
+
+typedef struct dedup_table_s {
+    dedup_entry_t * slots;
+    size_t capacity;    // power of two
+    size_t count;
+    arvik_csum_alg_t alg;
+} dedup_table_t;
+
+void dedup_init(dedup_table_t * table, arvik_csum_alg_t alg);
+int dedup_find(dedup_table_t * table, char ** members, int member, struct stat * st, const char * map, uLong crc);
+int dedup_same(const char * name, dedup_entry_t * entry, const char * map);
+int write_ref_member(io_out_t * out, char * filename, struct stat * st, off_t file_size, off_t target_off
+                     , arvik_header_t * header_out, off_t * stored_out);
+int maybe_sparse(struct stat * st);
+int find_extents(int fd, off_t size, sparse_extent_t ** extents_out, size_t * count_out);
+int write_sparse_member(io_out_t * out, char * filename, struct stat * st, int fd, const char * map
+                        , sparse_extent_t * extents, size_t extent_count, arvik_header_t * header_out
+                        , off_t * stored_out, csum_t * sum);
+
+// --shards spreads the members over several archives, balanced by size and
+// written at the same time, one thread each. The -f file becomes a text
+// manifest listing the shards, named after it as name.0 to name.N-1, and
+// then one line per member: shard, header offset, d for a directory, and
+// the name with backslash and newline escaped. -t and -x on a manifest run
+// every shard in a child process of its own.
+#define SHARD_TAG "!<arvik-shards>\n"
+#define SHARD_MAX 1024
+
+typedef struct shard_s {
+    char * name;            // path of the shard archive
+    int fd;
+    char ** members;        // its members, in command-line order
+    int member_count;
+    off_t load;             // bytes given to it so far
+    arvik_index_t index;    // what was written, for the manifest
+    create_options_t * opts;
+    pthread_t thread;
+    int failed;             // some member was not written in full
+} shard_t;
+
+// A member to place, heaviest first
+typedef struct shard_load_s {
+    off_t bytes;
+    int member;
+} shard_load_t;
+
+typedef struct manifest_entry_s {
+    int shard;
+    off_t header_off;
+    int dir;
+    char * name;
+} manifest_entry_t;
+
+typedef struct manifest_s {
+    char ** shards;         // paths of the shard archives
+    int shard_count;
+    manifest_entry_t * entries;
+    size_t count;
+} manifest_t;
+
+void create_shards(char * archive_name, char ** members, int member_count, create_options_t * opts);
+void * shard_writer(void * arg);
+int compare_loads(const void * a, const void * b);
+void write_manifest(char * archive_name, shard_t * shards, int shard_count);
+int is_manifest(const char * archive_name);
+void read_manifest(const char * archive_name, manifest_t * manifest);
+void free_manifest(manifest_t * manifest);
+void run_shards(char * archive_name, int extract, int verbose, int validate, char ** patterns, int pattern_count
+                , int jobs);
+int entry_selected(manifest_entry_t * entry, char ** patterns, int pattern_count, char * matched);
+void shard_dir(manifest_t * manifest, manifest_entry_t * entry);
+
+// Directory operands of -R are read by a few walk threads working ahead,
+// while a lister thread puts what they find in archive order: each
+// directory, then its entries sorted by name, depth first. The pipeline
+// archives members as they are found. members is a reserved mapping that
+// never moves, so the pipeline threads index it without taking the lock.
+#define WALK_MAX_MEMBERS ((size_t) 1 << 28)
+#define WALK_BUF_SIZE (64 * 1024)   // getdents64 buffer
+
+struct walk_dir_s;
+
+typedef struct walk_entry_s {
+    char * name;                // path from the operand, malloc'd
+    unsigned char type;         // DT_ type
+    struct walk_dir_s * subdir; // to descend into, for a directory
+} walk_entry_t;
+
+typedef struct walk_dir_s {
+    char * path;
+    int ready;                  // entries have been read
+    int error;                  // errno from reading the directory, or 0
+    walk_entry_t * entries;     // sorted by name
+    size_t count;
+    struct walk_dir_s * next;   // in the queue of directories to read
+} walk_dir_t;
+
+typedef struct tree_walk_s {
+    char ** roots;              // the operands
+    int root_count;
+    char ** members;            // found so far, in archive order
+    size_t member_count;
+    int finished;               // no more members are coming
+    walk_dir_t * queue;         // directories to read, next one first
+    int shutdown;
+    pthread_t * threads;
+    int thread_count;
+    pthread_t lister;
+    pthread_mutex_t lock;
+    pthread_cond_t work;        // a directory was queued, or shutdown
+    pthread_cond_t ready;       // a directory was read
+    pthread_cond_t found;       // members were added, or the walk finished
+} tree_walk_t;
+
+void walk_start(tree_walk_t * walk, char ** roots, int root_count, int threads);
+size_t walk_wait(tree_walk_t * walk, size_t i);
+void walk_finish(tree_walk_t * walk);
+void * walk_worker(void * arg);
+void * walk_lister(void * arg);
+void walk_read_dir(walk_dir_t * dir);
+void walk_list_dir(tree_walk_t * walk, walk_dir_t * dir);
+void walk_add(tree_walk_t * walk, char * name);
+char * walk_join(const char * dir, const char * name);
+int compare_walk_entries(const void * a, const void * b);
+
+// What a ring slot carries from the reader to the writer
+typedef enum {
+    SLOT_BEGIN = 0  // start of a member, file_size is valid
+    , SLOT_DATA     // len bytes of member data in data
+    , SLOT_FILE     // whole member, copied from fd and checksummed from map
+    , SLOT_REUSE    // whole member, copied as stored from the --base archive
+    , SLOT_END      // end of the current member
+    , SLOT_DONE     // no more members
+} slot_kind_t;
+
+typedef struct pipe_slot_s {
+    slot_kind_t kind;
+    int member;         // index into the members array
+    off_t file_size;    // size from fstat, for SLOT_BEGIN
+    char * data;        // io_block_size buffer owned by this slot
+    ssize_t len;        // bytes used in data
+    int fd;             // open member for SLOT_FILE, closed by the writer
+    char * map;         // read-only mapping of the member for SLOT_FILE
+    struct stat st;     // the member's fstat, for SLOT_BEGIN, SLOT_REUSE and SLOT_FILE
+    arvik_index_entry_t * base_entry;   // where SLOT_REUSE copies from
+    int have_crc;       // SLOT_FILE was already summed into crc by the reader
+    uLong crc;
+    int ref;            // SLOT_FILE repeats this earlier member (--dedup), or -1
+    sparse_extent_t * extents;  // data extents of a sparse SLOT_FILE (-S), or NULL
+    size_t extent_count;
+} pipe_slot_t;
+
+// Single producer / single consumer ring shared by the two create threads
+typedef struct create_pipe_s {
+    pipe_slot_t slots[PIPE_BUF_COUNT];
+    int head;           // next slot the reader fills
+    int tail;           // next slot the writer drains
+    int count;          // slots filled and not yet drained
+    pthread_mutex_t lock;
+    pthread_cond_t not_empty;
+    pthread_cond_t not_full;
+    char ** members;
+    int member_count;
+    int direct_reads;   // read members with O_DIRECT instead of mapping them
+    base_archive_t * base;  // --base archive, or NULL
+    dedup_table_t * dedup;  // --dedup contents seen so far, or NULL
+    int sparse;             // -S
+    int compress;           // -z, which compresses from the mapping
+    tree_walk_t * walk;     // -R walk still finding members, or NULL
+} create_pipe_t;
+
+// One block handed to a compression thread
+typedef struct zblock_job_s {
+    const char * src;   // member data for this block
+    size_t src_len;
+    char * dst;         // compressBound(ZBLOCK_SIZE) buffer owned by the job
+    uLongf dst_len;
+    int raw;            // deflate did not shrink it, store src as is
+    uLong crc;          // checksum of src
+} zblock_job_t;
+
+// Compression threads that work through one window of blocks at a time
+typedef struct compress_pool_s {
+    pthread_t * threads;
+    int thread_count;
+    zblock_job_t * blocks;  // window of blocks in flight
+    size_t window;          // capacity of blocks
+    size_t block_count;     // blocks in the current window
+    size_t next_block;      // next block a thread should take
+    size_t blocks_done;
+    int shutdown;
+    arvik_csum_alg_t alg;   // checksum each block is summed with
+    pthread_mutex_t lock;
+    pthread_cond_t work;
+    pthread_cond_t done;
+} compress_pool_t;
+
+// Output of a compressed member held back until its size is known. At most
+// this many windows of it are held in memory; the rest spills to a
+// temporary file.
+#define ZHOLD_WINDOWS 4
+typedef struct out_buf_s {
+    char * data;
+    size_t len;
+    size_t capacity;
+    size_t max;         // most to hold in data
+    FILE * spill;       // everything, once there was more than that
+} out_buf_t;
+
+// Where the library's decoders put a member restored by this tool: out,
+// summed into sum, with --stats kept. Data still in the mapped archive is
+// copied in the kernel, as copy_range_direct() does for plain members.
+typedef struct restore_to_s {
+    restore_sink_t sink;
+    io_out_t * out;
+    csum_t * sum;
+    int archive_fd;
+    const char * map;       // the archive, or NULL on a stream
+    off_t map_size;
+} restore_to_t;
+
+void compress_pool_start(compress_pool_t * pool, int threads, arvik_csum_alg_t alg);
+void compress_pool_stop(compress_pool_t * pool);
+void * compress_worker(void * arg);
+void compress_window(compress_pool_t * pool, size_t count);
+int write_compressed_member(io_out_t * out, compress_pool_t * pool, char * filename, struct stat * st
+                            , const char * map, off_t file_size, arvik_header_t * header_out, off_t * stored_out
+                            , csum_t * sum);
+int emit_bytes(io_out_t * out, out_buf_t * held, const void * data, size_t len);
+int write_spilled(io_out_t * out, FILE * spill, const arvik_header_t * header);
+int write_plain_mapped(io_out_t * out, char * filename, struct stat * st, const char * map, off_t file_size
+                       , arvik_header_t * header_out, off_t * stored_out);
+ssize_t read_full(int fd, void * buffer, size_t len);
+void restore_to_start(restore_to_t * to, io_out_t * out, csum_t * sum, int archive_fd, const char * map
+                      , off_t map_size);
+int restore_to_data(restore_sink_t * sink, const char * data, size_t len);
+int restore_to_hole(restore_sink_t * sink, off_t len);
+int restore_inflate(char * dest, uLongf * dest_len, const char * src, size_t len);
+ssize_t restore_read(restore_source_t * source, const char ** data, size_t max);
+int restore_result(int result);
+int restore_extended(io_out_t * out, int archive_fd, const char * map, off_t map_size, off_t data_off, csum_t * sum);
+int restore_stream(archive_reader_t * in, io_out_t * out, const arvik_xheader_t * xheader, off_t stored, csum_t * sum);
+int copy_source(arvik_index_t * extracted, char ** names, const arvik_xheader_t * xheader, off_t stored
+                , off_t ref_off);
+int restore_copy(io_out_t * out, int fd, csum_t * sum);
 
+pipe_slot_t * pipe_acquire(create_pipe_t * pipe);
+void pipe_publish(create_pipe_t * pipe);
+pipe_slot_t * pipe_take(create_pipe_t * pipe);
+void pipe_release(create_pipe_t * pipe);
+void pipeline_member(create_pipe_t * pipe, int i, int member_fd, struct stat * st);
+void pipeline_reader_uring(create_pipe_t * pipe, uring_t * ring);
+int pipe_member_count(create_pipe_t * pipe, int i);
+void map_fault(int sig, siginfo_t * info, void * context);
+void map_fault_install(void);
+int member_resized(int fd, off_t size);
+const char * map_write_error(void);
 
 int main(int argc, char * argv[]) 
 {
@@ -29,16 +721,36 @@ int main(int argc, char * argv[])
     var_action_t action = ACTION_NONE;
     int vflag = 0; //Flag for verbose output option
     int Vflag = 0; //Flag for validation
+    int jobs = 0; //Number of worker threads, 0 when not given
+    create_options_t create_opts = { 0, 0, 0, 0, ARVIK_CSUM_CRC32, 0, NULL, 0, 0, 0, 0 }; //Settings for -c, -r and -u
+    char * end = NULL;
     char * archive_name = NULL; //Name of the archive file
+    int status = EXIT_SUCCESS; //Exit status of the action run
 
     //Process the command line options using getopt
-    while ((opt = getopt(argc, argv, ARVIK_OPTIONS)) != -1)
+    while ((opt = getopt_long(argc, argv, ARVIK_OPTIONS ARVIK_EXTRA_OPTIONS, arvik_long_options, NULL)) != -1)
     {
         switch(opt)
         {
             case 'c': //Create archive
                 action = ACTION_CREATE;
                 break;
+            case 'r': // Add or replace members
+                action = ACTION_CREATE;
+                create_opts.update = UPDATE_REPLACE;
+                break;
+            case 'u': // Add or replace members with newer files
+                action = ACTION_CREATE;
+                create_opts.update = UPDATE_NEWER;
+                break;
+            case 'd': // Remove members
+                action = ACTION_CREATE;
+                create_opts.update = UPDATE_DELETE;
+                break;
+            case 'm': // Append the members of other archives
+                action = ACTION_CREATE;
+                create_opts.update = UPDATE_MERGE;
+                break;
             case 't': //Table of contents
                 action = ACTION_TOC;
                 break;
@@ -58,6 +770,86 @@ int main(int argc, char * argv[])
             case 'V': // Validate CRC
                 Vflag = 1;
                 break;
+            case 'I': // Write member index
+                create_opts.write_index = 1;
+                break;
+            case 'z': // Compress members
+                create_opts.compress = 1;
+                break;
+            case 'C': // Checksum algorithm
+                if (strcmp(optarg, "crc32") == 0)
+                {
+                    create_opts.csum = ARVIK_CSUM_CRC32;
+                }
+                else if (strcmp(optarg, "crc32c") == 0)
+                {
+                    create_opts.csum = ARVIK_CSUM_CRC32C;
+                }
+                else
+                {
+                    fprintf(stderr, "Unknown checksum %s\n", optarg);
+                    exit(INVALID_CMD_OPTION);
+                }
+                break;
+            case 'B': // I/O block size
+                if (parse_size(optarg, &io_block_size) < 0)
+                {
+                    fprintf(stderr, "Invalid block size %s, need a multiple of %d up to %d\n"
+                            , optarg, IO_ALIGN, IO_BLOCK_MAX);
+                    exit(INVALID_CMD_OPTION);
+                }
+                break;
+            case 'D': // Bypass the page cache
+                io_direct = 1;
+                break;
+            case 'S': // Store sparse files as their data extents
+                create_opts.sparse = 1;
+                break;
+            case 'R': // Walk directory operands
+                create_opts.recursive = 1;
+                break;
+            case OPT_BASE: // Previous archive for an incremental create
+                create_opts.base = optarg;
+                break;
+            case OPT_DEDUP: // Store repeated content once
+                create_opts.dedup = 1;
+                break;
+            case OPT_URING: // Batch small-member I/O through io_uring
+                io_uring_wanted = 1;
+                break;
+            case OPT_SHARDS: // Spread the members over several archives
+                create_opts.shards = strtol(optarg, &end, 10);
+                if (*end != '\0' || create_opts.shards < 1 || create_opts.shards > SHARD_MAX)
+                {
+                    fprintf(stderr, "Invalid shard count %s, need 1 to %d\n", optarg, SHARD_MAX);
+                    exit(INVALID_CMD_OPTION);
+                }
+                break;
+            case OPT_SKIP: // Leave files that match their member alone
+                if (optarg != NULL && strcmp(optarg, "crc") != 0)
+                {
+                    fprintf(stderr, "Unknown --skip-unchanged check %s (only crc)\n", optarg);
+                    exit(INVALID_CMD_OPTION);
+                }
+                skip_unchanged = optarg != NULL ? SKIP_CRC : SKIP_STAT;
+                break;
+            case OPT_STATS: // Report where the time went
+                if (optarg != NULL && strcmp(optarg, "json") != 0)
+                {
+                    fprintf(stderr, "Unknown --stats format %s (only json)\n", optarg);
+                    exit(INVALID_CMD_OPTION);
+                }
+                stats_wanted = 1;
+                stats_json = optarg != NULL;
+                break;
+            case 'j': // Worker threads
+                jobs = strtol(optarg, &end, 10);
+                if (*end != '\0' || jobs < 1)
+                {
+                    fprintf(stderr, "Invalid job count %s\n", optarg);
+                    exit(INVALID_CMD_OPTION);
+                }
+                break;
             default: // Invalid option
                 fprintf(stderr, "Invalid command line option\n");
                 exit(INVALID_CMD_OPTION);
@@ -75,6 +867,17 @@ int main(int argc, char * argv[])
         exit(NO_ACTION_GIVEN);
     }
     
+    if (stats_wanted)
+    {
+        stats_action = action == ACTION_CREATE ? (create_opts.update == UPDATE_DELETE ? "delete"
+                                                  : create_opts.update == UPDATE_MERGE ? "merge"
+                                                  : create_opts.update ? "update" : "create")
+                       : action == ACTION_TOC ? (Vflag ? "verify" : "list") : "extract";
+        stats_mark(&stats_run_start);
+        // Errors exit from anywhere, and a failed run is worth a report too
+        atexit(stats_report);
+    }
+
     switch (action)
     {
         case ACTION_CREATE:
@@ -87,7 +890,28 @@ int main(int argc, char * argv[])
                 exit(CREATE_FAIL);
             }
 
-            create_archive(archive_name, members, member_count, vflag);
+            create_opts.verbose = vflag;
+            create_opts.jobs = jobs;
+            if (create_opts.shards > 0)
+            {
+                create_shards(archive_name, members, member_count, &create_opts);
+            }
+            else if (create_opts.update == UPDATE_DELETE)
+            {
+                delete_members(archive_name, members, member_count, &create_opts);
+            }
+            else if (create_opts.update == UPDATE_MERGE)
+            {
+                merge_archives(archive_name, members, member_count, &create_opts);
+            }
+            else if (create_opts.update)
+            {
+                update_archive(archive_name, members, member_count, &create_opts);
+            }
+            else
+            {
+                status = create_archive(archive_name, members, member_count, &create_opts);
+            }
             break;
         case ACTION_TOC:
             if(archive_name == NULL && isatty(STDIN_FILENO))
@@ -96,7 +920,12 @@ int main(int argc, char * argv[])
                 exit(NO_ARCHIVE_NAME);
             }
             // List Table of Contents
-            list_archive(archive_name, vflag, Vflag);
+            if (archive_name != NULL && is_manifest(archive_name))
+            {
+                run_shards(archive_name, 0, vflag, Vflag, NULL, 0, jobs);
+                break;
+            }
+            status = list_archive(archive_name, vflag, Vflag, jobs);
             break;
         case ACTION_EXTRACT:
             if (archive_name == NULL && isatty(STDIN_FILENO))
@@ -104,617 +933,7246 @@ int main(int argc, char * argv[])
                 fprintf(stderr, "No archive file specified\n");
                 exit(NO_ARCHIVE_NAME);
             }
-            extract_archive(archive_name, vflag, Vflag);
+            // Any remaining operands name the members (or globs) to extract
+            if (archive_name != NULL && is_manifest(archive_name))
+            {
+                run_shards(archive_name, 1, vflag, Vflag, &argv[optind], argc - optind, jobs);
+                break;
+            }
+            status = extract_archive(archive_name, vflag, Vflag, &argv[optind], argc - optind, jobs);
             break;
         default:
             fprintf(stderr, "Unknown action\n");
             exit(NO_ACTION_GIVEN);
     }
-    return EXIT_SUCCESS;
+    return status;
 }
 
 // Display help for the program
 void show_help(void)
 {
-    printf("Usage: arvik -[cxtvVf:h] archive-file file...\n");
+    printf("Usage: arvik -[cruxtdmvVIzDSRj:C:B:f:h] archive-file file...\n");
     printf("    -c           create a new archive file\n");
+    printf("    -r           add files to an archive, replacing members of the same name\n");
+    printf("    -u           like -r, but only replace members older than the file\n");
+    printf("    -d           remove the members matching the file... operands (globs allowed)\n");
+    printf("                 from an archive, closing up the space in place\n");
+    printf("    -m           append the members of the archives given as file... operands to\n");
+    printf("                 the archive file, creating it if need be\n");
     printf("    -x           extract members from an existing archive file\n");
+    printf("                 (only those matching any file... operands, globs allowed)\n");
     printf("    -t           show the table of contents of archive file\n");
     printf("    -f filename  name of archive file to use\n");
-    printf("    -V           Validate the crc value for the data\n");
+    printf("    -V           Validate the crc value for the data; with -t, check every member\n");
+    printf("                 and report all that are corrupt, without extracting\n");
+    printf("    -I           write a member index at the end of the archive (-c, -d, -m)\n");
+    printf("    -z           compress members (-c)\n");
+    printf("    -C checksum  crc32 (default) or crc32c, which needs a newer arvik to verify (-c)\n");
+    printf("    -j jobs      create, extract or check (-t -V, default all cores) with this many\n");
+    printf("                 threads (archive must be a file),\n");
+    printf("                 or compress with this many threads (-c -z, default all cores)\n");
+    printf("    -B size      copy data in blocks of this size, a multiple of 4K (K/M/G suffix,\n");
+    printf("                 default 1M)\n");
+    printf("    -D           keep archive data out of the page cache, using O_DIRECT where the\n");
+    printf("                 file system allows it\n");
+    printf("    -S           store only the data of sparse files; holes come back as holes (-c)\n");
+    printf("    -R           also archive everything below directory operands, with paths\n");
+    printf("                 relative to the operand; -j sets the walk threads (-c, -r, -u)\n");
+    printf("    --base old   copy members whose file size and mtime are unchanged from this\n");
+    printf("                 earlier archive instead of reading the files (-c)\n");
+    printf("    --dedup      store files with identical content once; later copies refer to\n");
+    printf("                 the first (-c, -r, -u)\n");
+    printf("    --uring      batch the I/O of small members with io_uring, if the kernel has it\n");
+    printf("                 (not with -D)\n");
+    printf("    --shards n   spread the members over n archives, named after the -f file, and\n");
+    printf("                 write them at once; the -f file lists which holds each member,\n");
+    printf("                 and -t and -x on it work on all of them at once (-c)\n");
+    printf("    --skip-unchanged[=crc] leave files that have the size and mtime of their member,\n");
+    printf("                 and with =crc its CRC too, as they are (-x; =crc and compressed\n");
+    printf("                 members need the archive as a file)\n");
+    printf("    --stats[=json] report time, calls and bytes per phase of the work, and the\n");
+    printf("                 slowest members, on stderr at exit (-c, -r, -u, -x, -t)\n");
     printf("    -v           verbose output\n");
     printf("    -h           show help text\n");
 }
 
-// Create new archive file
-void create_archive(char * archive_name, char ** members, int member_count, int verbose)
+// Note the time a call starts, when --stats is on
+void stats_mark(stats_mark_t * mark)
 {
-    int archive_fd;
-    mode_t old_mask;
+    struct timespec now;
 
-    // Open the archive file or use stdout if no file is specified
-    if (archive_name == NULL)
+    if (!stats_wanted)
     {
-        archive_fd = STDOUT_FILENO;
+        return;
     }
-    else
-    {
-        old_mask = umask(0); // Clear umask temp
-        archive_fd = open(archive_name, O_WRONLY | O_CREAT | O_TRUNC, 0644);
-        umask(old_mask); // Restore original umask
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    mark->wall_ns = now.tv_sec * 1000000000ULL + now.tv_nsec;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &now);
+    mark->cpu_ns = now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
 
-        if (archive_fd < 0)
-        {
-            perror("Error opening archive file for writing");
-            exit(1);
-        }
-    }
+// Charge the time since mark, and the calls and bytes, to a phase
+void stats_add(stats_phase_t phase, stats_mark_t * mark, uint64_t bytes, uint64_t calls)
+{
+    stats_counter_t * counter = &stats_phases[phase];
+    stats_mark_t now;
 
-    if (write(archive_fd, ARVIK_TAG, strlen(ARVIK_TAG)) != (ssize_t)strlen(ARVIK_TAG))
+    if (!stats_wanted)
     {
-        perror("Error writing archive tag");
-        close(archive_fd);
-        exit(1);
+        return;
     }
+    stats_mark(&now);
+    __atomic_fetch_add(&counter->calls, calls, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&counter->bytes, bytes, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&counter->wall_ns, now.wall_ns - mark->wall_ns, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&counter->cpu_ns, now.cpu_ns - mark->cpu_ns, __ATOMIC_RELAXED);
+}
 
-    // Process each member file given
-    for (int i = 0; i < member_count; ++i)
-    {
-        struct stat st; // File Statistics
-        int member_fd; // File descriptor for the memory file
-        char buffer[4096]; // Buffer for reading file data
-        ssize_t bytes_read; // Number of bytes read
-        uLong crc = crc32(0L, Z_NULL, 0); // Initialize CRC
+// Count a member handled since mark, keeping it if it is among the slowest
+void stats_member(const char * name, off_t size, stats_mark_t * mark)
+{
+    stats_mark_t now;
+    uint64_t wall_ns;
+    size_t pos;
 
-        // Open member file
-        member_fd = open(members[i], O_RDONLY);
-        if (member_fd < 0)
+    if (!stats_wanted)
+    {
+        return;
+    }
+    stats_mark(&now);
+    wall_ns = now.wall_ns - mark->wall_ns;
+    pthread_mutex_lock(&stats_lock);
+    stats_members++;
+    pos = stats_slowest_count;
+    while (pos > 0 && stats_slowest[pos - 1].wall_ns < wall_ns)
+    {
+        pos--;
+    }
+    if (pos < STATS_OUTLIERS)
+    {
+        if (stats_slowest_count < STATS_OUTLIERS)
         {
-            fprintf(stderr, "Error opening member file %s: %s\n", members[i], strerror(errno));
-            continue;
+            stats_slowest_count++;
         }
+        memmove(&stats_slowest[pos + 1], &stats_slowest[pos]
+                , (stats_slowest_count - pos - 1) * sizeof(stats_member_t));
+        snprintf(stats_slowest[pos].name, sizeof(stats_slowest[pos].name), "%s", name);
+        stats_slowest[pos].size = size;
+        stats_slowest[pos].wall_ns = wall_ns;
+    }
+    pthread_mutex_unlock(&stats_lock);
+}
 
-        // Get file information using fstat
-        if (fstat(member_fd, &st) < 0)
-        {
-            fprintf(stderr, "Error getting file information for %s: %s\n", members[i], strerror(errno));
-            close(member_fd);
-            continue;
-        }
+// Print the --stats report on stderr; run at exit
+void stats_report(void)
+{
+    static const char * phase_names[PHASE_COUNT] = {
+        "open/stat", "read", "crc", "zlib", "write", "metadata", "io_uring"
+    };
+    stats_mark_t now = { 0, 0 };
+    struct rusage usage;
+    uint64_t calls = 0;
+    double wall;
 
-        write_header(archive_fd, members[i]);
+    if (!stats_wanted)
+    {
+        return;
+    }
+    stats_mark(&now);
+    getrusage(RUSAGE_SELF, &usage);
+    wall = (now.wall_ns - stats_run_start.wall_ns) / 1e9;
+    for (int i = 0; i < PHASE_COUNT; ++i)
+    {
+        calls += stats_phases[i].calls;
+    }
+    fflush(stdout);
+    pthread_mutex_lock(&stats_lock);
 
-        if (verbose)
+    if (stats_json)
+    {
+        fprintf(stderr, "{\"action\":\"%s\",\"wall_s\":%.6f,\"user_s\":%.6f,\"sys_s\":%.6f"
+                ",\"max_rss_kb\":%ld,\"members\":%llu,\"syscalls\":%llu,\"phases\":{"
+                , stats_action, wall, usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6
+                , usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6, usage.ru_maxrss
+                , (unsigned long long) stats_members, (unsigned long long) calls);
+        for (int i = 0; i < PHASE_COUNT; ++i)
         {
-            printf("a - %s\n", members[i]);
+            fprintf(stderr, "%s\"%s\":{\"calls\":%llu,\"bytes\":%llu,\"wall_s\":%.6f,\"cpu_s\":%.6f}"
+                    , i > 0 ? "," : "", phase_names[i], (unsigned long long) stats_phases[i].calls
+                    , (unsigned long long) stats_phases[i].bytes, stats_phases[i].wall_ns / 1e9
+                    , stats_phases[i].cpu_ns / 1e9);
         }
-
-        // Copy file data and calculate CRC
-        while ((bytes_read = read(member_fd, &buffer, sizeof(buffer))) > 0)
+        fprintf(stderr, "},\"slowest\":[");
+        for (size_t i = 0; i < stats_slowest_count; ++i)
         {
-            // Update CRC for this chunk of data
-            crc = crc32(crc, (const Bytef*) buffer, bytes_read);
-            
-            if (write(archive_fd, buffer, bytes_read) != bytes_read)
+            fprintf(stderr, "%s{\"name\":\"", i > 0 ? "," : "");
+            for (const char * ch = stats_slowest[i].name; *ch != '\0'; ++ch)
             {
-                fprintf(stderr, "Error writing data for %s: %s\n", members[i], strerror(errno));
-                break;
+                if (*ch == '"' || *ch == '\\')
+                {
+                    fputc('\\', stderr);
+                    fputc(*ch, stderr);
+                }
+                else if ((unsigned char) *ch < 0x20)
+                {
+                    fprintf(stderr, "\\u%04x", (unsigned char) *ch);
+                }
+                else
+                {
+                    fputc(*ch, stderr);
+                }
             }
+            fprintf(stderr, "\",\"bytes\":%lld,\"wall_s\":%.6f}", (long long) stats_slowest[i].size
+                    , stats_slowest[i].wall_ns / 1e9);
         }
-
-        // Write footer with CRC
-        write_footer(archive_fd, crc, st.st_size);
-
-        // Close member file
-        close(member_fd);
+        fprintf(stderr, "]}\n");
     }
-
-    /*
-    // Close archive file if it's not stdout
-    if (archive_fd != STDOUT_FILENO)
+    else
     {
-        close(archive_fd);
+        fprintf(stderr, "arvik %s: %.3f s wall, %.3f s user, %.3f s system, %ld KiB peak RSS\n"
+                , stats_action, wall, usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6
+                , usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6, usage.ru_maxrss);
+        fprintf(stderr, "  %llu members, %llu system calls counted\n"
+                , (unsigned long long) stats_members, (unsigned long long) calls);
+        fprintf(stderr, "  %-10s %12s %14s %10s %10s %10s\n", "phase", "calls", "bytes", "wall s", "cpu s", "MB/s");
+        for (int i = 0; i < PHASE_COUNT; ++i)
+        {
+            stats_counter_t * counter = &stats_phases[i];
+
+            if (counter->calls == 0)
+            {
+                continue;
+            }
+            fprintf(stderr, "  %-10s %12llu %14llu %10.3f %10.3f", phase_names[i]
+                    , (unsigned long long) counter->calls, (unsigned long long) counter->bytes
+                    , counter->wall_ns / 1e9, counter->cpu_ns / 1e9);
+            if (counter->bytes > 0 && counter->wall_ns > 0)
+            {
+                fprintf(stderr, " %10.1f", counter->bytes / 1048576.0 / (counter->wall_ns / 1e9));
+            }
+            fputc('\n', stderr);
+        }
+        fprintf(stderr, "  (phase times add up over threads)\n");
+        if (stats_slowest_count > 0)
+        {
+            fprintf(stderr, "  slowest members:\n");
+        }
+        for (size_t i = 0; i < stats_slowest_count; ++i)
+        {
+            fprintf(stderr, "  %10.3f s %14lld  %s\n", stats_slowest[i].wall_ns / 1e9
+                    , (long long) stats_slowest[i].size, stats_slowest[i].name);
+        }
     }
-    */
-    close (archive_fd);
+    pthread_mutex_unlock(&stats_lock);
 }
 
-// Write file header to archive
-void write_header(int archive_fd, char * filename)
+// System calls counted for --stats. With it off they cost one test.
+ssize_t stats_read(int fd, void * buffer, size_t len)
 {
-    arvik_header_t header; // Header struct
-    char temp_buf[32];
-    size_t len;
-    size_t name_len;
-    ssize_t bytes_written;
-    struct stat st; // File statistics
-    // Initialize header with zeros
-    memset(&header, ' ', sizeof(header));
+    stats_mark_t mark;
+    ssize_t result;
 
-    // Get file info
-    if (stat(filename, &st) < 0)
-    {  
-        perror("Error getting file information");
-        return;
-    }
+    stats_mark(&mark);
+    result = read(fd, buffer, len);
+    stats_add(PHASE_READ, &mark, result > 0 ? result : 0, 1);
+    return result;
+}
 
-    // Copy filename and add '/' terminator
-    name_len = strlen(filename);
-    memcpy(header.arvik_name, filename, MIN(name_len, sizeof(header.arvik_name) - 1));
-    if (name_len < sizeof(header.arvik_name)) {
-        header.arvik_name[name_len]  = '/';
-    } else {
-        header.arvik_name[sizeof(header.arvik_name) - 1] = '/';
-    }
+ssize_t stats_pread(int fd, void * buffer, size_t len, off_t offset)
+{
+    stats_mark_t mark;
+    ssize_t result;
 
-    // Format the numeric fields with proper right alignment
-    // and ensure they're space-padded
+    stats_mark(&mark);
+    result = pread(fd, buffer, len, offset);
+    stats_add(PHASE_READ, &mark, result > 0 ? result : 0, 1);
+    return result;
+}
 
-    // Date field
+ssize_t stats_write(int fd, const void * buffer, size_t len)
+{
+    stats_mark_t mark;
+    ssize_t result;
 
-    sprintf(temp_buf, "%ld", st.st_mtime);
-    len = strlen(temp_buf);
-    memcpy(header.arvik_date, temp_buf, len);
+    stats_mark(&mark);
+    result = write(fd, buffer, len);
+    stats_add(PHASE_WRITE, &mark, result > 0 ? result : 0, 1);
+    return result;
+}
 
-    // UID field
-    sprintf(temp_buf, "%d", st.st_uid);
-    len = strlen(temp_buf);
-    memcpy(header.arvik_uid, temp_buf, len);
+ssize_t stats_pwrite(int fd, const void * buffer, size_t len, off_t offset)
+{
+    stats_mark_t mark;
+    ssize_t result;
 
-    // GID field
-    sprintf(temp_buf, "%d", st.st_gid);
-    len = strlen(temp_buf);
-    memcpy(header.arvik_gid, temp_buf, len);
+    stats_mark(&mark);
+    result = pwrite(fd, buffer, len, offset);
+    stats_add(PHASE_WRITE, &mark, result > 0 ? result : 0, 1);
+    return result;
+}
 
-    // Mode field
-    sprintf(temp_buf, "%o", st.st_mode);
-    len = strlen(temp_buf);
-    memcpy(header.arvik_mode, temp_buf, len);
+int stats_open(const char * name, int flags, mode_t mode)
+{
+    stats_mark_t mark;
+    int fd;
 
-    // Size field
-    sprintf(temp_buf, "%ld", st.st_size);
-    len = strlen(temp_buf);
-    memcpy(header.arvik_size, temp_buf, len);
+    stats_mark(&mark);
+    fd = open(name, flags, mode);
+    stats_add(PHASE_OPEN, &mark, 0, 1);
+    return fd;
+}
 
-    // Set terminator
-    header.arvik_term[0] = '+';
-    header.arvik_term[1] = '\n';
+int stats_fstat(int fd, struct stat * st)
+{
+    stats_mark_t mark;
+    int result;
 
-    // Write the entire header struct to the archive file at once
-    bytes_written = write(archive_fd, &header, sizeof(header));
-    if (bytes_written != sizeof(header))
-    {
-        perror("Error writing header");
-    }
+    stats_mark(&mark);
+    result = fstat(fd, st);
+    stats_add(PHASE_OPEN, &mark, 0, 1);
+    return result;
 }
-/*
-    // Fill in header fields
-    name_len = strlen(filename);
-    memcpy(header.arvik_name, filename, MIN(name_len, sizeof(header.arvik_name) -1));
-    header.arvik_name[name_len] = ARVIK_NAME_TERM;
-
-    sprintf(date_buff, "%ld", st.st_mtime);
-    date_len = strlen(date_buff);
-    memcpy(header.arvik_date + sizeof(header.arvik_date) - date_len -1, date_buff, date_len);
 
-    sprintf(uid_buf, "%d", st.st_uid);
-    uid_len = strlen(uid_buf);
-    memcpy(header.arvik_uid + sizeof(header.arvik_uid) - uid_len - 1, 
-           uid_buf, uid_len);
-    
-    // Format GID (right-aligned)
-    sprintf(gid_buf, "%d", st.st_gid);
-    gid_len = strlen(gid_buf);
-    memcpy(header.arvik_gid + sizeof(header.arvik_gid) - gid_len - 1, 
-           gid_buf, gid_len);
-    
-    // Format mode (right-aligned)
-    sprintf(mode_buf, "%o", st.st_mode);
-    mode_len = strlen(mode_buf);
-    memcpy(header.arvik_mode + sizeof(header.arvik_mode) - mode_len - 1, 
-           mode_buf, mode_len);
-    
-    // Format size (right-aligned)
-    sprintf(size_buf, "%ld", st.st_size);
-    size_len = strlen(size_buf);
-    memcpy(header.arvik_size + sizeof(header.arvik_size) - size_len - 1, 
-           size_buf, size_len);
+int stats_close(int fd)
+{
+    stats_mark_t mark;
+    int result;
 
+    stats_mark(&mark);
+    result = close(fd);
+    stats_add(PHASE_OPEN, &mark, 0, 1);
+    return result;
+}
 
-    strncpy(header.arvik_name, filename, sizeof(header.arvik_name) -1);
-    sprintf(header.arvik_date, "%ld", st.st_mtime); // Convert modification time to string
-    sprintf(header.arvik_uid, "%d", st.st_uid);  // Convert UID to string
-    sprintf(header.arvik_gid, "%d", st.st_gid); // Convert GID to string
-    sprintf(header.arvik_mode, "%o", st.st_mode); // Convert mode to octal string
-    sprintf(header.arvik_size, "%ld", st.st_size); // Convert size to string
-    // Set terminator
-    header.arvik_term[0] = '+';
-    header.arvik_term[1] = '\n';
+// Allocate a page-aligned buffer, as O_DIRECT needs; release with free()
+void * io_alloc(size_t len)
+{
+    void * buffer;
 
-    // Write the header to the archive
-    if (write(archive_fd, &header, sizeof(header)) != sizeof(header))
+    if (posix_memalign(&buffer, sysconf(_SC_PAGESIZE), len) != 0)
     {
-        perror("Error writing header");
+        return NULL;
     }
-    */
+    return buffer;
+}
 
-// Write file footer to archive
-void write_footer(int archive_fd, uLong crc, off_t file_size)
+// Parse a block size such as 65536, 64K or 4M
+int parse_size(const char * text, size_t * size)
 {
-    arvik_footer_t footer;
-    char temp[11];
-    
-    // Init footer with zeros
-    memset(&footer, ' ', sizeof(footer));
+    char * end;
+    unsigned long long value = strtoull(text, &end, 10);
 
-    // Fill in footer fields
-    snprintf(temp, sizeof(temp), "0x%08lx", crc); // Convert CRC to hex string
-    memcpy(footer.arvik_data_crc, temp, 10);
-
-    // Set Terminator
-    footer.arvik_term[0] = '+';
-    footer.arvik_term[1] = '\n';
-    if (file_size % 2 != 0)
+    switch (*end)
     {
-        char padding = '\n';
-        write(archive_fd, &padding, 1);
+        case 'G': case 'g':
+            value *= 1024;
+            // fall through
+        case 'M': case 'm':
+            value *= 1024;
+            // fall through
+        case 'K': case 'k':
+            value *= 1024;
+            end++;
+            break;
     }
-
-    // Write footer to archive
-    if (write(archive_fd, &footer, sizeof(footer)) != sizeof(footer))
+    if (*end != '\0' || end == text || value == 0 || value % IO_ALIGN != 0 || value > IO_BLOCK_MAX)
     {
-        perror("Error writing footer");
+        return -1;
     }
+    *size = value;
+    return 0;
 }
 
-// Extract files from archive
-void extract_archive(char * archive_name, int verbose, int validate)
+// Turn on O_DIRECT for an open file. Fails on file systems without it.
+int set_direct(int fd)
 {
-    arvik_header_t header;
-    int archive_fd; // File descriptor for the archive file
-    char buffer[100] = {'\0'};
-    ssize_t bytes_read = 0;
+    int flags = fcntl(fd, F_GETFL);
 
-    if (archive_name == NULL)
+    if (flags < 0 || fcntl(fd, F_SETFL, flags | O_DIRECT) < 0)
     {
-        archive_fd = STDIN_FILENO; // Use standard input
+        return -1;
     }
-    else
+    return 0;
+}
+
+// Tell the kernel we are done with a file's cached pages. Dirty pages are
+// written out first, or they would stay.
+void drop_cache(int fd)
+{
+    fdatasync(fd);
+    posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+}
+
+// Start writing at fd's current offset. With -D on a regular file that
+// takes O_DIRECT, the block containing the offset is read back and staged
+// so the first direct write starts aligned. Elsewhere writes go straight
+// through.
+int io_out_start(io_out_t * out, int fd)
+{
+    struct stat st;
+    off_t off;
+    size_t lead;
+
+    out->fd = fd;
+    out->block = NULL;
+    out->len = 0;
+    out->batch = NULL;
+    out->batch_len = 0;
+    if (!io_direct || fstat(fd, &st) < 0 || !S_ISREG(st.st_mode))
     {
-        archive_fd = open(archive_name, O_RDONLY);
-        if (archive_fd < 0)
-        {
-            perror("Error opening archive file for reading");
-            exit(EXTRACT_FAIL);
-        }
+        return 0;
     }
-        
-    bytes_read = read (archive_fd, buffer, strlen(ARVIK_TAG));
-    if (strncmp(buffer, ARVIK_TAG, strlen(ARVIK_TAG)) != 0)
+    off = lseek(fd, 0, SEEK_CUR);
+    if (off < 0)
     {
-        fprintf(stderr, "Error, not a correct arvik archive file\n");
-        exit(BAD_TAG);
+        return 0;
     }
-    umask(0);
-    while ((bytes_read = read(archive_fd, &header, sizeof(header))) > 0)
+    lead = off % IO_ALIGN;
+    out->block = io_alloc(io_block_size);
+    if (out->block == NULL)
     {
-        extract_file(archive_fd, header, verbose, validate);
+        return -1;
     }
-    
-    /*// Close file if not stdin
-    if (archive_fd != STDIN_FILENO)
+    // Without O_DIRECT (or a way to read the lead back, e.g. a write-only
+    // stdout) write through the cache and drop it at the end
+    if ((lead > 0 && pread(fd, out->block, lead, off - lead) != (ssize_t) lead)
+        || set_direct(fd) < 0)
     {
-        close (archive_fd);
+        free(out->block);
+        out->block = NULL;
+        return 0;
     }
-    */
-    if (bytes_read < 0)
+    if (lseek(fd, off - lead, SEEK_SET) < 0)
     {
-        fprintf(stderr, "Error: Failed to read header\n");
-        exit(READ_FAIL);
+        return -1;
     }
+    out->len = lead;
+    return 0;
+}
 
-    close (archive_fd);
+// Output that goes nowhere, for restoring data only to checksum it
+void io_out_discard(io_out_t * out)
+{
+    out->fd = -1;
+    out->block = NULL;
+    out->len = 0;
+    out->batch = NULL;
+    out->batch_len = 0;
 }
 
-// Extract single file from archive
-void extract_file(int archive_fd, arvik_header_t header, int verbose, int validate)
+// Write len bytes. Returns -1 on error.
+int io_out_write(io_out_t * out, const void * data, size_t len)
 {
-    int file_fd; // File descriptor for the extracted file
-    size_t file_size; //size of file
-    char buffer[4096] = {'\0'}; //buffer for reading file data
-    ssize_t bytes_read; //number of bytes read in one op
-    size_t total_bytes_read;
-    uLong crc = crc32(0L, Z_NULL, 0); //init CRC
-    arvik_footer_t footer; // Footer struct
-    time_t mtime; // For setting file times
-    mode_t mode;    // file mode
-    int has_padding = 0;
-    struct utimbuf times;
+    const char * bytes = data;
 
-    if (header.arvik_term[0] != '+' || header.arvik_term[1] != '\n')
+    if (out->fd < 0)
     {
-        fprintf(stderr, "Error: Header terminator invalid - assuming data corruption\n");
-        exit(CRC_DATA_ERROR);
+        return 0;
     }
-
-    // convert size string to num
-    file_size = strtol(header.arvik_size, NULL, 10);
-    
-    if (file_size % 2 != 0)
-        has_padding = 1;
-
-    // open output file
+    if (out->block == NULL)
     {
-        char *ch = strchr(header.arvik_name, '/');
+        struct iovec iov[2];
 
-        if (ch) {
-            *ch = '\0';
+        if (len < OUT_SMALL && out->batch_len + len <= OUT_BATCH)
+        {
+            if (out->batch == NULL && (out->batch = malloc(OUT_BATCH)) == NULL)
+            {
+                return -1;
+            }
+            memcpy(out->batch + out->batch_len, data, len);
+            out->batch_len += len;
+            return 0;
         }
+        // A large write takes what is batched along with it
+        iov[0].iov_base = out->batch;
+        iov[0].iov_len = out->batch_len;
+        iov[1].iov_base = (void *) data;
+        iov[1].iov_len = len;
+        out->batch_len = 0;
+        return iov[0].iov_len > 0 ? write_vec(out->fd, iov, 2) : write_vec(out->fd, iov + 1, 1);
     }
-    fprintf(stderr, "%d: >>%s<<\n", __LINE__, header.arvik_name);
-    file_fd = open(header.arvik_name, O_WRONLY | O_CREAT | O_TRUNC, 0644);
-    if (file_fd < 0)
+    while (len > 0)
     {
-        fprintf(stderr, "Error creating file %s: %s\n", header.arvik_name, strerror(errno));
+        size_t part = MIN(io_block_size - out->len, len);
 
-        // skip file data
-        if (lseek(archive_fd, file_size, SEEK_CUR) < 0)
+        memcpy(out->block + out->len, bytes, part);
+        out->len += part;
+        bytes += part;
+        len -= part;
+        if (out->len == io_block_size)
         {
-            perror("Error skipping file data");
-            exit(READ_FAIL);
+            if (stats_write(out->fd, out->block, io_block_size) != (ssize_t) io_block_size)
+            {
+                return -1;
+            }
+            out->len = 0;
         }
+    }
+    return 0;
+}
+
+// Write any staged tail. O_DIRECT cannot write a partial block, so it is
+// switched off first; with -D the cached tail is then dropped.
+int io_out_finish(io_out_t * out)
+{
+    int result = io_out_flush(out);
+
+    free(out->batch);
+    out->batch = NULL;
+    if (out->block != NULL)
+    {
+        int flags = fcntl(out->fd, F_GETFL);
 
-        // skip footer
-        if (lseek(archive_fd, sizeof(arvik_footer_t), SEEK_CUR) < 0)
+        if (flags < 0 || fcntl(out->fd, F_SETFL, flags & ~O_DIRECT) < 0
+            || (out->len > 0 && stats_write(out->fd, out->block, out->len) != (ssize_t) out->len))
         {
-            perror("Error skipping footer");
-            exit(READ_FAIL);
+            result = -1;
         }
-        return;
+        free(out->block);
+        out->block = NULL;
+        out->len = 0;
     }
-
-    // Verbose check
-    if (verbose)
+    if (io_direct && result == 0 && out->fd >= 0)
     {
-        printf("x - %s\n", header.arvik_name);
+        drop_cache(out->fd);
     }
+    return result;
+}
 
-    // Copy file data
-    total_bytes_read = 0;
-    while (total_bytes_read < file_size)
-    {
-        size_t to_read = MIN(sizeof(buffer), file_size - total_bytes_read);
-        bytes_read = read(archive_fd, buffer, to_read);
+// Leave a hole of len bytes in sequential output. The file is extended
+// over it at once, since output never goes back. O_DIRECT output can only
+// skip whole blocks, so the staged block is filled with zeros first.
+int io_out_hole(io_out_t * out, off_t len)
+{
+    static const char zeros[IO_ALIGN];
+    off_t off;
 
-        if (bytes_read <= 0)
+    if (out->fd < 0)
+    {
+        return 0;
+    }
+    if (out->block == NULL)
+    {
+        if (io_out_flush(out) < 0)
         {
-            fprintf(stderr, "Error reading file data for %s: %s\n", header.arvik_name, strerror(errno));
-            close(file_fd);
-            exit(READ_FAIL);
+            return -1;
         }
+        off = lseek(out->fd, len, SEEK_CUR);
+        return off < 0 || ftruncate(out->fd, off) < 0 ? -1 : 0;
+    }
+    while (len > 0 && (out->len > 0 || len < (off_t) io_block_size))
+    {
+        size_t part = MIN((off_t) sizeof(zeros), len);
 
-        // update CRC
-        crc = crc32(crc, (const Bytef*) buffer, bytes_read);
-        // write data to output file
-        if (write(file_fd, buffer, bytes_read) != bytes_read)
+        if (io_out_write(out, zeros, part) < 0)
         {
-            fprintf(stderr, "Error writing data to %s: %s\n", header.arvik_name, strerror(errno));
-            close(file_fd);
-            exit(EXTRACT_FAIL);
+            return -1;
         }
-        
-        total_bytes_read += bytes_read;
+        len -= part;
     }
-    if(has_padding == 1)
+    if (len > 0)
     {
-        char padding;
-        if(read(archive_fd, &padding, 1) != 1)
+        off_t skip = len - len % io_block_size;
+
+        off = lseek(out->fd, skip, SEEK_CUR);
+        if (off < 0 || ftruncate(out->fd, off) < 0)
         {
-            fprintf(stderr, "Error reading padding bytes for %s\n", header.arvik_name);
+            return -1;
         }
+        return io_out_hole(out, len - skip);
     }
+    return 0;
+}
 
-    //close(file_fd);
-    // read footer
-    if (read(archive_fd, &footer, sizeof(footer)) != sizeof(footer))
-    {
-        fprintf(stderr, "Error reading footer for %s: %s\n", header.arvik_name, strerror(errno));
-        close (file_fd);
-        exit(READ_FAIL);
-    }
+// Write out the small-write batch, before the file is used other than
+// through out
+int io_out_flush(io_out_t * out)
+{
+    struct iovec iov;
 
-    if (footer.arvik_term [0] != '+' || footer.arvik_term[1] != '\n')
+    if (out->batch_len == 0)
     {
-        fprintf(stderr, "Error: Footer terminator invalid - assuming data corruption\n");
-        close(file_fd);
-        exit(CRC_DATA_ERROR);
+        return 0;
     }
+    iov.iov_base = out->batch;
+    iov.iov_len = out->batch_len;
+    out->batch_len = 0;
+    return write_vec(out->fd, &iov, 1);
+}
 
-    // validate CRC if req
-    if (validate)
+// Archive offset of the next byte written through out, or -1 on a pipe
+off_t io_out_tell(io_out_t * out)
+{
+    off_t off = lseek(out->fd, 0, SEEK_CUR);
+
+    return off < 0 ? -1 : off + (off_t) (out->batch_len + out->len);
+}
+
+// writev() all of it, picking up after short writes. Returns -1 on error.
+int write_vec(int fd, struct iovec * iov, int count)
+{
+    while (count > 0)
     {
-        uLong stored_crc;
-        if (sscanf(footer.arvik_data_crc, "0x%lx", &stored_crc) != 1)
+        size_t len = 0;
+        ssize_t written;
+        stats_mark_t mark;
+
+        for (int i = 0; i < count; ++i)
         {
-            fprintf(stderr, "Error parsing CRC value\n");
-            close(file_fd);
-            exit(CRC_DATA_ERROR);
+            len += iov[i].iov_len;
         }
-
-        if (crc != stored_crc)
+        stats_mark(&mark);
+        written = writev(fd, iov, count);
+        stats_add(PHASE_WRITE, &mark, written > 0 ? written : 0, 1);
+        if (written < 0 && errno == EINTR)
         {
-            fprintf(stderr, "CRC check failed for %s\n", header.arvik_name);
-            close(file_fd);
-            exit(CRC_DATA_ERROR);
+            continue;
         }
-        else if (verbose)
+        if (written <= 0)
+        {
+            return -1;
+        }
+        if ((size_t) written == len)
         {
-            printf("CRC check passed for %s\n", header.arvik_name);
+            return 0;
         }
+        while ((size_t) written >= iov->iov_len)
+        {
+            written -= iov->iov_len;
+            iov++;
+            count--;
+        }
+        iov->iov_base = (char *) iov->iov_base + written;
+        iov->iov_len -= written;
     }
+    return 0;
+}
 
-    // set file perms
-    mode = strtol(header.arvik_mode, NULL, 8); // convert octal str to num
-    if (fchmod(file_fd, mode) < 0)
+// Set up an io_uring instance. Returns -1, leaving nothing behind, if the
+// kernel lacks io_uring or any of the operations we use.
+int uring_init(uring_t * ring, unsigned entries)
+{
+    static const uint8_t needed[] = { IORING_OP_OPENAT, IORING_OP_STATX, IORING_OP_READ, IORING_OP_WRITE
+                                      , IORING_OP_CLOSE };
+    struct io_uring_params params;
+    struct io_uring_probe * probe;
+    size_t probe_size = sizeof(*probe) + IORING_OP_LAST * sizeof(struct io_uring_probe_op);
+    char * base;
+    int supported = 1;
+
+    memset(ring, 0, sizeof(*ring));
+    memset(&params, 0, sizeof(params));
+    ring->fd = syscall(__NR_io_uring_setup, entries, &params);
+    if (ring->fd < 0)
     {
-        fprintf(stderr, "Error setting permissions for %s: %s\n", header.arvik_name, strerror(errno));
+        return -1;
+    }
+    probe = calloc(1, probe_size);
+    if (probe == NULL || !(params.features & IORING_FEAT_SINGLE_MMAP)
+        || syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_PROBE, probe, IORING_OP_LAST) < 0)
+    {
+        supported = 0;
+    }
+    for (size_t i = 0; i < sizeof(needed) && supported; ++i)
+    {
+        supported = needed[i] <= probe->last_op && (probe->ops[needed[i]].flags & IO_URING_OP_SUPPORTED);
+    }
+    free(probe);
+    if (!supported)
+    {
+        close(ring->fd);
+        return -1;
     }
 
-    mtime = strtol(header.arvik_date, NULL, 10);
-    times.actime = time(NULL);
-    times.modtime = mtime;
-
-    // close output
-    close(file_fd);
-    if (utime(header.arvik_name, & times) < 0)
+    ring->entries = params.sq_entries;
+    ring->ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    if (ring->ring_size < params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe))
+    {
+        ring->ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    }
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->ring = mmap(NULL, ring->ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd
+                      , IORING_OFF_SQ_RING);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd
+                      , IORING_OFF_SQES);
+    if (ring->ring == MAP_FAILED || ring->sqes == MAP_FAILED)
     {
-        fprintf(stderr, "Error setting file times for %s: %s\n", header.arvik_name, strerror(errno));
+        if (ring->ring != MAP_FAILED)
+        {
+            munmap(ring->ring, ring->ring_size);
+        }
+        close(ring->fd);
+        return -1;
     }
+    base = ring->ring;
+    ring->sq_head = (unsigned *) (base + params.sq_off.head);
+    ring->sq_tail = (unsigned *) (base + params.sq_off.tail);
+    ring->sq_mask = (unsigned *) (base + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned *) (base + params.sq_off.array);
+    ring->cq_head = (unsigned *) (base + params.cq_off.head);
+    ring->cq_tail = (unsigned *) (base + params.cq_off.tail);
+    ring->cq_mask = (unsigned *) (base + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *) (base + params.cq_off.cqes);
+    return 0;
+}
+
+void uring_exit(uring_t * ring)
+{
+    munmap(ring->sqes, ring->sqes_size);
+    munmap(ring->ring, ring->ring_size);
+    close(ring->fd);
 }
 
+// Queue an operation on fd. Its result goes to results[index] in the
+// next uring_run().
+struct io_uring_sqe * uring_sqe(uring_t * ring, uint8_t opcode, int fd, unsigned index)
+{
+    unsigned slot = (*ring->sq_tail + ring->queued) & *ring->sq_mask;
+    struct io_uring_sqe * sqe = &ring->sqes[slot];
+
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = opcode;
+    sqe->fd = fd;
+    sqe->user_data = index;
+    ring->sq_array[slot] = slot;
+    ring->queued++;
+    return sqe;
+}
 
-// List contents of an archive
-void list_archive(char * archive_name, int verbose, int validate)
+// Submit everything queued and wait for all of it. Each result, a count
+// or a negative errno, lands in results[] at the index it was queued with.
+// Returns -1 if io_uring itself fails.
+int uring_run(uring_t * ring, int * results)
 {
-    int archive_fd = STDIN_FILENO;
-    char buffer[100] = {'\0'};
-    ssize_t bytes_read;
+    unsigned to_submit = ring->queued;
+    unsigned waiting = ring->queued;
 
-    if (archive_name != NULL)
+    __atomic_store_n(ring->sq_tail, *ring->sq_tail + ring->queued, __ATOMIC_RELEASE);
+    ring->queued = 0;
+    while (waiting > 0)
     {
-        archive_fd = open(archive_name, O_RDONLY);
-        if (archive_fd < 0)
+        unsigned head = *ring->cq_head;
+        unsigned tail;
+        stats_mark_t mark;
+        long submitted;
+
+        stats_mark(&mark);
+        submitted = syscall(__NR_io_uring_enter, ring->fd, to_submit, waiting, IORING_ENTER_GETEVENTS, NULL, 0);
+        stats_add(PHASE_URING, &mark, 0, 1);
+
+        if (submitted < 0)
         {
-            perror("Error opening archive file for reading");
-            exit(TOC_FAIL);
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            return -1;
+        }
+        to_submit -= submitted;
+        tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+        while (head != tail)
+        {
+            struct io_uring_cqe * cqe = &ring->cqes[head & *ring->cq_mask];
+
+            results[cqe->user_data] = cqe->res;
+            head++;
+            waiting--;
         }
+        __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
     }
+    return 0;
+}
 
-    // check if file has correct tag
-    bytes_read = read (archive_fd, buffer, strlen(ARVIK_TAG));
-    if (bytes_read != strlen(ARVIK_TAG) || strncmp(buffer, ARVIK_TAG, strlen(ARVIK_TAG)) != 0)
+// The parts of a statx result that build_header() and friends look at
+void statx_to_stat(const struct statx * stx, struct stat * st)
+{
+    memset(st, 0, sizeof(*st));
+    st->st_dev = makedev(stx->stx_dev_major, stx->stx_dev_minor);
+    st->st_ino = stx->stx_ino;
+    st->st_mode = stx->stx_mode;
+    st->st_nlink = stx->stx_nlink;
+    st->st_uid = stx->stx_uid;
+    st->st_gid = stx->stx_gid;
+    st->st_size = stx->stx_size;
+    st->st_blocks = stx->stx_blocks;
+    st->st_atime = stx->stx_atime.tv_sec;
+    st->st_mtime = stx->stx_mtime.tv_sec;
+    st->st_ctime = stx->stx_ctime.tv_sec;
+}
+
+// Start reading fd from its current offset
+int reader_open(archive_reader_t * in, int fd)
+{
+    memset(in, 0, sizeof(*in));
+    in->fd = fd;
+    in->offset = lseek(fd, 0, SEEK_CUR);
+    in->seekable = in->offset >= 0;
+    if (!in->seekable)
     {
-        fprintf(stderr, "Error, not a correct arvik archive file\n");
-        exit(BAD_TAG);
+        in->offset = 0;
     }
+    in->owned = io_alloc(io_block_size);
+    in->buffer = in->owned;
+    return in->owned == NULL ? -1 : 0;
+}
 
-    process_archive(archive_fd, verbose, 0, validate);
+// Take the rest of the archive from a mapping of the whole file
+void reader_use_map(archive_reader_t * in, const char * map, off_t map_size)
+{
+    in->buffer = map;
+    in->pos = in->offset;
+    in->len = map_size;
+    in->mapped = 1;
+}
 
-    // close if not stdin
-    if (archive_name != NULL)
+void reader_close(archive_reader_t * in)
+{
+    free(in->owned);
+    in->owned = NULL;
+}
+
+// Refill the buffer once it is drained. Returns the bytes buffered, 0 at
+// the end of the input, -1 on error.
+ssize_t reader_fill(archive_reader_t * in)
+{
+    ssize_t bytes_read;
+
+    if (in->pos < in->len || in->mapped)
     {
-        close (archive_fd);
+        return in->len - in->pos;
     }
+    bytes_read = stats_read(in->fd, in->owned, io_block_size);
+    if (bytes_read < 0)
+    {
+        return -1;
+    }
+    in->pos = 0;
+    in->len = bytes_read;
+    return bytes_read;
 }
 
+// Consume up to max bytes and point data at them in the buffer
+ssize_t reader_next(archive_reader_t * in, const char ** data, size_t max)
+{
+    ssize_t avail = reader_fill(in);
 
-// Print information about a file in the archive
-
+    if (avail <= 0)
+    {
+        return avail;
+    }
+    avail = MIN((size_t) avail, max);
+    *data = in->buffer + in->pos;
+    in->pos += avail;
+    in->offset += avail;
+    return avail;
+}
 
-// proccess archive file and call function for each member
-void process_archive(int archive_fd, int verbose, int extract, int validate)
+// Copy len bytes out. Short only at the end of the input; -1 on error.
+ssize_t reader_read(archive_reader_t * in, void * data, size_t len)
 {
-    size_t file_size;
-    time_t mtime;
-    struct tm *tm_info;
-    char time_str[32];
-    mode_t mode;
-    char mode_str[11];
-    arvik_header_t header;
-    arvik_footer_t footer;
-    char * back_pos = NULL;
-    char buffer[100] = {'\0'};
-    ssize_t bytes_read;
-    (void) extract;
-    (void) validate;
-    // process each file in archive
-    while ((bytes_read = read(archive_fd, &header, sizeof(header))) > 0)
+    size_t total = 0;
+
+    while (total < len)
     {
-        if (bytes_read != sizeof(header))
-        {
-            fprintf(stderr, "Error: Incomplete header read\n");
-            exit(READ_FAIL);
-        }
+        const char * src;
+        ssize_t bytes_read;
 
-        if(header.arvik_term[0] != '+' || header.arvik_term[1] != '\n')
+        // Once the buffer is drained, big reads go straight to the caller
+        if (!in->mapped && in->pos == in->len && len - total >= io_block_size)
         {
-            fprintf(stderr, "Error: Invalid header terminator\n");
-            exit(BAD_TAG);
+            bytes_read = read_full(in->fd, (char *) data + total, len - total);
+            if (bytes_read < 0)
+            {
+                return -1;
+            }
+            in->offset += bytes_read;
+            total += bytes_read;
+            break;
         }
-
-        memset(buffer, 0, 100);
-        strncpy(buffer, header.arvik_name, 16);
-        if ((back_pos = strchr(buffer, '/')))
+        bytes_read = reader_next(in, &src, len - total);
+        if (bytes_read < 0)
         {
-            *back_pos = '\0';
+            return -1;
         }
-
-
-        if(verbose == 1)
+        if (bytes_read == 0)
         {
-            file_size = strtol(header.arvik_size, NULL, 10);
-
-           
-            // conert time string to time_t 
-            mtime = strtol(header.arvik_date, NULL, 10);
-            tm_info = localtime(&mtime);
-            strftime(time_str, sizeof(time_str), "%b %e %R %Y", tm_info);
-
-            // convert mode str to mode_t
-            mode = strtol(header.arvik_mode, NULL, 8);
-
-            // format mode string
-            mode_str[0] = S_ISDIR(mode) ? 'd' : ' ';
-            mode_str[1] = (mode & S_IRUSR) ? 'r' : '-';
-            mode_str[2] = (mode & S_IWUSR) ? 'w' : '-';
-            mode_str[3] = (mode & S_IXUSR) ? 'x' : '-';
-            mode_str[4] = (mode & S_IRGRP) ? 'r' : '-';
-            mode_str[5] = (mode & S_IWGRP) ? 'w' : '-';
-            mode_str[6] = (mode & S_IXGRP) ? 'x' : '-';
-            mode_str[7] = (mode & S_IROTH) ? 'r' : '-';
-            mode_str[8] = (mode & S_IWOTH) ? 'w' : '-';
-            mode_str[9] = (mode & S_IXOTH) ? 'x' : '-';
-            mode_str[10] = '\0';
+            break;
+        }
+        memcpy((char *) data + total, src, bytes_read);
+        total += bytes_read;
+    }
+    return total;
+}
 
-        printf("file name: %s\n", buffer);
-        printf("    mode:      %s\n", mode_str);
-        printf("    uid:             %.6s%s\n", header.arvik_uid, arvik_uname);
-        printf("    gid:              %.6s%s\n", header.arvik_gid, arvik_gname);
-        printf("    size:              %ld  bytes\n", file_size);
-        printf("    mtime:      %s\n", time_str);
+// Move past count bytes, seeking when we can and reading when we cannot
+int reader_skip(archive_reader_t * in, off_t count)
+{
+    off_t buffered = in->len - in->pos;
 
-        lseek(archive_fd, atoi(header.arvik_size) + (atoi(header.arvik_size) % 2 == 0 ? 0 : 1), SEEK_CUR);
-        bytes_read = read(archive_fd, &footer, sizeof(footer));
-        if (bytes_read != sizeof(footer))
+    if (count <= buffered || in->mapped)
+    {
+        if (count > buffered)
         {
-            fprintf(stderr, "Error reading footer\n");
-            exit(READ_FAIL);
+            return -1; // past the end of the mapping
         }
-        if (footer.arvik_term[0] != '+' || footer.arvik_term[1] != '\n')
+        in->pos += count;
+        in->offset += count;
+        return 0;
+    }
+    in->pos = in->len;
+    in->offset += buffered;
+    count -= buffered;
+    if (in->seekable)
+    {
+        if (lseek(in->fd, count, SEEK_CUR) < 0)
         {
-            fprintf(stderr, "Error reading footer\n");
-            exit(READ_FAIL);
-        }
-        printf("    data csc32: %.10s\n", footer.arvik_data_crc);
+            return -1;
         }
+        in->offset += count;
+        return 0;
+    }
+    while (count > 0)
+    {
+        ssize_t bytes_read = stats_read(in->fd, in->owned, io_block_size);
 
-        else
+        if (bytes_read <= 0)
         {
-            printf("%s\n", buffer);
-            file_size = strtol(header.arvik_size, NULL, 10);
-            lseek(archive_fd, atoi(header.arvik_size) + (atoi(header.arvik_size) % 2 == 0 ? 0 : 1), SEEK_CUR);
+            return -1;
+        }
+        // Keep whatever follows the skipped bytes
+        in->len = bytes_read;
+        in->pos = MIN(bytes_read, count);
+        in->offset += in->pos;
+        count -= in->pos;
+    }
+    return 0;
+}
+
+// Go to an absolute archive offset; the input must be seekable
+int reader_seek(archive_reader_t * in, off_t offset)
+{
+    if (in->mapped)
+    {
+        if (offset > (off_t) in->len)
+        {
+            return -1;
+        }
+        in->pos = offset;
+    }
+    else
+    {
+        if (lseek(in->fd, offset, SEEK_SET) < 0)
+        {
+            return -1;
+        }
+        in->pos = in->len = 0;
+    }
+    in->offset = offset;
+    return 0;
+}
+
+// Create new archive file; returns the exit status
+int create_archive(char * archive_name, char ** members, int member_count, create_options_t * opts)
+{
+    int archive_fd;
+    mode_t old_mask;
+
+    // Truncating the archive would also empty a --base that is the same file
+    if (opts->base != NULL && archive_name != NULL)
+    {
+        struct stat base_st;
+        struct stat archive_st;
+
+        if (stat(opts->base, &base_st) == 0 && stat(archive_name, &archive_st) == 0
+            && base_st.st_dev == archive_st.st_dev && base_st.st_ino == archive_st.st_ino)
+        {
+            fprintf(stderr, "The --base archive cannot be the archive being created\n");
+            return CREATE_FAIL;
+        }
+    }
+
+    // Open the archive file or use stdout if no file is specified
+    if (archive_name == NULL)
+    {
+        archive_fd = STDOUT_FILENO;
+    }
+    else
+    {
+        old_mask = umask(0); // Clear umask temp
+        // -D rereads the partly written first block, see io_out_start()
+        archive_fd = open(archive_name, (io_direct ? O_RDWR : O_WRONLY) | O_CREAT | O_TRUNC, 0644);
+        umask(old_mask); // Restore original umask
+
+        if (archive_fd < 0)
+        {
+            perror("Error opening archive file for writing");
+            return 1;
+        }
+    }
+
+    if (write(archive_fd, ARVIK_TAG, strlen(ARVIK_TAG)) != (ssize_t)strlen(ARVIK_TAG))
+    {
+        perror("Error writing archive tag");
+        close(archive_fd);
+        return 1;
+    }
+
+    // Several writers need a regular file they can pwrite into; otherwise
+    // read members on a helper thread while this thread checksums and writes
+    // Compressed sizes are not known up front, so -z always takes the pipeline,
+    // and so does -D, since O_DIRECT cannot pwrite to unaligned offsets, and
+    // --base, whose reused members keep the size they were stored with,
+    // --dedup, which only knows a member's size once it has seen its content,
+    // and -R, whose members are still being found while the first are written
+    if ((opts->compress || io_direct || opts->base != NULL || opts->dedup || opts->recursive || opts->jobs < 2
+         || create_parallel(archive_fd, archive_name, members, member_count, opts) < 0)
+        && create_pipeline(archive_fd, strlen(ARVIK_TAG), members, member_count, opts, NULL) < 0)
+    {
+        // As create_parallel() does: no archive rather than a damaged one
+        if (archive_name != NULL)
+        {
+            unlink(archive_name);
+        }
+        close(archive_fd);
+        return CREATE_FAIL;
+    }
+
+    /*
+    // Close archive file if it's not stdout
+    if (archive_fd != STDOUT_FILENO)
+    {
+        close(archive_fd);
+    }
+    */
+    close (archive_fd);
+    return EXIT_SUCCESS;
+}
+
+// Add members to an existing archive (-r), or only files newer than the
+// member they replace (-u). New data is appended, and a replaced member is
+// renamed to ARVIK_DELETED_NAME in place once its successor is written, so
+// the work is proportional to the new data. A trailing index is cut off
+// first and written again last, covering the members that remain.
+void update_archive(char * archive_name, char ** members, int member_count, create_options_t * opts)
+{
+    int archive_fd;
+    char tag[sizeof(ARVIK_TAG)] = {'\0'};
+    struct stat st;
+    arvik_index_t list = { NULL, 0, 0 }; // live members, in archive order
+    off_t end; // where new members go
+    int had_index = 0;
+    char ** added; // members to append
+    int added_count = 0;
+    char * retire; // for each member already in list: a new file replaces it
+    size_t old_count;
+    size_t kept = 0;
+    create_options_t append_opts = *opts;
+    int failed = 0; // some new member was not written in full
+    tree_walk_t walk;
+
+    if (archive_name == NULL)
+    {
+        fprintf(stderr, "Adding to an archive needs its name (-f)\n");
+        exit(NO_ARCHIVE_NAME);
+    }
+    archive_fd = open(archive_name, O_RDWR);
+    if (archive_fd < 0 && errno == ENOENT)
+    {
+        int status = create_archive(archive_name, members, member_count, opts);
+
+        if (status != EXIT_SUCCESS)
+        {
+            exit(status);
+        }
+        return;
+    }
+    if (archive_fd < 0 || fstat(archive_fd, &st) < 0)
+    {
+        perror("Error opening archive file for update");
+        exit(CREATE_FAIL);
+    }
+    if (!S_ISREG(st.st_mode) || pread(archive_fd, tag, strlen(ARVIK_TAG), 0) != (ssize_t) strlen(ARVIK_TAG)
+        || strcmp(tag, ARVIK_TAG) != 0)
+    {
+        fprintf(stderr, "Error, not a correct arvik archive file\n");
+        exit(BAD_TAG);
+    }
+    end = find_members(archive_fd, st.st_size, &list, &had_index);
+    if (end < 0)
+    {
+        fprintf(stderr, "Error: archive is damaged, not updating it\n");
+        exit(READ_FAIL);
+    }
+    old_count = list.count;
+
+    // Which members are replaced depends on all of them, so -R walks first
+    if (opts->recursive)
+    {
+        walk_start(&walk, members, member_count, opts->jobs ? opts->jobs : (int) sysconf(_SC_NPROCESSORS_ONLN));
+        members = walk.members;
+        member_count = walk_wait(&walk, SIZE_MAX);
+        append_opts.recursive = 0;
+    }
+
+    added = malloc((member_count + 1) * sizeof(char *));
+    retire = calloc(old_count + 1, 1);
+    if (added == NULL || retire == NULL)
+    {
+        perror("Error allocating member list");
+        exit(CREATE_FAIL);
+    }
+    for (int i = 0; i < member_count; ++i)
+    {
+        arvik_header_t header;
+        struct stat member_st;
+        int newer = 1;
+
+        if (stat(members[i], &member_st) < 0)
+        {
+            fprintf(stderr, "Error getting file information for %s: %s\n", members[i], strerror(errno));
+            continue;
+        }
+        // Compare names as they would be stored, truncation included
+        build_header(&header, members[i], &member_st);
+        for (size_t j = 0; j < old_count && opts->update == UPDATE_NEWER; ++j)
+        {
+            arvik_header_t * old = &list.entries[j].arvik_header;
+
+            if (memcmp(old->arvik_name, header.arvik_name, sizeof(header.arvik_name)) == 0
+                && member_st.st_mtime <= field_value(old->arvik_date, sizeof(old->arvik_date), 10))
+            {
+                newer = 0;
+            }
+        }
+        if (!newer)
+        {
+            continue;
+        }
+        for (size_t j = 0; j < old_count; ++j)
+        {
+            if (memcmp(list.entries[j].arvik_header.arvik_name, header.arvik_name, sizeof(header.arvik_name)) == 0)
+            {
+                retire[j] = 1;
+            }
+        }
+        added[added_count++] = members[i];
+    }
+
+    if (added_count > 0)
+    {
+        // Drop the old index; the new one goes after the new members
+        if (ftruncate(archive_fd, end) < 0 || lseek(archive_fd, end, SEEK_SET) < 0)
+        {
+            perror("Error preparing archive for update");
+            exit(CREATE_FAIL);
+        }
+        append_opts.write_index = 0;
+        if (create_pipeline(archive_fd, end, added, added_count, &append_opts, &list) < 0)
+        {
+            // Cut the new members off again and keep every old one
+            failed = 1;
+            list.count = old_count;
+            memset(retire, 0, old_count);
+            if (ftruncate(archive_fd, end) < 0 || lseek(archive_fd, end, SEEK_SET) < 0)
+            {
+                perror("Error restoring archive after failed update");
+                exit(CREATE_FAIL);
+            }
+        }
+
+        // Only now that the new copies are in, retire the old ones. A file
+        // that could not be read after all leaves its old copy alone.
+        for (size_t j = 0; j < list.count; ++j)
+        {
+            arvik_index_entry_t * entry = &list.entries[j];
+            int replaced = 0;
+
+            for (size_t k = old_count; j < old_count && retire[j] && k < list.count && !replaced; ++k)
+            {
+                replaced = memcmp(list.entries[k].arvik_header.arvik_name, entry->arvik_header.arvik_name
+                                  , sizeof(entry->arvik_header.arvik_name)) == 0;
+            }
+            if (replaced)
+            {
+                char name[sizeof(entry->arvik_header.arvik_name)];
+                off_t header_off = field_value(entry->arvik_data_off, sizeof(entry->arvik_data_off), 10)
+                                   - sizeof(arvik_header_t);
+                arvik_index_entry_t * record = kept > 0 ? &list.entries[kept - 1] : NULL;
+
+                memset(name, ' ', sizeof(name));
+                memcpy(name, ARVIK_DELETED_NAME "/", strlen(ARVIK_DELETED_NAME) + 1);
+                if (pwrite(archive_fd, name, sizeof(name), header_off) != sizeof(name))
+                {
+                    perror("Error removing replaced member");
+                    exit(CREATE_FAIL);
+                }
+
+                // A long name record right before it goes too
+                if (record != NULL && is_long_name_member(&record->arvik_header))
+                {
+                    off_t record_off = field_value(record->arvik_data_off, sizeof(record->arvik_data_off), 10);
+                    off_t len = field_value(record->arvik_header.arvik_size, sizeof(record->arvik_header.arvik_size)
+                                            , 10);
+
+                    if (record_off + len + (len % 2) + (off_t) sizeof(arvik_footer_t) == header_off)
+                    {
+                        if (pwrite(archive_fd, name, sizeof(name), record_off - sizeof(arvik_header_t))
+                            != sizeof(name))
+                        {
+                            perror("Error removing replaced member");
+                            exit(CREATE_FAIL);
+                        }
+                        kept--;
+                    }
+                }
+                continue;
+            }
+            list.entries[kept++] = *entry;
+        }
+        list.count = kept;
+
+        if ((opts->write_index && !failed) || had_index)
+        {
+            off_t index_off = lseek(archive_fd, 0, SEEK_CUR);
+            io_out_t out;
+
+            if (io_out_start(&out, archive_fd) < 0)
+            {
+                perror("Error setting up archive output");
+                exit(CREATE_FAIL);
+            }
+            write_index_member(&out, &list, index_off, opts->csum);
+            if (io_out_finish(&out) < 0)
+            {
+                perror("Error writing member index");
+                exit(CREATE_FAIL);
+            }
+        }
+    }
+    free(list.entries);
+    free(added);
+    free(retire);
+    if (opts->recursive)
+    {
+        walk_finish(&walk);
+    }
+    close(archive_fd);
+    if (failed)
+    {
+        exit(CREATE_FAIL);
+    }
+}
+
+// Create the archive as --shards separate archives and a manifest. Members
+// go heaviest first to the shard with the fewest bytes so far, and keep
+// their command-line order within it. Each shard is written by
+// create_pipeline() on a thread of its own.
+void create_shards(char * archive_name, char ** members, int member_count, create_options_t * opts)
+{
+    shard_t * shards;
+    shard_load_t * loads;
+    create_options_t shard_opts = *opts;
+    int shard_count = opts->shards;
+    int * placed; // shard of each member
+    int threads = opts->jobs ? opts->jobs : (int) sysconf(_SC_NPROCESSORS_ONLN);
+    mode_t old_mask;
+    tree_walk_t walk;
+
+    if (archive_name == NULL)
+    {
+        fprintf(stderr, "Writing shards needs the archive name (-f)\n");
+        exit(NO_ARCHIVE_NAME);
+    }
+    if (opts->update)
+    {
+        fprintf(stderr, "--shards only creates archives, it cannot be used with -r, -u, -d or -m\n");
+        exit(INVALID_CMD_OPTION);
+    }
+
+    // Balancing needs every member, so -R walks first
+    if (opts->recursive)
+    {
+        walk_start(&walk, members, member_count, threads);
+        members = walk.members;
+        member_count = walk_wait(&walk, SIZE_MAX);
+        shard_opts.recursive = 0;
+    }
+    // Compression threads are shared out between the shards
+    if (opts->compress && opts->jobs == 0)
+    {
+        shard_opts.jobs = threads > shard_count ? threads / shard_count : 1;
+    }
+
+    shards = calloc(shard_count, sizeof(shard_t));
+    loads = malloc((member_count + 1) * sizeof(shard_load_t));
+    placed = malloc((member_count + 1) * sizeof(int));
+    if (shards == NULL || loads == NULL || placed == NULL)
+    {
+        perror("Error allocating shard list");
+        exit(CREATE_FAIL);
+    }
+    for (int i = 0; i < member_count; ++i)
+    {
+        struct stat st;
+
+        // One that cannot be read is reported when its shard gets to it
+        loads[i].bytes = sizeof(arvik_header_t) + sizeof(arvik_footer_t);
+        if (stat(members[i], &st) == 0 && S_ISREG(st.st_mode))
+        {
+            loads[i].bytes += st.st_size;
+        }
+        loads[i].member = i;
+    }
+    qsort(loads, member_count, sizeof(shard_load_t), compare_loads);
+    for (int i = 0; i < member_count; ++i)
+    {
+        int lightest = 0;
+
+        for (int j = 1; j < shard_count; ++j)
+        {
+            if (shards[j].load < shards[lightest].load)
+            {
+                lightest = j;
+            }
+        }
+        shards[lightest].load += loads[i].bytes;
+        shards[lightest].member_count++;
+        placed[loads[i].member] = lightest;
+    }
+
+    old_mask = umask(0);
+    for (int i = 0; i < shard_count; ++i)
+    {
+        shard_t * shard = &shards[i];
+
+        shard->members = malloc((shard->member_count + 1) * sizeof(char *));
+        shard->name = malloc(strlen(archive_name) + 16);
+        if (shard->members == NULL || shard->name == NULL)
+        {
+            perror("Error allocating shard list");
+            exit(CREATE_FAIL);
+        }
+        shard->member_count = 0;
+        shard->opts = &shard_opts;
+        sprintf(shard->name, "%s.%d", archive_name, i);
+        // Read back for the long names in the manifest
+        shard->fd = open(shard->name, O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if (shard->fd < 0)
+        {
+            fprintf(stderr, "Error opening shard %s for writing: %s\n", shard->name, strerror(errno));
+            exit(CREATE_FAIL);
+        }
+        if (write(shard->fd, ARVIK_TAG, strlen(ARVIK_TAG)) != (ssize_t) strlen(ARVIK_TAG))
+        {
+            fprintf(stderr, "Error writing archive tag to %s: %s\n", shard->name, strerror(errno));
+            exit(CREATE_FAIL);
+        }
+    }
+    umask(old_mask);
+    for (int i = 0; i < member_count; ++i)
+    {
+        shard_t * shard = &shards[placed[i]];
+
+        shard->members[shard->member_count++] = members[i];
+    }
+
+    for (int i = 0; i < shard_count; ++i)
+    {
+        if (pthread_create(&shards[i].thread, NULL, shard_writer, &shards[i]) != 0)
+        {
+            fprintf(stderr, "Error starting shard thread\n");
+            exit(CREATE_FAIL);
+        }
+    }
+    for (int i = 0; i < shard_count; ++i)
+    {
+        pthread_join(shards[i].thread, NULL);
+    }
+    // One damaged shard spoils the set; write none of it
+    for (int i = 0; i < shard_count; ++i)
+    {
+        if (shards[i].failed)
+        {
+            for (int j = 0; j < shard_count; ++j)
+            {
+                unlink(shards[j].name);
+            }
+            exit(CREATE_FAIL);
+        }
+    }
+
+    write_manifest(archive_name, shards, shard_count);
+    for (int i = 0; i < shard_count; ++i)
+    {
+        close(shards[i].fd);
+        free(shards[i].name);
+        free(shards[i].members);
+        free(shards[i].index.entries);
+    }
+    free(shards);
+    free(loads);
+    free(placed);
+    if (opts->recursive)
+    {
+        walk_finish(&walk);
+    }
+}
+
+// Shard thread: write one shard, collecting its index for the manifest
+void * shard_writer(void * arg)
+{
+    shard_t * shard = (shard_t *) arg;
+
+    shard->failed = create_pipeline(shard->fd, strlen(ARVIK_TAG), shard->members, shard->member_count, shard->opts
+                                    , &shard->index) < 0;
+    return NULL;
+}
+
+// Heaviest first, then in command-line order
+int compare_loads(const void * a, const void * b)
+{
+    const shard_load_t * x = (const shard_load_t *) a;
+    const shard_load_t * y = (const shard_load_t *) b;
+
+    if (x->bytes != y->bytes)
+    {
+        return x->bytes < y->bytes ? 1 : -1;
+    }
+    return x->member - y->member;
+}
+
+// Write the manifest from what each shard's index says was written
+void write_manifest(char * archive_name, shard_t * shards, int shard_count)
+{
+    char long_name[ARVIK_PATH_MAX] = {'\0'};
+    char name[ARVIK_PATH_MAX];
+    mode_t old_mask;
+    int fd;
+    FILE * manifest;
+
+    old_mask = umask(0);
+    fd = open(archive_name, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    umask(old_mask);
+    manifest = fd < 0 ? NULL : fdopen(fd, "w");
+    if (manifest == NULL)
+    {
+        perror("Error opening archive file for writing");
+        exit(CREATE_FAIL);
+    }
+
+    fputs(SHARD_TAG, manifest);
+    for (int i = 0; i < shard_count; ++i)
+    {
+        // Named without the directory, so the set can be moved together
+        const char * base = strrchr(shards[i].name, '/');
+
+        fprintf(manifest, "shard %s\n", base != NULL ? base + 1 : shards[i].name);
+    }
+    for (int i = 0; i < shard_count; ++i)
+    {
+        for (size_t j = 0; j < shards[i].index.count; ++j)
+        {
+            arvik_index_entry_t * entry = &shards[i].index.entries[j];
+            off_t header_off = strtoll(entry->arvik_data_off, NULL, 10) - sizeof(arvik_header_t);
+
+            if (is_long_name_member(&entry->arvik_header))
+            {
+                entry_long_name(shards[i].fd, entry, long_name);
+                continue;
+            }
+            if (!is_hidden_member(&entry->arvik_header))
+            {
+                member_name(&entry->arvik_header, long_name, name);
+                fprintf(manifest, "%d %lld %c ", i, (long long) header_off
+                        , S_ISDIR(strtol(entry->arvik_header.arvik_mode, NULL, 8)) ? 'd' : '-');
+                for (const char * ch = name; *ch != '\0'; ++ch)
+                {
+                    if (*ch == '\\')
+                    {
+                        fputs("\\\\", manifest);
+                    }
+                    else if (*ch == '\n')
+                    {
+                        fputs("\\n", manifest);
+                    }
+                    else
+                    {
+                        fputc(*ch, manifest);
+                    }
+                }
+                fputc('\n', manifest);
+            }
+            long_name[0] = '\0';
+        }
+    }
+    if (fclose(manifest) != 0)
+    {
+        perror("Error writing shard manifest");
+        exit(CREATE_FAIL);
+    }
+}
+
+// Find the live members of a seekable archive, with their long name
+// records, and the offset new members should go at. A trailing index answers both at once; otherwise the member
+// headers and footers are walked with pread() and the data is never touched.
+// Returns -1 if the archive is damaged.
+off_t find_members(int archive_fd, off_t archive_size, arvik_index_t * list, int * had_index)
+{
+    off_t off = strlen(ARVIK_TAG);
+    record_walk_t walk;
+    int result;
+
+    if (load_index(archive_fd, &list->entries, &list->count) == 0)
+    {
+        // The index starts where its last entry's member ends
+        *had_index = 1;
+        list->capacity = list->count;
+        if (list->count > 0)
+        {
+            arvik_index_entry_t * last = &list->entries[list->count - 1];
+            off_t size = field_value(last->arvik_header.arvik_size, sizeof(last->arvik_header.arvik_size), 10);
+
+            off = field_value(last->arvik_data_off, sizeof(last->arvik_data_off), 10)
+                  + size + (size % 2) + sizeof(arvik_footer_t);
+        }
+        return off;
+    }
+
+    record_walk_start(&walk, NULL, archive_fd, archive_size);
+    while ((result = record_next(&walk)) > 0)
+    {
+        if (!footer_term_ok(&walk.footer))
+        {
+            return -1;
+        }
+        // Long name records stay with their members, as in an index
+        if (!is_hidden_member(&walk.header) || is_long_name_member(&walk.header))
+        {
+            index_add(list, &walk.header, walk.data_off, &walk.footer);
+        }
+    }
+    return result < 0 ? -1 : walk.next;
+}
+
+// Remove the members matching patterns (-d). The records that stay are
+// moved down over the gaps, header through footer, and the file is cut
+// short, so the work is proportional to what follows the first removed
+// member. drefs are pointed at where their members went; a removed member
+// that a remaining dref repeats is kept as an ARVIK_DELETED_NAME record,
+// as -r does, and earlier such records that nothing repeats any more are
+// dropped. A trailing index is written again at the end.
+void delete_members(char * archive_name, char ** patterns, int pattern_count, create_options_t * opts)
+{
+    int archive_fd;
+    off_t archive_size;
+    archive_record_t * records;
+    size_t count;
+    char * matched;
+    int had_index = 0;
+    int unmatched = 0;
+    off_t end;
+    char long_name[ARVIK_PATH_MAX] = {'\0'};
+    char name[ARVIK_PATH_MAX];
+
+    archive_fd = open_existing(archive_name, 0, &archive_size);
+    records = scan_records(archive_fd, archive_size, &count);
+    matched = calloc(pattern_count, 1);
+    if (matched == NULL)
+    {
+        perror("Error allocating pattern table");
+        exit(CREATE_FAIL);
+    }
+
+    for (size_t i = 0; i < count; ++i)
+    {
+        archive_record_t * record = &records[i];
+        off_t size = field_value(record->header.arvik_size, sizeof(record->header.arvik_size), 10);
+
+        if (is_long_name_member(&record->header))
+        {
+            long_name[0] = '\0';
+            if (size < ARVIK_PATH_MAX
+                && pread(archive_fd, long_name, size, record->off + sizeof(arvik_header_t)) == size)
+            {
+                long_name[size] = '\0';
+            }
+            continue;
+        }
+        // The index is written again, and replaced members go unless a dref needs them
+        if (is_hidden_member(&record->header))
+        {
+            had_index |= is_index_member(&record->header);
+            record->keep = 0;
+        }
+        else
+        {
+            record->keep = !member_selected(&record->header, long_name, patterns, pattern_count, matched);
+            if (!record->keep && opts->verbose)
+            {
+                member_name(&record->header, long_name, name);
+                printf("d - %s\n", name);
+            }
+        }
+        long_name[0] = '\0';
+    }
+    keep_ref_targets(records, count);
+
+    end = place_records(records, count, strlen(ARVIK_TAG));
+    if (move_records(archive_fd, archive_fd, records, count) < 0 || fix_records(archive_fd, records, count) < 0)
+    {
+        perror("Error moving members");
+        exit(CREATE_FAIL);
+    }
+    finish_records(archive_fd, end, had_index || opts->write_index, opts->csum);
+
+    for (int i = 0; i < pattern_count; ++i)
+    {
+        if (!matched[i])
+        {
+            fprintf(stderr, "%s: not found in archive\n", patterns[i]);
+            unmatched = 1;
+        }
+    }
+    free(matched);
+    free(records);
+    close(archive_fd);
+    if (unmatched)
+    {
+        exit(CREATE_FAIL);
+    }
+}
+
+// Append the members of other archives to one (-m), copying their records
+// as they are, file to file. The target's index is dropped first and
+// written again last; the sources' indexes are left behind. drefs in a
+// source are pointed at where their members land.
+void merge_archives(char * archive_name, char ** sources, int source_count, create_options_t * opts)
+{
+    int archive_fd;
+    off_t archive_size;
+    archive_record_t * records;
+    size_t count;
+    int had_index = 0;
+    off_t end;
+    struct stat archive_st;
+
+    if (archive_name == NULL)
+    {
+        fprintf(stderr, "Merging needs the archive name (-f)\n");
+        exit(NO_ARCHIVE_NAME);
+    }
+    archive_fd = open_existing(archive_name, 1, &archive_size);
+    if (fstat(archive_fd, &archive_st) < 0)
+    {
+        perror("Error opening archive file for update");
+        exit(CREATE_FAIL);
+    }
+
+    // Close up the target where its index was
+    records = scan_records(archive_fd, archive_size, &count);
+    for (size_t i = 0; i < count; ++i)
+    {
+        records[i].keep = !is_index_member(&records[i].header);
+        had_index |= !records[i].keep;
+    }
+    end = place_records(records, count, strlen(ARVIK_TAG));
+    if (move_records(archive_fd, archive_fd, records, count) < 0 || fix_records(archive_fd, records, count) < 0)
+    {
+        perror("Error moving members");
+        exit(CREATE_FAIL);
+    }
+    free(records);
+
+    for (int i = 0; i < source_count; ++i)
+    {
+        struct stat st;
+        off_t source_size;
+        off_t start = end;
+        int source_fd;
+
+        if (stat(sources[i], &st) == 0 && st.st_dev == archive_st.st_dev && st.st_ino == archive_st.st_ino)
+        {
+            fprintf(stderr, "Cannot merge %s into itself\n", sources[i]);
+            exit(CREATE_FAIL);
+        }
+        source_fd = open_existing(sources[i], 0, &source_size);
+        records = scan_records(source_fd, source_size, &count);
+        for (size_t j = 0; j < count; ++j)
+        {
+            records[j].keep = !is_index_member(&records[j].header);
+        }
+        if (opts->verbose)
+        {
+            printf("m - %s\n", sources[i]);
+        }
+        end = place_records(records, count, end);
+        if (move_records(source_fd, archive_fd, records, count) < 0
+            || fix_records(archive_fd, records, count) < 0)
+        {
+            // Drop what came of this source
+            fprintf(stderr, "Error copying members of %s: %s\n", sources[i], strerror(errno));
+            finish_records(archive_fd, start, had_index || opts->write_index, opts->csum);
+            exit(CREATE_FAIL);
+        }
+        free(records);
+        close(source_fd);
+    }
+    finish_records(archive_fd, end, had_index || opts->write_index, opts->csum);
+    close(archive_fd);
+}
+
+// Open an archive to change it in place, checking its tag. With create, a
+// missing one is made empty. Exits on failure.
+int open_existing(char * archive_name, int create, off_t * size)
+{
+    char tag[sizeof(ARVIK_TAG)] = {'\0'};
+    struct stat st;
+    int archive_fd;
+    mode_t old_mask;
+
+    if (archive_name == NULL)
+    {
+        fprintf(stderr, "Changing an archive needs its name (-f)\n");
+        exit(NO_ARCHIVE_NAME);
+    }
+    archive_fd = open(archive_name, O_RDWR);
+    if (archive_fd < 0 && errno == ENOENT && create)
+    {
+        old_mask = umask(0);
+        archive_fd = open(archive_name, O_RDWR | O_CREAT | O_EXCL, 0644);
+        umask(old_mask);
+        if (archive_fd >= 0 && write(archive_fd, ARVIK_TAG, strlen(ARVIK_TAG)) != (ssize_t) strlen(ARVIK_TAG))
+        {
+            perror("Error writing archive tag");
+            exit(CREATE_FAIL);
+        }
+    }
+    if (archive_fd < 0 || fstat(archive_fd, &st) < 0)
+    {
+        fprintf(stderr, "Error opening archive %s for update: %s\n", archive_name, strerror(errno));
+        exit(CREATE_FAIL);
+    }
+    if (!S_ISREG(st.st_mode) || pread(archive_fd, tag, strlen(ARVIK_TAG), 0) != (ssize_t) strlen(ARVIK_TAG)
+        || strcmp(tag, ARVIK_TAG) != 0)
+    {
+        fprintf(stderr, "Error, %s is not a correct arvik archive file\n", archive_name);
+        exit(BAD_TAG);
+    }
+    *size = st.st_size;
+    return archive_fd;
+}
+
+// Every record of an archive, hidden ones too, read with pread() like
+// find_members(). Member data is only looked at for drefs. Exits if the
+// archive is damaged, before anything is changed.
+archive_record_t * scan_records(int archive_fd, off_t archive_size, size_t * count)
+{
+    archive_record_t * records = NULL;
+    size_t capacity = 0;
+    record_walk_t walk;
+    int result;
+
+    *count = 0;
+    record_walk_start(&walk, NULL, archive_fd, archive_size);
+    while ((result = record_next(&walk)) > 0 && footer_term_ok(&walk.footer))
+    {
+        archive_record_t * record;
+        arvik_xheader_t xheader;
+        off_t raw_size;
+
+        if (*count == capacity)
+        {
+            capacity = capacity ? capacity * 2 : 256;
+            records = realloc(records, capacity * sizeof(archive_record_t));
+            if (records == NULL)
+            {
+                perror("Error allocating member list");
+                exit(CREATE_FAIL);
+            }
+        }
+        record = &records[*count];
+        memset(record, 0, sizeof(*record));
+        record->off = walk.off;
+        record->ref_off = -1;
+        record->header = walk.header;
+        if (is_extended_member(&record->header) && walk.stored == sizeof(xheader)
+            && pread(archive_fd, &xheader, sizeof(xheader), walk.data_off) == sizeof(xheader)
+            && is_ref_xheader(&xheader)
+            && check_ref(&xheader, walk.stored, walk.off, &raw_size, &record->ref_off) < 0)
+        {
+            break;
+        }
+        record->len = walk.next - walk.off;
+        (*count)++;
+    }
+    if (result != 0)
+    {
+        fprintf(stderr, "Error: archive is damaged, not changing it\n");
+        exit(READ_FAIL);
+    }
+    return records;
+}
+
+// The record whose header is at off, or NULL
+archive_record_t * record_at(archive_record_t * records, size_t count, off_t off)
+{
+    size_t low = 0;
+    size_t high = count;
+
+    while (low < high)
+    {
+        size_t mid = low + (high - low) / 2;
+
+        if (records[mid].off == off)
+        {
+            return &records[mid];
+        }
+        if (records[mid].off < off)
+        {
+            low = mid + 1;
+        }
+        else
+        {
+            high = mid;
+        }
+    }
+    return NULL;
+}
+
+// Keep the members that remaining drefs repeat, hidden if they were going,
+// and the long name records of the members that remain visible
+void keep_ref_targets(archive_record_t * records, size_t count)
+{
+    for (size_t i = 0; i < count; ++i)
+    {
+        archive_record_t * target;
+
+        if (!records[i].keep || records[i].ref_off < 0)
+        {
+            continue;
+        }
+        target = record_at(records, i, records[i].ref_off);
+        if (target != NULL && !target->keep)
+        {
+            target->keep = 1;
+            target->hide = !is_hidden_member(&target->header);
+        }
+    }
+    for (size_t i = 0; i < count; ++i)
+    {
+        if (is_long_name_member(&records[i].header))
+        {
+            records[i].keep = i + 1 < count && records[i + 1].keep && !records[i + 1].hide
+                              && !is_hidden_member(&records[i + 1].header);
+        }
+    }
+}
+
+// Give the kept records their places from off on; returns where they end
+off_t place_records(archive_record_t * records, size_t count, off_t off)
+{
+    for (size_t i = 0; i < count; ++i)
+    {
+        if (records[i].keep)
+        {
+            records[i].new_off = off;
+            off += records[i].len;
+        }
+    }
+    return off;
+}
+
+// Copy the kept records to their places, a run of adjacent ones at a time
+int move_records(int from_fd, int to_fd, archive_record_t * records, size_t count)
+{
+    size_t i = 0;
+
+    while (i < count)
+    {
+        size_t j = i + 1;
+        off_t len;
+
+        if (!records[i].keep)
+        {
+            i++;
+            continue;
+        }
+        len = records[i].len;
+        while (j < count && records[j].keep)
+        {
+            len += records[j].len;
+            j++;
+        }
+        if (copy_within(from_fd, records[i].off, to_fd, records[i].new_off, len) < 0)
+        {
+            return -1;
+        }
+        i = j;
+    }
+    return 0;
+}
+
+// Copy len bytes at from in from_fd to to in to_fd. Within one file to
+// must be below from, and the copy goes front to back so it never reads
+// what it has written. Clones the blocks when the ranges line up with the
+// file system's, else uses copy_file_range(), which will not take ranges
+// that overlap, else pread() and pwrite().
+int copy_within(int from_fd, off_t from, int to_fd, off_t to, off_t len)
+{
+    off_t distance = from_fd == to_fd ? from - to : len; // how far a step may go
+    off_t done = 0;
+    struct stat st;
+    char * buffer;
+
+    if (len == 0 || (from_fd == to_fd && from == to))
+    {
+        return 0;
+    }
+    if (fstat(to_fd, &st) == 0 && st.st_blksize > 0 && from % st.st_blksize == 0 && to % st.st_blksize == 0
+        && len % st.st_blksize == 0 && distance >= len)
+    {
+        struct file_clone_range clone = { from_fd, from, len, to };
+        stats_mark_t mark;
+
+        stats_mark(&mark);
+        if (ioctl(to_fd, FICLONERANGE, &clone) == 0)
+        {
+            stats_add(PHASE_WRITE, &mark, len, 1);
+            return 0;
+        }
+    }
+
+    // Small steps through a pread() buffer beat many tiny copy_file_range() calls
+    while (done < len && (from_fd != to_fd || distance >= (off_t) io_block_size))
+    {
+        off_t in_off = from + done;
+        off_t out_off = to + done;
+        ssize_t copied;
+        stats_mark_t mark;
+
+        stats_mark(&mark);
+        copied = copy_file_range(from_fd, &in_off, to_fd, &out_off, MIN(MIN(len - done, distance), DIRECT_CHUNK)
+                                 , 0);
+        stats_add(PHASE_WRITE, &mark, copied > 0 ? copied : 0, 1);
+        if (copied <= 0)
+        {
+            if (copied < 0 && (errno == EXDEV || errno == EINVAL || errno == ENOSYS || errno == EOPNOTSUPP))
+            {
+                break;
+            }
+            errno = copied == 0 ? EIO : errno;
+            return -1;
+        }
+        done += copied;
+    }
+    if (done == len)
+    {
+        return 0;
+    }
+
+    buffer = io_alloc(io_block_size);
+    if (buffer == NULL)
+    {
+        return -1;
+    }
+    while (done < len)
+    {
+        ssize_t bytes_read = stats_pread(from_fd, buffer, MIN((off_t) io_block_size, len - done), from + done);
+
+        if (bytes_read <= 0 || stats_pwrite(to_fd, buffer, bytes_read, to + done) != bytes_read)
+        {
+            errno = bytes_read == 0 ? EIO : errno;
+            free(buffer);
+            return -1;
+        }
+        done += bytes_read;
+    }
+    free(buffer);
+    return 0;
+}
+
+// With the kept records in their places, rename the ones kept only for a
+// dref, and point every dref at where its member went
+int fix_records(int archive_fd, archive_record_t * records, size_t count)
+{
+    for (size_t i = 0; i < count; ++i)
+    {
+        archive_record_t * record = &records[i];
+
+        if (!record->keep)
+        {
+            continue;
+        }
+        if (record->hide)
+        {
+            char name[sizeof(record->header.arvik_name)];
+
+            memset(name, ' ', sizeof(name));
+            memcpy(name, ARVIK_DELETED_NAME "/", strlen(ARVIK_DELETED_NAME) + 1);
+            if (pwrite(archive_fd, name, sizeof(name), record->new_off) != sizeof(name))
+            {
+                return -1;
+            }
+        }
+        if (record->ref_off >= 0)
+        {
+            archive_record_t * target = record_at(records, i, record->ref_off);
+            off_t xheader_off = record->new_off + sizeof(arvik_header_t);
+            arvik_xheader_t xheader;
+
+            if (target == NULL || target->new_off == record->ref_off)
+            {
+                continue;
+            }
+            if (pread(archive_fd, &xheader, sizeof(xheader), xheader_off) != sizeof(xheader))
+            {
+                return -1;
+            }
+            set_field(xheader.arvik_xarg, sizeof(xheader.arvik_xarg), target->new_off);
+            if (pwrite(archive_fd, &xheader, sizeof(xheader), xheader_off) != sizeof(xheader))
+            {
+                return -1;
+            }
+        }
+    }
+    return 0;
+}
+
+// Cut the archive off after its last record, and write an index there if
+// it is wanted
+void finish_records(int archive_fd, off_t end, int write_index, arvik_csum_alg_t alg)
+{
+    arvik_index_t list = { NULL, 0, 0 };
+    int had_index = 0;
+    io_out_t out;
+
+    if (ftruncate(archive_fd, end) < 0 || lseek(archive_fd, end, SEEK_SET) < 0)
+    {
+        perror("Error truncating archive");
+        exit(CREATE_FAIL);
+    }
+    if (!write_index)
+    {
+        return;
+    }
+    if (find_members(archive_fd, end, &list, &had_index) < 0 || io_out_start(&out, archive_fd) < 0)
+    {
+        perror("Error writing member index");
+        exit(CREATE_FAIL);
+    }
+    write_index_member(&out, &list, end, alg);
+    if (io_out_finish(&out) < 0)
+    {
+        perror("Error writing member index");
+        exit(CREATE_FAIL);
+    }
+    free(list.entries);
+}
+
+// Wait for a free slot the reader can fill
+pipe_slot_t * pipe_acquire(create_pipe_t * pipe)
+{
+    pipe_slot_t * slot;
+
+    pthread_mutex_lock(&pipe->lock);
+    while (pipe->count == PIPE_BUF_COUNT)
+    {
+        pthread_cond_wait(&pipe->not_full, &pipe->lock);
+    }
+    slot = &pipe->slots[pipe->head];
+    pthread_mutex_unlock(&pipe->lock);
+    return slot;
+}
+
+// Hand the slot filled by the reader over to the writer
+void pipe_publish(create_pipe_t * pipe)
+{
+    pthread_mutex_lock(&pipe->lock);
+    pipe->head = (pipe->head + 1) % PIPE_BUF_COUNT;
+    pipe->count++;
+    pthread_cond_signal(&pipe->not_empty);
+    pthread_mutex_unlock(&pipe->lock);
+}
+
+// Wait for the next filled slot
+pipe_slot_t * pipe_take(create_pipe_t * pipe)
+{
+    pipe_slot_t * slot;
+
+    pthread_mutex_lock(&pipe->lock);
+    while (pipe->count == 0)
+    {
+        pthread_cond_wait(&pipe->not_empty, &pipe->lock);
+    }
+    slot = &pipe->slots[pipe->tail];
+    pthread_mutex_unlock(&pipe->lock);
+    return slot;
+}
+
+// Give a drained slot back to the reader
+void pipe_release(create_pipe_t * pipe)
+{
+    pthread_mutex_lock(&pipe->lock);
+    pipe->tail = (pipe->tail + 1) % PIPE_BUF_COUNT;
+    pipe->count--;
+    pthread_cond_signal(&pipe->not_full);
+    pthread_mutex_unlock(&pipe->lock);
+}
+
+// Reader thread: open each member and push its data through the ring
+void * pipeline_reader(void * arg)
+{
+    create_pipe_t * pipe = (create_pipe_t *) arg;
+    pipe_slot_t * slot;
+    uring_t ring;
+
+    // Direct reads want each member on its own, so --uring stays out of -D
+    if (io_uring_wanted && !io_direct && uring_init(&ring, URING_BATCH) == 0)
+    {
+        pipeline_reader_uring(pipe, &ring);
+        uring_exit(&ring);
+        slot = pipe_acquire(pipe);
+        slot->kind = SLOT_DONE;
+        pipe_publish(pipe);
+        return NULL;
+    }
+
+    for (int i = 0; i < pipe_member_count(pipe, i); ++i)
+    {
+        struct stat st; // File Statistics
+        int member_fd; // File descriptor for the member file
+        stats_mark_t mark; // When this member was started, for --stats
+
+        // Open member file
+        stats_mark(&mark);
+        member_fd = stats_open(pipe->members[i], O_RDONLY, 0);
+        if (member_fd < 0)
+        {
+            fprintf(stderr, "Error opening member file %s: %s\n", pipe->members[i], strerror(errno));
+            continue;
+        }
+
+        // Get file information using fstat
+        if (stats_fstat(member_fd, &st) < 0)
+        {
+            fprintf(stderr, "Error getting file information for %s: %s\n", pipe->members[i], strerror(errno));
+            stats_close(member_fd);
+            continue;
+        }
+
+        pipeline_member(pipe, i, member_fd, &st);
+        stats_member(pipe->members[i], st.st_size, &mark);
+    }
+
+    slot = pipe_acquire(pipe);
+    slot->kind = SLOT_DONE;
+    pipe_publish(pipe);
+    return NULL;
+}
+
+// Reader thread with io_uring: open, stat, read and close members a batch
+// at a time. Small plain members are read whole by the ring; the rest are
+// handed to pipeline_member() once opened.
+void pipeline_reader_uring(create_pipe_t * pipe, uring_t * ring)
+{
+    int fds[URING_BATCH];
+    int stat_results[URING_BATCH];
+    int reads[URING_BATCH];
+    int closes[URING_BATCH];
+    struct statx stx[URING_BATCH];
+    struct stat st[URING_BATCH];
+    int small[URING_BATCH]; // read by the ring
+    size_t small_max = MIN(URING_SMALL, io_block_size);
+    char * buffers = malloc(URING_BATCH * small_max);
+
+    if (buffers == NULL)
+    {
+        perror("Error allocating read buffers");
+        exit(CREATE_FAIL);
+    }
+    for (int first = 0, count = 0; first < pipe_member_count(pipe, first); first += count)
+    {
+        count = MIN(URING_BATCH, pipe_member_count(pipe, first) - first);
+
+        for (int k = 0; k < count; ++k)
+        {
+            struct io_uring_sqe * sqe = uring_sqe(ring, IORING_OP_OPENAT, AT_FDCWD, k);
+
+            sqe->addr = (uintptr_t) pipe->members[first + k];
+            sqe->open_flags = O_RDONLY;
+        }
+        if (uring_run(ring, fds) < 0)
+        {
+            perror("Error opening member files");
+            exit(CREATE_FAIL);
+        }
+
+        // fstat, in effect
+        for (int k = 0; k < count; ++k)
+        {
+            stat_results[k] = -EBADF;
+            if (fds[k] >= 0)
+            {
+                struct io_uring_sqe * sqe = uring_sqe(ring, IORING_OP_STATX, fds[k], k);
+
+                sqe->addr = (uintptr_t) "";
+                sqe->statx_flags = AT_EMPTY_PATH;
+                sqe->len = STATX_BASIC_STATS;
+                sqe->off = (uintptr_t) &stx[k];
+            }
+        }
+        if (uring_run(ring, stat_results) < 0)
+        {
+            perror("Error getting file information");
+            exit(CREATE_FAIL);
+        }
+
+        // --base, --dedup and -z look at each member on their own
+        for (int k = 0; k < count; ++k)
+        {
+            small[k] = 0;
+            if (stat_results[k] == 0)
+            {
+                statx_to_stat(&stx[k], &st[k]);
+                small[k] = S_ISREG(st[k].st_mode) && st[k].st_size <= (off_t) small_max
+                           && pipe->base == NULL && pipe->dedup == NULL && !pipe->compress;
+            }
+            reads[k] = 0;
+            if (small[k] && st[k].st_size > 0)
+            {
+                struct io_uring_sqe * sqe = uring_sqe(ring, IORING_OP_READ, fds[k], k);
+
+                sqe->addr = (uintptr_t) (buffers + k * small_max);
+                sqe->len = st[k].st_size;
+                sqe->off = 0;
+            }
+        }
+        if (uring_run(ring, reads) < 0)
+        {
+            perror("Error reading member files");
+            exit(CREATE_FAIL);
+        }
+
+        // Hand the members over in order
+        for (int k = 0; k < count; ++k)
+        {
+            int i = first + k;
+            pipe_slot_t * slot;
+            stats_mark_t mark; // the batched calls are not charged to members
+
+            stats_mark(&mark);
+            if (fds[k] < 0)
+            {
+                fprintf(stderr, "Error opening member file %s: %s\n", pipe->members[i], strerror(-fds[k]));
+                continue;
+            }
+            if (stat_results[k] < 0)
+            {
+                fprintf(stderr, "Error getting file information for %s: %s\n", pipe->members[i]
+                        , strerror(-stat_results[k]));
+                continue;
+            }
+            // A short read means the file changed; let the usual path see it
+            if (!small[k] || reads[k] != st[k].st_size)
+            {
+                pipeline_member(pipe, i, fds[k], &st[k]);
+                stats_member(pipe->members[i], st[k].st_size, &mark);
+                fds[k] = -1;
+                continue;
+            }
+
+            slot = pipe_acquire(pipe);
+            slot->kind = SLOT_BEGIN;
+            slot->member = i;
+            slot->file_size = st[k].st_size;
+            slot->st = st[k];
+            pipe_publish(pipe);
+
+            if (st[k].st_size > 0)
+            {
+                slot = pipe_acquire(pipe);
+                slot->kind = SLOT_DATA;
+                slot->member = i;
+                slot->len = st[k].st_size;
+                memcpy(slot->data, buffers + k * small_max, st[k].st_size);
+                pipe_publish(pipe);
+            }
+
+            slot = pipe_acquire(pipe);
+            slot->kind = SLOT_END;
+            slot->member = i;
+            pipe_publish(pipe);
+            stats_member(pipe->members[i], st[k].st_size, &mark);
+        }
+
+        for (int k = 0; k < count; ++k)
+        {
+            if (fds[k] >= 0)
+            {
+                uring_sqe(ring, IORING_OP_CLOSE, fds[k], k);
+            }
+        }
+        if (uring_run(ring, closes) < 0)
+        {
+            perror("Error closing member files");
+            exit(CREATE_FAIL);
+        }
+    }
+    free(buffers);
+}
+
+// How many members the reader can go through, waiting until there are
+// more than i while -R is still finding them
+int pipe_member_count(create_pipe_t * pipe, int i)
+{
+    if (pipe->walk == NULL)
+    {
+        return pipe->member_count;
+    }
+    return walk_wait(pipe->walk, i);
+}
+
+// A member that shrinks while it is mapped raises SIGBUS on the pages past
+// its new end, in whichever thread reads them. Map zeros over the page so
+// the read goes on; the writer then sees the size change with member_resized()
+// and fails the member. Other bus errors keep their default action.
+void map_fault(int sig, siginfo_t * info, void * context)
+{
+    void * page = (void *) ((uintptr_t) info->si_addr & ~(uintptr_t) (map_page_size - 1));
+
+    (void) context;
+    if (info->si_code != BUS_ADRERR
+        || mmap(page, map_page_size, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0) == MAP_FAILED)
+    {
+        signal(sig, SIG_DFL);
+    }
+}
+
+void map_fault_install(void)
+{
+    struct sigaction action;
+
+    memset(&action, 0, sizeof(action));
+    map_page_size = sysconf(_SC_PAGESIZE);
+    action.sa_sigaction = map_fault;
+    action.sa_flags = SA_SIGINFO;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGBUS, &action, NULL);
+}
+
+// Has the file at fd changed from size bytes? If it shrank, a mapping of
+// it read as zeros past the new end (see map_fault()).
+int member_resized(int fd, off_t size)
+{
+    struct stat st;
+
+    return fstat(fd, &st) < 0 || st.st_size != size;
+}
+
+// Why copying from a mapping failed. A write(2) of pages past the end of a
+// file that shrank fails with EFAULT instead of raising SIGBUS.
+const char * map_write_error(void)
+{
+    return errno == 0 || errno == EFAULT ? "file changed size" : strerror(errno);
+}
+
+// Push one opened member through the ring. Takes over member_fd.
+void pipeline_member(create_pipe_t * pipe, int i, int member_fd, struct stat * st)
+{
+    pipe_slot_t * slot;
+    ssize_t bytes_read; // Number of bytes read
+    int direct; // member_fd is in O_DIRECT mode
+    arvik_header_t header; // Header the member would get, for --base
+    arvik_index_entry_t * entry; // Its unchanged copy in the --base archive
+    sparse_extent_t * extents; // Data extents of a sparse member, for -S
+    size_t extent_count;
+
+    // A directory is its header alone
+    if (S_ISDIR(st->st_mode))
+    {
+        stats_close(member_fd);
+
+        slot = pipe_acquire(pipe);
+        slot->kind = SLOT_BEGIN;
+        slot->member = i;
+        slot->file_size = 0;
+        slot->st = *st;
+        pipe_publish(pipe);
+
+        slot = pipe_acquire(pipe);
+        slot->kind = SLOT_END;
+        slot->member = i;
+        pipe_publish(pipe);
+        return;
+    }
+
+    // Unchanged since the --base archive: the writer copies it from there
+    build_header(&header, pipe->members[i], st);
+    if (pipe->base != NULL && (entry = base_lookup(pipe->base, &header, st)) != NULL)
+    {
+        stats_close(member_fd);
+
+        slot = pipe_acquire(pipe);
+        slot->kind = SLOT_BEGIN;
+        slot->member = i;
+        slot->file_size = st->st_size;
+        slot->st = *st;
+        pipe_publish(pipe);
+
+        slot = pipe_acquire(pipe);
+        slot->kind = SLOT_REUSE;
+        slot->member = i;
+        slot->st = *st;
+        slot->base_entry = entry;
+        pipe_publish(pipe);
+
+        slot = pipe_acquire(pipe);
+        slot->kind = SLOT_END;
+        slot->member = i;
+        pipe_publish(pipe);
+        return;
+    }
+
+    // Under -S, sparse files have their data extents mapped first
+    extents = NULL;
+    extent_count = 0;
+    if (pipe->sparse && S_ISREG(st->st_mode) && maybe_sparse(st))
+    {
+        find_extents(member_fd, st->st_size, &extents, &extent_count);
+    }
+
+    direct = pipe->direct_reads && extents == NULL && S_ISREG(st->st_mode) && set_direct(member_fd) == 0;
+    if (!direct)
+    {
+        posix_fadvise(member_fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    }
+
+    slot = pipe_acquire(pipe);
+    slot->kind = SLOT_BEGIN;
+    slot->member = i;
+    slot->file_size = st->st_size;
+    slot->st = *st;
+    pipe_publish(pipe);
+
+    // Regular files go to the writer whole, to be copied in the kernel.
+    // So do sparse ones, even with -D, as only their data is read.
+    if ((!pipe->direct_reads || extents != NULL) && S_ISREG(st->st_mode) && st->st_size > 0)
+    {
+        char * map = mmap(NULL, st->st_size, PROT_READ, MAP_PRIVATE, member_fd, 0);
+
+        if (map != MAP_FAILED)
+        {
+            csum_t sum;
+            int ref = -1;
+            int summed = pipe->dedup != NULL && extents == NULL && st->st_size > (off_t) sizeof(arvik_xheader_t);
+
+            // Start readahead now so it overlaps the previous member's copy
+            madvise(map, st->st_size, MADV_SEQUENTIAL);
+            if (extents == NULL)
+            {
+                madvise(map, st->st_size, MADV_WILLNEED);
+            }
+
+            // --dedup sums here so the writer knows before it writes
+            // anything whether the content is already in the archive.
+            // Members no bigger than a reference are not worth it, and
+            // sparse ones would have their holes read.
+            csum_init(&sum, ARVIK_CSUM_CRC32);
+            if (summed)
+            {
+                csum_init(&sum, pipe->dedup->alg);
+                csum_update(&sum, map, st->st_size);
+                ref = dedup_find(pipe->dedup, pipe->members, i, st, map, sum.value);
+            }
+
+            slot = pipe_acquire(pipe);
+            slot->kind = SLOT_FILE;
+            slot->member = i;
+            slot->file_size = st->st_size;
+            slot->fd = member_fd;
+            slot->map = map;
+            slot->st = *st;
+            slot->have_crc = summed;
+            slot->crc = sum.value;
+            slot->ref = ref;
+            slot->extents = extents;
+            slot->extent_count = extent_count;
+            pipe_publish(pipe);
+
+            slot = pipe_acquire(pipe);
+            slot->kind = SLOT_END;
+            slot->member = i;
+            pipe_publish(pipe);
+            return;
+        }
+    }
+    free(extents);
+
+    // Fill whole buffers so the writer sees few large chunks
+    do
+    {
+        slot = pipe_acquire(pipe);
+        slot->len = 0;
+        while (slot->len < (ssize_t) io_block_size
+               && (bytes_read = stats_read(member_fd, slot->data + slot->len, io_block_size - slot->len)) > 0)
+        {
+            slot->len += bytes_read;
+            // Direct reads stay aligned, so a short one is the tail
+            if (direct && slot->len < (ssize_t) io_block_size)
+            {
+                break;
+            }
+        }
+        if (slot->len == 0)
+        {
+            break;
+        }
+        slot->kind = SLOT_DATA;
+        slot->member = i;
+        pipe_publish(pipe);
+    } while (slot->len == (ssize_t) io_block_size);
+
+    slot = pipe_acquire(pipe);
+    slot->kind = SLOT_END;
+    slot->member = i;
+    pipe_publish(pipe);
+
+    // Close member file
+    if (io_direct && !direct)
+    {
+        drop_cache(member_fd);
+    }
+    stats_close(member_fd);
+}
+
+// Copy length bytes starting at in_base of in_fd to out's current offset
+// without staging them in a user buffer. map points at in_base in a mapping
+// of in_fd. Tries copy_file_range, then sendfile (for pipes and stdout), then
+// plain write() from the mapping. If sum is not NULL it is updated from the
+// mapping as we go. O_DIRECT output is staged from the mapping instead.
+int copy_range_direct(io_out_t * out, int in_fd, off_t in_base, const char * map, off_t length, csum_t * sum)
+{
+    int out_fd = out->fd;
+    off_t copied = 0;
+    int use_copy_range = 1;
+    int use_sendfile = 1;
+
+    // Small members are batched with their headers and footers
+    if (out->block != NULL || out_fd < 0 || length < OUT_SMALL)
+    {
+        if (sum != NULL)
+        {
+            csum_update(sum, map, length);
+        }
+        return io_out_write(out, map, length);
+    }
+    if (io_out_flush(out) < 0)
+    {
+        return -1;
+    }
+
+    while (copied < length)
+    {
+        size_t chunk = MIN(DIRECT_CHUNK, length - copied);
+        off_t in_off = in_base + copied;
+        ssize_t bytes_copied;
+        stats_mark_t mark;
+
+        stats_mark(&mark);
+        if (use_copy_range)
+        {
+            bytes_copied = copy_file_range(in_fd, &in_off, out_fd, NULL, chunk, 0);
+            if (bytes_copied < 0 && (errno == EXDEV || errno == EINVAL || errno == ENOSYS
+                                     || errno == EOPNOTSUPP || errno == EBADF))
+            {
+                use_copy_range = 0;
+                continue;
+            }
+        }
+        else if (use_sendfile)
+        {
+            bytes_copied = sendfile(out_fd, in_fd, &in_off, chunk);
+            if (bytes_copied < 0 && (errno == EINVAL || errno == ENOSYS))
+            {
+                use_sendfile = 0;
+                continue;
+            }
+        }
+        else
+        {
+            bytes_copied = write(out_fd, map + copied, chunk);
+        }
+        stats_add(PHASE_WRITE, &mark, bytes_copied > 0 ? bytes_copied : 0, 1);
+
+        if (bytes_copied <= 0)
+        {
+            // Zero means the input shrank underneath us
+            if (bytes_copied == 0)
+            {
+                errno = 0;
+            }
+            return -1;
+        }
+
+        // Update CRC for the bytes that just went out
+        if (sum != NULL)
+        {
+            csum_update(sum, map + copied, bytes_copied);
+        }
+        copied += bytes_copied;
+    }
+    return 0;
+}
+
+// Write all members, overlapping member reads with CRC and archive writes.
+// archive_off is where archive_fd is positioned. index holds members already
+// in the archive for -r/-u and gets the new ones; NULL when creating.
+// Returns -1 if some member could not be written in full, such as a file
+// that changed size; its footer then fails every check.
+int create_pipeline(int archive_fd, off_t archive_off, char ** members, int member_count, create_options_t * opts
+                    , arvik_index_t * index)
+{
+    create_pipe_t pipe;
+    pthread_t reader;
+    pipe_slot_t * slot;
+    csum_t sum; // Checksum of the current member
+    arvik_footer_t footer; // Footer of the current member, for the index
+    off_t file_size = 0; // Size of the current member
+    off_t stored_size = 0; // Bytes of the current member in the archive
+    off_t data_len = 0; // Bytes of it that came in SLOT_DATA buffers, or -1
+    int write_failed = 0; // Skip the rest of a member after a write error
+    int failed = 0; // Some member was not written in full
+    int header_pending = 0; // Header waits until we know how data is stored
+    int done = 0;
+    arvik_header_t header; // Header of the current member
+    struct stat member_st; // fstat of the current member, for its header
+    off_t data_off = 0; // Where the current member's data starts
+    arvik_index_t own_index = { NULL, 0, 0 };
+    compress_pool_t zpool;
+    io_out_t out; // The archive, staged when it is in O_DIRECT mode
+    int collect = opts->write_index || index != NULL; // index_add each member
+    base_archive_t base;
+    dedup_table_t dedup;
+    off_t * member_off = NULL; // Header offset of each member written, for --dedup
+    size_t member_off_count = 0;
+    off_t ref_off = -1; // Header offset of the member a SLOT_FILE repeats
+    tree_walk_t walk;
+
+    if (index == NULL)
+    {
+        index = &own_index;
+    }
+    map_fault_install();
+    if (io_out_start(&out, archive_fd) < 0)
+    {
+        perror("Error setting up archive output");
+        exit(CREATE_FAIL);
+    }
+    if (opts->compress)
+    {
+        compress_pool_start(&zpool, opts->jobs ? opts->jobs : (int) sysconf(_SC_NPROCESSORS_ONLN), opts->csum);
+    }
+
+    memset(&pipe, 0, sizeof(pipe));
+    if (opts->recursive)
+    {
+        walk_start(&walk, members, member_count, opts->jobs ? opts->jobs : (int) sysconf(_SC_NPROCESSORS_ONLN));
+        members = walk.members;
+        member_count = 0;
+        pipe.walk = &walk;
+    }
+    pipe.members = members;
+    pipe.member_count = member_count;
+    // Compression and --dedup work from a mapping, so with -D they only
+    // drop the cache after
+    pipe.direct_reads = io_direct && !opts->compress && !opts->dedup;
+    pipe.sparse = opts->sparse;
+    pipe.compress = opts->compress;
+    if (opts->base != NULL)
+    {
+        base_open(&base, opts->base);
+        pipe.base = &base;
+    }
+    if (opts->dedup)
+    {
+        dedup_init(&dedup, opts->csum);
+        pipe.dedup = &dedup;
+        member_off = malloc((member_count + 1) * sizeof(off_t));
+        if (member_off == NULL)
+        {
+            perror("Error allocating member list");
+            exit(CREATE_FAIL);
+        }
+        for (int i = 0; i < member_count; ++i)
+        {
+            member_off[i] = -1;
+        }
+        member_off_count = member_count;
+    }
+    pthread_mutex_init(&pipe.lock, NULL);
+    pthread_cond_init(&pipe.not_empty, NULL);
+    pthread_cond_init(&pipe.not_full, NULL);
+    for (int i = 0; i < PIPE_BUF_COUNT; ++i)
+    {
+        pipe.slots[i].data = io_alloc(io_block_size);
+        if (pipe.slots[i].data == NULL)
+        {
+            perror("Error allocating create buffers");
+            exit(CREATE_FAIL);
+        }
+    }
+
+    if (pthread_create(&reader, NULL, pipeline_reader, &pipe) != 0)
+    {
+        fprintf(stderr, "Error starting reader thread\n");
+        exit(CREATE_FAIL);
+    }
+
+    while (!done)
+    {
+        slot = pipe_take(&pipe);
+        ref_off = slot->kind == SLOT_FILE && slot->ref >= 0 ? member_off[slot->ref] : -1;
+
+        // Plain members get their header as soon as their data shows up;
+        // compressed, reused, repeated and sparse ones write their own
+        if (header_pending && slot->kind != SLOT_REUSE
+            && !(slot->kind == SLOT_FILE && (opts->compress || ref_off >= 0 || slot->extents != NULL)))
+        {
+            write_header(&out, members[slot->member], &member_st, &header);
+            data_off = archive_off + sizeof(header);
+            header_pending = 0;
+        }
+
+        switch (slot->kind)
+        {
+            case SLOT_BEGIN:
+                csum_init(&sum, opts->csum);
+                file_size = slot->file_size;
+                member_st = slot->st;
+                stored_size = file_size;
+                data_len = 0;
+                write_failed = 0;
+                header_pending = 1;
+                if (opts->verbose)
+                {
+                    printf("a - %s\n", members[slot->member]);
+                }
+                if (needs_long_name(members[slot->member]))
+                {
+                    off_t written = write_long_name(&out, members[slot->member], opts->csum, archive_off
+                                                    , collect ? index : NULL);
+
+                    if (written < 0)
+                    {
+                        write_failed = 1;
+                    }
+                    else
+                    {
+                        archive_off += written;
+                    }
+                }
+                break;
+            case SLOT_DATA:
+                if (write_failed)
+                {
+                    break;
+                }
+                // Read, so the file may have grown since its header was made
+                data_len += slot->len;
+                if (data_len > file_size)
+                {
+                    fprintf(stderr, "Error writing data for %s: file changed size\n", members[slot->member]);
+                    write_failed = 1;
+                    break;
+                }
+                // Update CRC for this chunk of data
+                csum_update(&sum, slot->data, slot->len);
+                if (io_out_write(&out, slot->data, slot->len) < 0)
+                {
+                    fprintf(stderr, "Error writing data for %s: %s\n", members[slot->member], strerror(errno));
+                    write_failed = 1;
+                }
+                break;
+            case SLOT_FILE:
+                data_len = -1;
+                if (ref_off >= 0)
+                {
+                    // Same content as a member already written
+                    data_off = archive_off + sizeof(header);
+                    header_pending = 0;
+                    write_failed = write_ref_member(&out, members[slot->member], &slot->st, slot->file_size
+                                                    , ref_off, &header, &stored_size) < 0;
+                    sum.value = slot->crc;
+                }
+                else if (slot->extents != NULL)
+                {
+                    data_off = archive_off + sizeof(header);
+                    header_pending = 0;
+                    write_failed = write_sparse_member(&out, members[slot->member], &slot->st, slot->fd, slot->map
+                                                       , slot->extents, slot->extent_count, &header
+                                                       , &stored_size, &sum) < 0;
+                    free(slot->extents);
+                }
+                else if (header_pending)
+                {
+                    data_off = archive_off + sizeof(header);
+                    header_pending = 0;
+                    write_failed = write_compressed_member(&out, &zpool, members[slot->member], &slot->st
+                                                           , slot->map, slot->file_size, &header, &stored_size
+                                                           , &sum) < 0;
+                }
+                else if (copy_range_direct(&out, slot->fd, 0, slot->map, slot->file_size
+                                           , slot->have_crc ? NULL : &sum) < 0)
+                {
+                    fprintf(stderr, "Error writing data for %s: %s\n", members[slot->member], map_write_error());
+                    write_failed = 1;
+                }
+                else if (slot->have_crc)
+                {
+                    sum.value = slot->crc;
+                }
+                // Past a new end the mapping read as zeros
+                if (!write_failed && member_resized(slot->fd, slot->file_size))
+                {
+                    fprintf(stderr, "Error writing data for %s: file changed size\n", members[slot->member]);
+                    write_failed = 1;
+                }
+                munmap(slot->map, slot->file_size);
+                if (io_direct)
+                {
+                    drop_cache(slot->fd);
+                }
+                close(slot->fd);
+                break;
+            case SLOT_REUSE:
+                data_len = -1;
+                data_off = archive_off + sizeof(header);
+                header_pending = 0;
+                write_failed = write_reused_member(&out, &base, slot->base_entry, members[slot->member], &slot->st
+                                                   , &header, &stored_size, &sum) < 0;
+                break;
+            case SLOT_END:
+                // ... or shrunk
+                if (!write_failed && data_len >= 0 && data_len != file_size)
+                {
+                    fprintf(stderr, "Error writing data for %s: file changed size\n", members[slot->member]);
+                    write_failed = 1;
+                }
+                // Write footer with CRC, or one no reader takes when the
+                // data is short or not what the file held
+                if (write_failed)
+                {
+                    write_bad_footer(&out, stored_size);
+                    failed = 1;
+                }
+                else
+                {
+                    write_footer(&out, sum.alg, sum.value, stored_size);
+                }
+                archive_off = data_off + stored_size + (stored_size % 2) + sizeof(arvik_footer_t);
+                if (member_off != NULL && (size_t) slot->member >= member_off_count)
+                {
+                    size_t grown = MIN(member_off_count * 2 + 256, WALK_MAX_MEMBERS);
+
+                    member_off = realloc(member_off, grown * sizeof(off_t));
+                    if (member_off == NULL)
+                    {
+                        perror("Error allocating member list");
+                        exit(CREATE_FAIL);
+                    }
+                    while (member_off_count < grown)
+                    {
+                        member_off[member_off_count++] = -1;
+                    }
+                }
+                if (member_off != NULL && !write_failed)
+                {
+                    member_off[slot->member] = data_off - sizeof(header);
+                }
+                if (collect)
+                {
+                    build_footer(&footer, sum.alg, sum.value);
+                    index_add(index, &header, data_off, &footer);
+                }
+                break;
+            case SLOT_DONE:
+                done = 1;
+                break;
+        }
+        pipe_release(&pipe);
+    }
+
+    pthread_join(reader, NULL);
+    if (opts->recursive)
+    {
+        walk_finish(&walk);
+    }
+    if (opts->compress)
+    {
+        compress_pool_stop(&zpool);
+    }
+    if (opts->write_index)
+    {
+        write_index_member(&out, index, archive_off, opts->csum);
+    }
+    free(own_index.entries);
+    if (opts->base != NULL)
+    {
+        base_close(&base);
+    }
+    if (opts->dedup)
+    {
+        free(dedup.slots);
+        free(member_off);
+    }
+    if (io_out_finish(&out) < 0)
+    {
+        perror("Error writing archive");
+        exit(CREATE_FAIL);
+    }
+    for (int i = 0; i < PIPE_BUF_COUNT; ++i)
+    {
+        free(pipe.slots[i].data);
+    }
+    pthread_mutex_destroy(&pipe.lock);
+    pthread_cond_destroy(&pipe.not_empty);
+    pthread_cond_destroy(&pipe.not_full);
+    return failed ? -1 : 0;
+}
+
+// Start walking the -R operands
+void walk_start(tree_walk_t * walk, char ** roots, int root_count, int threads)
+{
+    memset(walk, 0, sizeof(*walk));
+    walk->roots = roots;
+    walk->root_count = root_count;
+    walk->thread_count = threads;
+    walk->members = mmap(NULL, WALK_MAX_MEMBERS * sizeof(char *), PROT_READ | PROT_WRITE
+                         , MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    walk->threads = malloc(threads * sizeof(pthread_t));
+    if (walk->members == MAP_FAILED || walk->threads == NULL)
+    {
+        perror("Error allocating member list");
+        exit(CREATE_FAIL);
+    }
+    pthread_mutex_init(&walk->lock, NULL);
+    pthread_cond_init(&walk->work, NULL);
+    pthread_cond_init(&walk->ready, NULL);
+    pthread_cond_init(&walk->found, NULL);
+    for (int i = 0; i < threads; ++i)
+    {
+        if (pthread_create(&walk->threads[i], NULL, walk_worker, walk) != 0)
+        {
+            fprintf(stderr, "Error starting walk thread\n");
+            exit(CREATE_FAIL);
+        }
+    }
+    if (pthread_create(&walk->lister, NULL, walk_lister, walk) != 0)
+    {
+        fprintf(stderr, "Error starting walk thread\n");
+        exit(CREATE_FAIL);
+    }
+}
+
+// Wait until the walk has found more than i members, or has finished.
+// Returns how many it has found.
+size_t walk_wait(tree_walk_t * walk, size_t i)
+{
+    size_t count;
+
+    pthread_mutex_lock(&walk->lock);
+    while (walk->member_count <= i && !walk->finished)
+    {
+        pthread_cond_wait(&walk->found, &walk->lock);
+    }
+    count = walk->member_count;
+    pthread_mutex_unlock(&walk->lock);
+    return count;
+}
+
+// Wait for the walk threads and free what they found
+void walk_finish(tree_walk_t * walk)
+{
+    pthread_join(walk->lister, NULL);
+    for (int i = 0; i < walk->thread_count; ++i)
+    {
+        pthread_join(walk->threads[i], NULL);
+    }
+    for (size_t i = 0; i < walk->member_count; ++i)
+    {
+        free(walk->members[i]);
+    }
+    munmap(walk->members, WALK_MAX_MEMBERS * sizeof(char *));
+    free(walk->threads);
+    pthread_mutex_destroy(&walk->lock);
+    pthread_cond_destroy(&walk->work);
+    pthread_cond_destroy(&walk->ready);
+    pthread_cond_destroy(&walk->found);
+}
+
+// Walk thread: read queued directories until the lister is done
+void * walk_worker(void * arg)
+{
+    tree_walk_t * walk = (tree_walk_t *) arg;
+
+    for (;;)
+    {
+        walk_dir_t * dir;
+
+        pthread_mutex_lock(&walk->lock);
+        while (walk->queue == NULL && !walk->shutdown)
+        {
+            pthread_cond_wait(&walk->work, &walk->lock);
+        }
+        dir = walk->queue;
+        if (dir == NULL)
+        {
+            pthread_mutex_unlock(&walk->lock);
+            break;
+        }
+        walk->queue = dir->next;
+        pthread_mutex_unlock(&walk->lock);
+
+        walk_read_dir(dir);
+
+        // Subdirectories go to the front, first one first, so threads read
+        // ahead in the order the lister will want them
+        pthread_mutex_lock(&walk->lock);
+        for (size_t k = dir->count; k > 0; --k)
+        {
+            walk_dir_t * subdir = dir->entries[k - 1].subdir;
+
+            if (subdir != NULL)
+            {
+                subdir->next = walk->queue;
+                walk->queue = subdir;
+            }
+        }
+        dir->ready = 1;
+        pthread_cond_broadcast(&walk->work);
+        pthread_cond_broadcast(&walk->ready);
+        pthread_mutex_unlock(&walk->lock);
+    }
+    return NULL;
+}
+
+// Lister thread: add each operand, and what is below it, as members
+void * walk_lister(void * arg)
+{
+    tree_walk_t * walk = (tree_walk_t *) arg;
+
+    for (int i = 0; i < walk->root_count; ++i)
+    {
+        struct stat st;
+        char * root = strdup(walk->roots[i]);
+        size_t len;
+
+        if (root == NULL)
+        {
+            perror("Error allocating member list");
+            exit(CREATE_FAIL);
+        }
+        // "dir/" is archived as "dir"
+        len = strlen(root);
+        while (len > 1 && root[len - 1] == '/')
+        {
+            root[--len] = '\0';
+        }
+        // Operands are followed if they are links, what is below them is not
+        if (stat(root, &st) < 0)
+        {
+            fprintf(stderr, "Error getting file information for %s: %s\n", root, strerror(errno));
+            free(root);
+            continue;
+        }
+        walk_add(walk, root);
+        if (S_ISDIR(st.st_mode))
+        {
+            walk_dir_t * dir = calloc(1, sizeof(walk_dir_t));
+
+            if (dir == NULL)
+            {
+                perror("Error allocating member list");
+                exit(CREATE_FAIL);
+            }
+            dir->path = root;
+            pthread_mutex_lock(&walk->lock);
+            dir->next = walk->queue;
+            walk->queue = dir;
+            pthread_cond_signal(&walk->work);
+            pthread_mutex_unlock(&walk->lock);
+            walk_list_dir(walk, dir);
+        }
+    }
+
+    pthread_mutex_lock(&walk->lock);
+    walk->finished = 1;
+    walk->shutdown = 1;
+    pthread_cond_broadcast(&walk->found);
+    pthread_cond_broadcast(&walk->work);
+    pthread_mutex_unlock(&walk->lock);
+    return NULL;
+}
+
+// Read one directory with getdents64, keeping everything but "." and ".."
+// sorted by name. Entries of unknown type are looked up with fstatat.
+void walk_read_dir(walk_dir_t * dir)
+{
+    char * buffer = malloc(WALK_BUF_SIZE);
+    size_t capacity = 0;
+    ssize_t len = 0;
+    int dir_fd = stats_open(dir->path, O_RDONLY | O_DIRECTORY | O_CLOEXEC, 0);
+    stats_mark_t mark;
+
+    if (buffer == NULL || dir_fd < 0)
+    {
+        dir->error = errno;
+        free(buffer);
+        if (dir_fd >= 0)
+        {
+            stats_close(dir_fd);
+        }
+        return;
+    }
+    for (;;)
+    {
+        ssize_t pos = 0;
+
+        stats_mark(&mark);
+        len = getdents64(dir_fd, buffer, WALK_BUF_SIZE);
+        stats_add(PHASE_OPEN, &mark, 0, 1);
+        if (len <= 0)
+        {
+            break;
+        }
+
+        while (pos < len)
+        {
+            struct dirent64 * entry = (struct dirent64 *) (buffer + pos);
+            unsigned char type = entry->d_type;
+            struct stat st;
+
+            pos += entry->d_reclen;
+            if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
+            {
+                continue;
+            }
+            if (type == DT_UNKNOWN)
+            {
+                stats_mark(&mark);
+                if (fstatat(dir_fd, entry->d_name, &st, AT_SYMLINK_NOFOLLOW) == 0)
+                {
+                    type = IFTODT(st.st_mode);
+                }
+                stats_add(PHASE_OPEN, &mark, 0, 1);
+            }
+            if (dir->count == capacity)
+            {
+                capacity = capacity ? capacity * 2 : 64;
+                dir->entries = realloc(dir->entries, capacity * sizeof(walk_entry_t));
+                if (dir->entries == NULL)
+                {
+                    perror("Error allocating member list");
+                    exit(CREATE_FAIL);
+                }
+            }
+            dir->entries[dir->count].name = walk_join(dir->path, entry->d_name);
+            dir->entries[dir->count].type = type;
+            dir->entries[dir->count].subdir = NULL;
+            dir->count++;
+        }
+    }
+    if (len < 0)
+    {
+        dir->error = errno;
+    }
+    close(dir_fd);
+    free(buffer);
+
+    qsort(dir->entries, dir->count, sizeof(walk_entry_t), compare_walk_entries);
+    for (size_t k = 0; k < dir->count; ++k)
+    {
+        if (dir->entries[k].type == DT_DIR)
+        {
+            dir->entries[k].subdir = calloc(1, sizeof(walk_dir_t));
+            if (dir->entries[k].subdir == NULL)
+            {
+                perror("Error allocating member list");
+                exit(CREATE_FAIL);
+            }
+            dir->entries[k].subdir->path = dir->entries[k].name;
+        }
+    }
+}
+
+// Add the entries of a directory, and of the directories in it, once a
+// walk thread has read them
+void walk_list_dir(tree_walk_t * walk, walk_dir_t * dir)
+{
+    pthread_mutex_lock(&walk->lock);
+    while (!dir->ready)
+    {
+        pthread_cond_wait(&walk->ready, &walk->lock);
+    }
+    pthread_mutex_unlock(&walk->lock);
+
+    if (dir->error != 0)
+    {
+        fprintf(stderr, "Error reading directory %s: %s\n", dir->path, strerror(dir->error));
+    }
+    for (size_t k = 0; k < dir->count; ++k)
+    {
+        walk_entry_t * entry = &dir->entries[k];
+
+        if (entry->type != DT_REG && entry->type != DT_DIR)
+        {
+            fprintf(stderr, "Skipping %s: not a regular file or directory\n", entry->name);
+            free(entry->name);
+            continue;
+        }
+        walk_add(walk, entry->name);
+        if (entry->subdir != NULL)
+        {
+            walk_list_dir(walk, entry->subdir);
+        }
+    }
+    free(dir->entries);
+    free(dir);
+}
+
+// Publish one more member to the pipeline
+void walk_add(tree_walk_t * walk, char * name)
+{
+    if (walk->member_count == WALK_MAX_MEMBERS)
+    {
+        fprintf(stderr, "Error: too many files to archive\n");
+        exit(CREATE_FAIL);
+    }
+    walk->members[walk->member_count] = name;
+    pthread_mutex_lock(&walk->lock);
+    walk->member_count++;
+    pthread_cond_broadcast(&walk->found);
+    pthread_mutex_unlock(&walk->lock);
+}
+
+// dir/name, malloc'd
+char * walk_join(const char * dir, const char * name)
+{
+    size_t dir_len = strlen(dir);
+    char * path = malloc(dir_len + strlen(name) + 2);
+
+    if (path == NULL)
+    {
+        perror("Error allocating member list");
+        exit(CREATE_FAIL);
+    }
+    sprintf(path, dir_len > 0 && dir[dir_len - 1] == '/' ? "%s%s" : "%s/%s", dir, name);
+    return path;
+}
+
+// Order directory entries by name
+int compare_walk_entries(const void * a, const void * b)
+{
+    return strcmp(((const walk_entry_t *) a)->name, ((const walk_entry_t *) b)->name);
+}
+
+// Open and catalogue a --base archive. Any problem with it is fatal: the
+// caller asked for it by name.
+void base_open(base_archive_t * base, const char * name)
+{
+    struct stat st;
+    char tag[sizeof(ARVIK_TAG)] = {'\0'};
+    int had_index;
+
+    memset(base, 0, sizeof(*base));
+    base->fd = open(name, O_RDONLY);
+    if (base->fd < 0 || fstat(base->fd, &st) < 0)
+    {
+        fprintf(stderr, "Error opening base archive %s: %s\n", name, strerror(errno));
+        exit(CREATE_FAIL);
+    }
+    if (!S_ISREG(st.st_mode) || pread(base->fd, tag, strlen(ARVIK_TAG), 0) != (ssize_t) strlen(ARVIK_TAG)
+        || strcmp(tag, ARVIK_TAG) != 0)
+    {
+        fprintf(stderr, "Error, base %s is not a correct arvik archive file\n", name);
+        exit(BAD_TAG);
+    }
+    if (find_members(base->fd, st.st_size, &base->members, &had_index) < 0)
+    {
+        fprintf(stderr, "Error: base archive %s is damaged\n", name);
+        exit(READ_FAIL);
+    }
+    base->map_size = st.st_size;
+    base->map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, base->fd, 0);
+    base->by_name = malloc((base->members.count + 1) * sizeof(arvik_index_entry_t *));
+    if (base->map == MAP_FAILED || base->by_name == NULL)
+    {
+        perror("Error reading base archive");
+        exit(CREATE_FAIL);
+    }
+    for (size_t i = 0; i < base->members.count; ++i)
+    {
+        base->by_name[i] = &base->members.entries[i];
+    }
+    qsort(base->by_name, base->members.count, sizeof(arvik_index_entry_t *), compare_entry_names);
+}
+
+void base_close(base_archive_t * base)
+{
+    munmap((void *) base->map, base->map_size);
+    close(base->fd);
+    free(base->members.entries);
+    free(base->by_name);
+}
+
+// Order index entries by stored member name
+int compare_entry_names(const void * a, const void * b)
+{
+    const arvik_index_entry_t * entry_a = *(arvik_index_entry_t * const *) a;
+    const arvik_index_entry_t * entry_b = *(arvik_index_entry_t * const *) b;
+
+    return memcmp(entry_a->arvik_header.arvik_name, entry_b->arvik_header.arvik_name
+                  , sizeof(entry_a->arvik_header.arvik_name));
+}
+
+// Find the base copy of a member whose header would be header. It is only
+// used if the file's size and mtime match and the stored copy looks whole.
+arvik_index_entry_t * base_lookup(base_archive_t * base, arvik_header_t * header, struct stat * st)
+{
+    arvik_index_entry_t key;
+    arvik_index_entry_t * key_ptr = &key;
+    arvik_index_entry_t ** found;
+    arvik_index_entry_t * entry;
+    arvik_footer_t footer;
+    off_t data_off;
+    off_t stored;
+    off_t footer_off;
+    off_t raw_size;
+    arvik_csum_alg_t alg;
+    uLong crc;
+
+    if (!S_ISREG(st->st_mode))
+    {
+        return NULL;
+    }
+    memcpy(key.arvik_header.arvik_name, header->arvik_name, sizeof(header->arvik_name));
+    found = bsearch(&key_ptr, base->by_name, base->members.count, sizeof(arvik_index_entry_t *), compare_entry_names);
+    if (found == NULL)
+    {
+        return NULL;
+    }
+    entry = *found;
+    if (field_value(entry->arvik_header.arvik_date, sizeof(entry->arvik_header.arvik_date), 10) != st->st_mtime)
+    {
+        return NULL;
+    }
+
+    data_off = field_value(entry->arvik_data_off, sizeof(entry->arvik_data_off), 10);
+    stored = field_value(entry->arvik_header.arvik_size, sizeof(entry->arvik_header.arvik_size), 10);
+    footer_off = data_off + stored + (stored % 2);
+    if (data_off < (off_t) strlen(ARVIK_TAG) || stored < 0 || footer_off + (off_t) sizeof(footer) > base->map_size)
+    {
+        return NULL;
+    }
+    raw_size = stored;
+    if (is_extended_member(&entry->arvik_header))
+    {
+        const arvik_xheader_t * xheader = (const arvik_xheader_t *) (base->map + data_off);
+
+        if (stored < (off_t) sizeof(*xheader))
+        {
+            return NULL;
+        }
+        // A reference means nothing outside its own archive
+        if (is_ref_xheader(xheader))
+        {
+            return NULL;
+        }
+        raw_size = field_value(xheader->arvik_xsize, sizeof(xheader->arvik_xsize), 10);
+    }
+    memcpy(&footer, base->map + footer_off, sizeof(footer));
+    if (raw_size != st->st_size || parse_footer(&footer, &alg, &crc) < 0)
+    {
+        return NULL;
+    }
+    return entry;
+}
+
+// Write a member as stored in the base archive. The header is new, from
+// the file's stat, but keeps the stored size and terminator; the data is
+// copied in the kernel and the CRC is the one the base footer holds.
+int write_reused_member(io_out_t * out, base_archive_t * base, arvik_index_entry_t * entry, char * filename
+                        , struct stat * st, arvik_header_t * header_out, off_t * stored_out, csum_t * sum)
+{
+    arvik_header_t header;
+    arvik_footer_t footer;
+    off_t data_off = field_value(entry->arvik_data_off, sizeof(entry->arvik_data_off), 10);
+    off_t stored = field_value(entry->arvik_header.arvik_size, sizeof(entry->arvik_header.arvik_size), 10);
+    arvik_csum_alg_t alg;
+    uLong crc;
+
+    build_header(&header, filename, st);
+    memcpy(header.arvik_size, entry->arvik_header.arvik_size, sizeof(header.arvik_size));
+    header.arvik_term[0] = entry->arvik_header.arvik_term[0];
+    memcpy(&footer, base->map + data_off + stored + (stored % 2), sizeof(footer));
+    parse_footer(&footer, &alg, &crc);
+
+    *header_out = header;
+    *stored_out = stored;
+    csum_init(sum, alg);
+    sum->value = crc;
+    if (io_out_write(out, &header, sizeof(header)) < 0
+        || copy_range_direct(out, base->fd, data_off, base->map + data_off, stored, NULL) < 0)
+    {
+        fprintf(stderr, "Error writing data for %s: %s\n", filename, map_write_error());
+        return -1;
+    }
+    return 0;
+}
+
+void dedup_init(dedup_table_t * table, arvik_csum_alg_t alg)
+{
+    table->capacity = 1024;
+    table->count = 0;
+    table->alg = alg;
+    table->slots = malloc(table->capacity * sizeof(dedup_entry_t));
+    if (table->slots == NULL)
+    {
+        perror("Error allocating dedup table");
+        exit(CREATE_FAIL);
+    }
+    for (size_t i = 0; i < table->capacity; ++i)
+    {
+        table->slots[i].member = -1;
+    }
+}
+
+// Look for an earlier member with the same content as map, which has
+// checksum crc. Returns that member, or -1 after recording this one as the
+// first copy of its content. Equal size and checksum only make a candidate;
+// the content itself is compared before a member is stored as a reference.
+int dedup_find(dedup_table_t * table, char ** members, int member, struct stat * st, const char * map, uLong crc)
+{
+    size_t mask;
+    size_t i;
+
+    // Keep the table at most half full
+    if (2 * (table->count + 1) > table->capacity)
+    {
+        dedup_table_t grown = *table;
+
+        grown.capacity = table->capacity * 2;
+        grown.count = 0;
+        grown.slots = malloc(grown.capacity * sizeof(dedup_entry_t));
+        if (grown.slots == NULL)
+        {
+            perror("Error allocating dedup table");
+            exit(CREATE_FAIL);
+        }
+        for (size_t j = 0; j < grown.capacity; ++j)
+        {
+            grown.slots[j].member = -1;
+        }
+        for (size_t j = 0; j < table->capacity; ++j)
+        {
+            dedup_entry_t * old = &table->slots[j];
+
+            if (old->member >= 0)
+            {
+                size_t k = (old->crc ^ (size_t) old->size * 0x9e3779b97f4a7c15ULL) & (grown.capacity - 1);
+
+                while (grown.slots[k].member >= 0)
+                {
+                    k = (k + 1) & (grown.capacity - 1);
+                }
+                grown.slots[k] = *old;
+                grown.count++;
+            }
+        }
+        free(table->slots);
+        *table = grown;
+    }
+
+    mask = table->capacity - 1;
+    for (i = (crc ^ (size_t) st->st_size * 0x9e3779b97f4a7c15ULL) & mask; table->slots[i].member >= 0; i = (i + 1) & mask)
+    {
+        dedup_entry_t * entry = &table->slots[i];
+
+        if (entry->size == st->st_size && entry->crc == crc && dedup_same(members[entry->member], entry, map))
+        {
+            return entry->member;
+        }
+    }
+    table->slots[i].member = member;
+    table->slots[i].size = st->st_size;
+    table->slots[i].crc = crc;
+    table->slots[i].dev = st->st_dev;
+    table->slots[i].ino = st->st_ino;
+    table->slots[i].mtime = st->st_mtime;
+    table->count++;
+    return -1;
+}
+
+// Does the file the entry was read from still hold what it held then, and
+// is that the same as the size bytes at map?
+int dedup_same(const char * name, dedup_entry_t * entry, const char * map)
+{
+    struct stat st;
+    char * other;
+    int same = 0;
+    int fd = open(name, O_RDONLY);
+
+    if (fd < 0)
+    {
+        return 0;
+    }
+    if (fstat(fd, &st) == 0 && st.st_dev == entry->dev && st.st_ino == entry->ino
+        && st.st_size == entry->size && st.st_mtime == entry->mtime)
+    {
+        other = mmap(NULL, entry->size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (other != MAP_FAILED)
+        {
+            same = memcmp(other, map, entry->size) == 0 && !member_resized(fd, entry->size);
+            munmap(other, entry->size);
+        }
+    }
+    close(fd);
+    return same;
+}
+
+// Write a dref member for a file whose content is already stored in the
+// member whose header is at target_off
+int write_ref_member(io_out_t * out, char * filename, struct stat * st, off_t file_size, off_t target_off
+                     , arvik_header_t * header_out, off_t * stored_out)
+{
+    arvik_header_t header;
+    arvik_xheader_t xheader;
+
+    build_header(&header, filename, st);
+    set_field(header.arvik_size, sizeof(header.arvik_size), sizeof(xheader));
+    header.arvik_term[0] = ARVIK_XTERM;
+
+    memset(&xheader, ' ', sizeof(xheader));
+    memcpy(xheader.arvik_xtype, ARVIK_XTYPE_REF, sizeof(xheader.arvik_xtype));
+    set_field(xheader.arvik_xsize, sizeof(xheader.arvik_xsize), file_size);
+    set_field(xheader.arvik_xarg, sizeof(xheader.arvik_xarg), target_off);
+    xheader.arvik_xterm[0] = '+';
+    xheader.arvik_xterm[1] = '\n';
+
+    *header_out = header;
+    *stored_out = sizeof(xheader);
+    if (io_out_write(out, &header, sizeof(header)) < 0 || io_out_write(out, &xheader, sizeof(xheader)) < 0)
+    {
+        fprintf(stderr, "Error writing data for %s: %s\n", filename, strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+// Fewer blocks than bytes: the file has holes, or at least its file
+// system stores it compressed, and is worth mapping with find_extents()
+int maybe_sparse(struct stat * st)
+{
+    return st->st_size > 0 && (off_t) st->st_blocks * 512 < st->st_size;
+}
+
+// Map the data extents of a file with SEEK_DATA/SEEK_HOLE. Returns -1,
+// leaving *extents_out NULL, if the file system cannot say or the file has
+// no holes worth recording.
+int find_extents(int fd, off_t size, sparse_extent_t ** extents_out, size_t * count_out)
+{
+    sparse_extent_t * extents = NULL;
+    size_t count = 0;
+    size_t capacity = 0;
+    off_t data_bytes = 0;
+    off_t off = 0;
+
+    while (off < size)
+    {
+        off_t data = lseek(fd, off, SEEK_DATA);
+        off_t hole;
+
+        if (data < 0 && errno == ENXIO)
+        {
+            break; // a hole runs to the end
+        }
+        hole = data < 0 ? -1 : lseek(fd, data, SEEK_HOLE);
+        if (hole < 0)
+        {
+            free(extents);
+            return -1;
+        }
+        hole = MIN(hole, size);
+        if (count == capacity)
+        {
+            sparse_extent_t * grown;
+
+            capacity = capacity ? capacity * 2 : 64;
+            grown = realloc(extents, capacity * sizeof(sparse_extent_t));
+            if (grown == NULL)
+            {
+                free(extents);
+                return -1;
+            }
+            extents = grown;
+        }
+        extents[count].offset = data;
+        extents[count].length = hole - data;
+        data_bytes += hole - data;
+        count++;
+        off = hole;
+    }
+    lseek(fd, 0, SEEK_SET);
+
+    // Not sparse after all, or too fragmented for the map to pay for itself
+    if (data_bytes + (off_t) (count * sizeof(arvik_extent_t) + sizeof(arvik_xheader_t)) >= size)
+    {
+        free(extents);
+        return -1;
+    }
+    *extents_out = extents;
+    *count_out = count;
+    return 0;
+}
+
+// Write a sparse file as a sprs member: the extent map, then the data of
+// each extent, copied in the kernel. The checksum covers the whole file,
+// holes included, but the holes are never read.
+int write_sparse_member(io_out_t * out, char * filename, struct stat * st, int fd, const char * map
+                        , sparse_extent_t * extents, size_t extent_count, arvik_header_t * header_out
+                        , off_t * stored_out, csum_t * sum)
+{
+    arvik_header_t header;
+    arvik_xheader_t xheader;
+    arvik_extent_t * records;
+    off_t stored = sizeof(xheader) + extent_count * sizeof(arvik_extent_t);
+    off_t pos = 0;
+    int result = 0;
+
+    records = malloc((extent_count + 1) * sizeof(arvik_extent_t));
+    if (records == NULL)
+    {
+        perror("Error allocating extent map");
+        return -1;
+    }
+    for (size_t i = 0; i < extent_count; ++i)
+    {
+        memset(&records[i], ' ', sizeof(records[i]));
+        set_field(records[i].arvik_eoff, sizeof(records[i].arvik_eoff), extents[i].offset);
+        set_field(records[i].arvik_elen, sizeof(records[i].arvik_elen), extents[i].length);
+        records[i].arvik_eterm[0] = '+';
+        records[i].arvik_eterm[1] = '\n';
+        stored += extents[i].length;
+    }
+
+    build_header(&header, filename, st);
+    set_field(header.arvik_size, sizeof(header.arvik_size), stored);
+    header.arvik_term[0] = ARVIK_XTERM;
+
+    memset(&xheader, ' ', sizeof(xheader));
+    memcpy(xheader.arvik_xtype, ARVIK_XTYPE_SPARSE, sizeof(xheader.arvik_xtype));
+    set_field(xheader.arvik_xsize, sizeof(xheader.arvik_xsize), st->st_size);
+    set_field(xheader.arvik_xarg, sizeof(xheader.arvik_xarg), extent_count);
+    xheader.arvik_xterm[0] = '+';
+    xheader.arvik_xterm[1] = '\n';
+
+    *header_out = header;
+    *stored_out = stored;
+    if (io_out_write(out, &header, sizeof(header)) < 0 || io_out_write(out, &xheader, sizeof(xheader)) < 0
+        || io_out_write(out, records, extent_count * sizeof(arvik_extent_t)) < 0)
+    {
+        result = -1;
+    }
+    for (size_t i = 0; i < extent_count && result == 0; ++i)
+    {
+        csum_zeros(sum, extents[i].offset - pos);
+        result = copy_range_direct(out, fd, extents[i].offset, map + extents[i].offset, extents[i].length, sum);
+        pos = extents[i].offset + extents[i].length;
+    }
+    csum_zeros(sum, st->st_size - pos);
+    if (result < 0)
+    {
+        fprintf(stderr, "Error writing data for %s: %s\n", filename, map_write_error());
+    }
+    free(records);
+    return result;
+}
+
+// Start the compression threads, idle until a window is handed out
+void compress_pool_start(compress_pool_t * pool, int threads, arvik_csum_alg_t alg)
+{
+    memset(pool, 0, sizeof(*pool));
+    pool->alg = alg;
+    pool->thread_count = threads > 0 ? threads : 1;
+    pool->window = 2 * pool->thread_count;
+    pool->threads = calloc(pool->thread_count, sizeof(pthread_t));
+    pool->blocks = calloc(pool->window, sizeof(zblock_job_t));
+    if (pool->threads == NULL || pool->blocks == NULL)
+    {
+        perror("Error allocating compression buffers");
+        exit(CREATE_FAIL);
+    }
+    for (size_t i = 0; i < pool->window; ++i)
+    {
+        pool->blocks[i].dst = malloc(compressBound(ZBLOCK_SIZE));
+        if (pool->blocks[i].dst == NULL)
+        {
+            perror("Error allocating compression buffers");
+            exit(CREATE_FAIL);
+        }
+    }
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->work, NULL);
+    pthread_cond_init(&pool->done, NULL);
+    for (int i = 0; i < pool->thread_count; ++i)
+    {
+        if (pthread_create(&pool->threads[i], NULL, compress_worker, pool) != 0)
+        {
+            fprintf(stderr, "Error starting compression thread\n");
+            exit(CREATE_FAIL);
+        }
+    }
+}
+
+// Stop the compression threads and free their buffers
+void compress_pool_stop(compress_pool_t * pool)
+{
+    pthread_mutex_lock(&pool->lock);
+    pool->shutdown = 1;
+    pthread_cond_broadcast(&pool->work);
+    pthread_mutex_unlock(&pool->lock);
+    for (int i = 0; i < pool->thread_count; ++i)
+    {
+        pthread_join(pool->threads[i], NULL);
+    }
+    for (size_t i = 0; i < pool->window; ++i)
+    {
+        free(pool->blocks[i].dst);
+    }
+    free(pool->blocks);
+    free(pool->threads);
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->work);
+    pthread_cond_destroy(&pool->done);
+}
+
+// Compression thread: deflate blocks of the current window
+void * compress_worker(void * arg)
+{
+    compress_pool_t * pool = (compress_pool_t *) arg;
+
+    for (;;)
+    {
+        zblock_job_t * block;
+        csum_t sum;
+        stats_mark_t mark;
+
+        pthread_mutex_lock(&pool->lock);
+        while (!pool->shutdown && pool->next_block == pool->block_count)
+        {
+            pthread_cond_wait(&pool->work, &pool->lock);
+        }
+        if (pool->shutdown)
+        {
+            pthread_mutex_unlock(&pool->lock);
+            break;
+        }
+        block = &pool->blocks[pool->next_block++];
+        pthread_mutex_unlock(&pool->lock);
+
+        csum_init(&sum, pool->alg);
+        csum_update(&sum, block->src, block->src_len);
+        block->crc = sum.value;
+        block->dst_len = compressBound(ZBLOCK_SIZE);
+        stats_mark(&mark);
+        block->raw = compress2((Bytef*) block->dst, &block->dst_len, (const Bytef*) block->src
+                               , block->src_len, Z_DEFAULT_COMPRESSION) != Z_OK
+                     || block->dst_len >= block->src_len;
+        stats_add(PHASE_ZLIB, &mark, block->src_len, 1);
+
+        pthread_mutex_lock(&pool->lock);
+        if (++pool->blocks_done == pool->block_count)
+        {
+            pthread_cond_signal(&pool->done);
+        }
+        pthread_mutex_unlock(&pool->lock);
+    }
+    return NULL;
+}
+
+// Compress the first count blocks of the window and wait for all of them
+void compress_window(compress_pool_t * pool, size_t count)
+{
+    pthread_mutex_lock(&pool->lock);
+    pool->block_count = count;
+    pool->next_block = 0;
+    pool->blocks_done = 0;
+    pthread_cond_broadcast(&pool->work);
+    while (pool->blocks_done < count)
+    {
+        pthread_cond_wait(&pool->done, &pool->lock);
+    }
+    pool->block_count = 0;
+    pool->next_block = 0;
+    pthread_mutex_unlock(&pool->lock);
+}
+
+// Write a mapped member as a zlib extended member, header included. The
+// header's size is patched in place when the archive can seek; on a pipe
+// or in O_DIRECT mode the compressed data is held back until the size is
+// known, in memory up to ZHOLD_WINDOWS windows of it and in a temporary
+// file past that. A member that fits in one block and does not shrink is
+// written as a plain member. Returns -1 after reporting a write error.
+int write_compressed_member(io_out_t * out, compress_pool_t * pool, char * filename, struct stat * st
+                            , const char * map, off_t file_size, arvik_header_t * header_out, off_t * stored_out
+                            , csum_t * sum)
+{
+    arvik_header_t header;
+    arvik_xheader_t xheader;
+    off_t header_off = out->block ? -1 : io_out_tell(out); // -1 on a pipe
+    off_t stored = sizeof(xheader);
+    off_t offset = 0;
+    uLong crc = sum->value;
+    out_buf_t held = { NULL, 0, 0, 0, NULL };
+    out_buf_t * hold = header_off < 0 ? &held : NULL;
+    int result = 0;
+
+    held.max = ZHOLD_WINDOWS * pool->window * (sizeof(arvik_zblock_t) + ZBLOCK_SIZE);
+    build_header(&header, filename, st);
+    set_field(header.arvik_size, sizeof(header.arvik_size), 0);
+    header.arvik_term[0] = ARVIK_XTERM;
+
+    memset(&xheader, ' ', sizeof(xheader));
+    memcpy(xheader.arvik_xtype, ARVIK_XTYPE_ZLIB, sizeof(xheader.arvik_xtype));
+    set_field(xheader.arvik_xsize, sizeof(xheader.arvik_xsize), file_size);
+    set_field(xheader.arvik_xarg, sizeof(xheader.arvik_xarg), ZBLOCK_SIZE);
+    xheader.arvik_xterm[0] = '+';
+    xheader.arvik_xterm[1] = '\n';
+
+    while (offset < file_size && result == 0)
+    {
+        size_t count = 0;
+
+        // Hand the threads a window of blocks
+        while (count < pool->window && offset < file_size)
+        {
+            pool->blocks[count].src = map + offset;
+            pool->blocks[count].src_len = MIN(ZBLOCK_SIZE, file_size - offset);
+            offset += pool->blocks[count].src_len;
+            count++;
+        }
+        compress_window(pool, count);
+
+        // Small incompressible member: store it plain
+        if (stored == sizeof(xheader) && offset == file_size && count == 1 && pool->blocks[0].raw)
+        {
+            free(held.data);
+            sum->value = pool->blocks[0].crc;
+            return write_plain_mapped(out, filename, st, map, file_size, header_out, stored_out);
+        }
+
+        if (stored == sizeof(xheader)
+            && (emit_bytes(out, hold, &header, sizeof(header)) < 0
+                || emit_bytes(out, hold, &xheader, sizeof(xheader)) < 0))
+        {
+            result = -1;
+        }
+
+        // Blocks go out in order
+        for (size_t i = 0; i < count && result == 0; ++i)
+        {
+            zblock_job_t * block = &pool->blocks[i];
+            arvik_zblock_t block_header;
+            size_t len = block->raw ? block->src_len : block->dst_len;
+
+            memset(&block_header, ' ', sizeof(block_header));
+            block_header.arvik_zkind[0] = block->raw ? 'r' : 'z';
+            set_field(block_header.arvik_zlen, sizeof(block_header.arvik_zlen), len);
+            block_header.arvik_zterm[0] = '+';
+            block_header.arvik_zterm[1] = '\n';
+            if (emit_bytes(out, hold, &block_header, sizeof(block_header)) < 0
+                || emit_bytes(out, hold, block->raw ? block->src : block->dst, len) < 0)
+            {
+                result = -1;
+            }
+            crc = csum_combine(sum->alg, crc, block->crc, block->src_len);
+            stored += sizeof(block_header) + len;
+        }
+    }
+
+    // Now the stored size is known
+    set_field(header.arvik_size, sizeof(header.arvik_size), stored);
+    if (result == 0)
+    {
+        if (hold == NULL)
+        {
+            // The header may still be batched
+            if (io_out_flush(out) < 0 || pwrite(out->fd, &header, sizeof(header), header_off) != sizeof(header))
+            {
+                result = -1;
+            }
+        }
+        else if (held.spill != NULL)
+        {
+            result = write_spilled(out, held.spill, &header);
+        }
+        else
+        {
+            memcpy(held.data, &header, sizeof(header));
+            if (io_out_write(out, held.data, held.len) < 0)
+            {
+                result = -1;
+            }
+        }
+    }
+    if (result < 0)
+    {
+        fprintf(stderr, "Error writing data for %s: %s\n", filename, map_write_error());
+    }
+    free(held.data);
+    if (held.spill != NULL)
+    {
+        fclose(held.spill);
+    }
+
+    *header_out = header;
+    *stored_out = stored;
+    sum->value = crc;
+    return result;
+}
+
+// Write a mapped member plain, header included, for write_compressed_member()
+// when compressing it does not pay
+int write_plain_mapped(io_out_t * out, char * filename, struct stat * st, const char * map, off_t file_size
+                       , arvik_header_t * header_out, off_t * stored_out)
+{
+    record_out_t dest = { out_put, out };
+
+    *stored_out = file_size;
+    if (put_header(&dest, filename, st, header_out) < 0 || io_out_write(out, map, file_size) < 0)
+    {
+        fprintf(stderr, "Error writing data for %s: %s\n", filename, map_write_error());
+        return -1;
+    }
+    return 0;
+}
+
+// Write bytes to the archive, or keep them in held when it is not NULL
+int emit_bytes(io_out_t * out, out_buf_t * held, const void * data, size_t len)
+{
+    if (held == NULL)
+    {
+        return io_out_write(out, data, len);
+    }
+    // Too much for memory: move what is held to a temporary file
+    if (held->spill == NULL && held->len + len > held->max)
+    {
+        held->spill = tmpfile();
+        if (held->spill == NULL || fwrite(held->data, 1, held->len, held->spill) != held->len)
+        {
+            return -1;
+        }
+        held->len = 0;
+    }
+    if (held->spill != NULL)
+    {
+        return fwrite(data, 1, len, held->spill) == len ? 0 : -1;
+    }
+    if (held->len + len > held->capacity)
+    {
+        size_t capacity = held->capacity ? held->capacity : io_block_size;
+        char * grown;
+
+        while (held->len + len > capacity)
+        {
+            capacity *= 2;
+        }
+        grown = realloc(held->data, capacity);
+        if (grown == NULL)
+        {
+            errno = ENOMEM;
+            return -1;
+        }
+        held->data = grown;
+        held->capacity = capacity;
+    }
+    memcpy(held->data + held->len, data, len);
+    held->len += len;
+    return 0;
+}
+
+// Copy a member that emit_bytes() spilled to the archive, with its final
+// header in place of the one written first
+int write_spilled(io_out_t * out, FILE * spill, const arvik_header_t * header)
+{
+    int fd = fileno(spill);
+    char * buffer;
+    ssize_t bytes_read;
+    off_t pos = 0;
+    int result = 0;
+
+    if (fflush(spill) != 0 || pwrite(fd, header, sizeof(*header), 0) != sizeof(*header))
+    {
+        return -1;
+    }
+    buffer = io_alloc(io_block_size);
+    if (buffer == NULL)
+    {
+        return -1;
+    }
+    while (result == 0 && (bytes_read = stats_pread(fd, buffer, io_block_size, pos)) > 0)
+    {
+        pos += bytes_read;
+        result = io_out_write(out, buffer, bytes_read);
+    }
+    if (bytes_read < 0)
+    {
+        result = -1;
+    }
+    free(buffer);
+    return result;
+}
+
+// Create the archive with several threads. Every member's header, data
+// and footer offset follows from the fstat sizes, so the archive is laid
+// out first and workers pwrite pieces of members into their slots. The
+// result is byte-identical to the serial path. A member whose size changes
+// during the copy fails the whole run and removes the archive. Returns -1
+// without writing anything if some member is not a regular file, or may
+// be sparse under -S, or has a name too long for its header.
+int create_parallel(int archive_fd, char * archive_name, char ** members, int member_count
+                    , create_options_t * opts)
+{
+    create_pool_t pool;
+    pthread_t * threads;
+    struct stat st;
+    off_t off = strlen(ARVIK_TAG);
+    size_t chunk_capacity = 0;
+    char ** open_errors;
+    int thread_count;
+    int err;
+
+    if (fstat(archive_fd, &st) < 0 || !S_ISREG(st.st_mode))
+    {
+        return -1;
+    }
+
+    memset(&pool, 0, sizeof(pool));
+    pool.archive_fd = archive_fd;
+    pool.alg = opts->csum;
+    pool.members = calloc(member_count, sizeof(create_member_t));
+    open_errors = calloc(member_count, sizeof(char *));
+    if (pool.members == NULL || open_errors == NULL)
+    {
+        perror("Error allocating member plan");
+        exit(CREATE_FAIL);
+    }
+
+    // Lay out the archive
+    for (int i = 0; i < member_count; ++i)
+    {
+        create_member_t * member;
+        int member_fd;
+        char message[512];
+
+        member_fd = stats_open(members[i], O_RDONLY, 0);
+        if (member_fd < 0)
+        {
+            snprintf(message, sizeof(message), "Error opening member file %s: %s\n", members[i], strerror(errno));
+            open_errors[i] = strdup(message);
+            continue;
+        }
+        if (stats_fstat(member_fd, &st) < 0)
+        {
+            snprintf(message, sizeof(message), "Error getting file information for %s: %s\n", members[i], strerror(errno));
+            open_errors[i] = strdup(message);
+            stats_close(member_fd);
+            continue;
+        }
+        stats_close(member_fd);
+
+        // Only regular files have a size we can trust up front, sparse ones
+        // need their holes mapped, and long names need a record ahead of
+        // the member, all of which the serial path does
+        if (!S_ISREG(st.st_mode) || (opts->sparse && maybe_sparse(&st)) || needs_long_name(members[i]))
+        {
+            for (int j = 0; j < member_count; ++j)
+            {
+                free(open_errors[j]);
+            }
+            for (size_t j = 0; j < pool.member_count; ++j)
+            {
+                free(pool.members[j].chunk_crc);
+            }
+            free(open_errors);
+            free(pool.members);
+            free(pool.chunks);
+            return -1;
+        }
+
+        member = &pool.members[pool.member_count++];
+        member->name = members[i];
+        build_header(&member->header, members[i], &st);
+        member->header_off = off;
+        member->data_off = off + sizeof(arvik_header_t);
+        member->file_size = st.st_size;
+        member->chunks = st.st_size ? (st.st_size + PARALLEL_CHUNK - 1) / PARALLEL_CHUNK : 1;
+        member->chunks_left = member->chunks;
+        member->chunk_crc = calloc(member->chunks, sizeof(uLong));
+        if (member->chunk_crc == NULL)
+        {
+            perror("Error allocating member plan");
+            exit(CREATE_FAIL);
+        }
+        off = member->data_off + st.st_size + (st.st_size % 2) + sizeof(arvik_footer_t);
+
+        for (int c = 0; c < member->chunks; ++c)
+        {
+            if (pool.chunk_count == chunk_capacity)
+            {
+                chunk_capacity = chunk_capacity ? chunk_capacity * 2 : 256;
+                pool.chunks = realloc(pool.chunks, chunk_capacity * sizeof(create_chunk_t));
+                if (pool.chunks == NULL)
+                {
+                    perror("Error allocating member plan");
+                    exit(CREATE_FAIL);
+                }
+            }
+            pool.chunks[pool.chunk_count].member = pool.member_count - 1;
+            pool.chunks[pool.chunk_count].chunk = c;
+            pool.chunk_count++;
+        }
+    }
+
+    for (int i = 0; i < member_count; ++i)
+    {
+        if (open_errors[i] != NULL)
+        {
+            fputs(open_errors[i], stderr);
+            free(open_errors[i]);
+        }
+    }
+    free(open_errors);
+    if (opts->verbose)
+    {
+        for (size_t i = 0; i < pool.member_count; ++i)
+        {
+            printf("a - %s\n", pool.members[i].name);
+        }
+    }
+
+    // Reserve the whole archive so workers write into allocated space
+    err = posix_fallocate(archive_fd, 0, off);
+    if (err != 0 && err != EOPNOTSUPP && err != EINVAL)
+    {
+        fprintf(stderr, "Error allocating archive space: %s\n", strerror(err));
+        exit(CREATE_FAIL);
+    }
+    if (ftruncate(archive_fd, off) < 0
+        || pwrite(archive_fd, ARVIK_TAG, strlen(ARVIK_TAG), 0) != (ssize_t) strlen(ARVIK_TAG))
+    {
+        perror("Error writing archive tag");
+        exit(CREATE_FAIL);
+    }
+
+    pthread_mutex_init(&pool.lock, NULL);
+    thread_count = MIN((size_t) opts->jobs, pool.chunk_count);
+    threads = malloc((thread_count + 1) * sizeof(pthread_t));
+    if (threads == NULL)
+    {
+        perror("Error allocating threads");
+        exit(CREATE_FAIL);
+    }
+    for (int i = 0; i < thread_count; ++i)
+    {
+        if (pthread_create(&threads[i], NULL, create_worker, &pool) != 0)
+        {
+            fprintf(stderr, "Error starting create thread\n");
+            exit(CREATE_FAIL);
+        }
+    }
+    for (int i = 0; i < thread_count; ++i)
+    {
+        pthread_join(threads[i], NULL);
+    }
+    free(threads);
+    pthread_mutex_destroy(&pool.lock);
+
+    if (pool.failed)
+    {
+        for (size_t i = 0; i < pool.member_count; ++i)
+        {
+            if (pool.members[i].failed)
+            {
+                fputs(pool.members[i].message, stderr);
+            }
+        }
+        if (archive_name != NULL)
+        {
+            unlink(archive_name);
+        }
+        exit(CREATE_FAIL);
+    }
+
+    if (opts->write_index)
+    {
+        arvik_index_t index = { NULL, 0, 0 };
+        arvik_footer_t footer;
+        io_out_t out;
+
+        for (size_t i = 0; i < pool.member_count; ++i)
+        {
+            build_footer(&footer, pool.alg, pool.members[i].crc);
+            index_add(&index, &pool.members[i].header, pool.members[i].data_off, &footer);
+        }
+        if (lseek(archive_fd, off, SEEK_SET) < 0)
+        {
+            perror("Error seeking to end of archive");
+            exit(CREATE_FAIL);
+        }
+        io_out_start(&out, archive_fd);
+        write_index_member(&out, &index, off, pool.alg);
+        io_out_finish(&out);
+        free(index.entries);
+    }
+
+    for (size_t i = 0; i < pool.member_count; ++i)
+    {
+        free(pool.members[i].chunk_crc);
+    }
+    free(pool.members);
+    free(pool.chunks);
+    return 0;
+}
+
+// Worker thread: copy pieces of members until none are left
+void * create_worker(void * arg)
+{
+    create_pool_t * pool = (create_pool_t *) arg;
+    char * buffer = io_alloc(io_block_size);
+
+    if (buffer == NULL)
+    {
+        perror("Error allocating create buffer");
+        exit(CREATE_FAIL);
+    }
+    for (;;)
+    {
+        create_chunk_t * chunk;
+
+        pthread_mutex_lock(&pool->lock);
+        if (pool->next_chunk == pool->chunk_count || pool->failed)
+        {
+            pthread_mutex_unlock(&pool->lock);
+            break;
+        }
+        chunk = &pool->chunks[pool->next_chunk++];
+        pthread_mutex_unlock(&pool->lock);
+
+        create_chunk_run(pool, chunk, buffer);
+    }
+    free(buffer);
+    return NULL;
+}
+
+// Copy one piece of a member into its slot. The first piece also writes
+// the header; whichever piece finishes last combines the CRCs and writes
+// the padding and footer.
+void create_chunk_run(create_pool_t * pool, create_chunk_t * chunk, char * buffer)
+{
+    create_member_t * member = &pool->members[chunk->member];
+    off_t start = (off_t) chunk->chunk * PARALLEL_CHUNK;
+    off_t length = MIN(PARALLEL_CHUNK, member->file_size - start);
+    off_t copied = 0;
+    csum_t sum;
+    char message[512] = {'\0'};
+    struct stat st;
+    int member_fd;
+    int chunks_left;
+
+    if (chunk->chunk == 0)
+    {
+        stats_mark(&member->started);
+    }
+    csum_init(&sum, pool->alg);
+    if (chunk->chunk == 0
+        && stats_pwrite(pool->archive_fd, &member->header, sizeof(arvik_header_t), member->header_off)
+           != sizeof(arvik_header_t))
+    {
+        snprintf(message, sizeof(message), "Error writing header for %s: %s\n", member->name, strerror(errno));
+    }
+
+    member_fd = stats_open(member->name, O_RDONLY, 0);
+    if (message[0] == '\0' && member_fd < 0)
+    {
+        snprintf(message, sizeof(message), "Error opening member file %s: %s\n", member->name, strerror(errno));
+    }
+    while (message[0] == '\0' && copied < length)
+    {
+        ssize_t bytes_read = stats_pread(member_fd, buffer, MIN((off_t) io_block_size, length - copied)
+                                         , start + copied);
+
+        if (bytes_read <= 0)
+        {
+            snprintf(message, sizeof(message), "Error reading %s: %s\n", member->name
+                     , bytes_read == 0 ? "file changed size while archiving" : strerror(errno));
+            break;
+        }
+        csum_update(&sum, buffer, bytes_read);
+        if (stats_pwrite(pool->archive_fd, buffer, bytes_read, member->data_off + start + copied) != bytes_read)
+        {
+            snprintf(message, sizeof(message), "Error writing data for %s: %s\n", member->name, strerror(errno));
+            break;
+        }
+        copied += bytes_read;
+    }
+
+    // The last piece also makes sure the file did not grow
+    if (message[0] == '\0' && start + length == member->file_size
+        && (stats_pread(member_fd, buffer, 1, member->file_size) != 0
+            || stats_fstat(member_fd, &st) < 0 || st.st_size != member->file_size))
+    {
+        snprintf(message, sizeof(message), "Error reading %s: file changed size while archiving\n", member->name);
+    }
+    if (member_fd >= 0)
+    {
+        stats_close(member_fd);
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    member->chunk_crc[chunk->chunk] = sum.value;
+    if (message[0] != '\0' && !member->failed)
+    {
+        member->failed = 1;
+        pool->failed = 1;
+        memcpy(member->message, message, sizeof(message));
+    }
+    chunks_left = --member->chunks_left;
+    pthread_mutex_unlock(&pool->lock);
+
+    if (chunks_left == 0 && !member->failed)
+    {
+        char tail[TAIL_MAX];
+        size_t tail_len;
+
+        member->crc = member->chunk_crc[0];
+        for (int c = 1; c < member->chunks; ++c)
+        {
+            off_t piece = MIN(PARALLEL_CHUNK, member->file_size - (off_t) c * PARALLEL_CHUNK);
+
+            member->crc = csum_combine(pool->alg, member->crc, member->chunk_crc[c], piece);
+        }
+        tail_len = build_tail(tail, pool->alg, member->crc, member->file_size);
+        if (stats_pwrite(pool->archive_fd, tail, tail_len, member->data_off + member->file_size)
+            != (ssize_t) tail_len)
+        {
+            pthread_mutex_lock(&pool->lock);
+            member->failed = 1;
+            pool->failed = 1;
+            snprintf(member->message, sizeof(member->message), "Error writing footer for %s: %s\n"
+                     , member->name, strerror(errno));
+            pthread_mutex_unlock(&pool->lock);
+        }
+        stats_member(member->name, member->file_size, &member->started);
+    }
+}
+
+// Start a checksum
+void csum_init(csum_t * sum, arvik_csum_alg_t alg)
+{
+    sum->alg = alg;
+    sum->value = 0;
+    sum->also = NULL;
+}
+
+// Add bytes to a checksum
+void csum_update(csum_t * sum, const void * buffer, size_t len)
+{
+    stats_mark_t mark;
+
+    if (sum->also != NULL)
+    {
+        csum_update(sum->also, buffer, len);
+    }
+    stats_mark(&mark);
+    sum->value = csum_bytes(sum->alg, sum->value, buffer, len);
+    stats_add(PHASE_CRC, &mark, len, 1);
+}
+
+// Extend a checksum over len zero bytes without reading them
+void csum_zeros(csum_t * sum, off_t len)
+{
+    if (sum->also != NULL)
+    {
+        csum_zeros(sum->also, len);
+    }
+    sum->value = csum_zero_bytes(sum->alg, sum->value, len);
+}
+
+// Checksum the first size bytes of an open file
+int csum_file(int fd, arvik_csum_alg_t alg, off_t size, csum_t * sum)
+{
+    char * buffer = io_alloc(io_block_size);
+    off_t done = 0;
+
+    if (buffer == NULL)
+    {
+        return -1;
+    }
+    csum_init(sum, alg);
+    while (done < size)
+    {
+        ssize_t bytes_read = stats_pread(fd, buffer, MIN((off_t) io_block_size, size - done), done);
+
+        if (bytes_read <= 0)
+        {
+            free(buffer);
+            return -1;
+        }
+        csum_update(sum, buffer, bytes_read);
+        done += bytes_read;
+    }
+    free(buffer);
+    return 0;
+}
+
+// Write file header to archive, from the fstat of the opened file
+void write_header(io_out_t * out, char * filename, struct stat * st, arvik_header_t * header_out)
+{
+    record_out_t dest = { out_put, out };
+
+    if (put_header(&dest, filename, st, header_out) < 0)
+    {
+        perror("Error writing header");
+    }
+}
+
+// Let the library's record writers put bytes to out
+int out_put(record_out_t * dest, const void * data, size_t len)
+{
+    return io_out_write(dest->arg, data, len) < 0 ? ARVIK_ERR_IO : 0;
+}
+
+/*
+    // Fill in header fields
+    name_len = strlen(filename);
+    memcpy(header.arvik_name, filename, MIN(name_len, sizeof(header.arvik_name) -1));
+    header.arvik_name[name_len] = ARVIK_NAME_TERM;
+
+    sprintf(date_buff, "%ld", st.st_mtime);
+    date_len = strlen(date_buff);
+    memcpy(header.arvik_date + sizeof(header.arvik_date) - date_len -1, date_buff, date_len);
+
+    sprintf(uid_buf, "%d", st.st_uid);
+    uid_len = strlen(uid_buf);
+    memcpy(header.arvik_uid + sizeof(header.arvik_uid) - uid_len - 1, 
+           uid_buf, uid_len);
+    
+    // Format GID (right-aligned)
+    sprintf(gid_buf, "%d", st.st_gid);
+    gid_len = strlen(gid_buf);
+    memcpy(header.arvik_gid + sizeof(header.arvik_gid) - gid_len - 1, 
+           gid_buf, gid_len);
+    
+    // Format mode (right-aligned)
+    sprintf(mode_buf, "%o", st.st_mode);
+    mode_len = strlen(mode_buf);
+    memcpy(header.arvik_mode + sizeof(header.arvik_mode) - mode_len - 1, 
+           mode_buf, mode_len);
+    
+    // Format size (right-aligned)
+    sprintf(size_buf, "%ld", st.st_size);
+    size_len = strlen(size_buf);
+    memcpy(header.arvik_size + sizeof(header.arvik_size) - size_len - 1, 
+           size_buf, size_len);
+
+    strncpy(header.arvik_name, filename, sizeof(header.arvik_name) -1);
+    sprintf(header.arvik_date, "%ld", st.st_mtime); // Convert modification time to string
+    sprintf(header.arvik_uid, "%d", st.st_uid);  // Convert UID to string
+    sprintf(header.arvik_gid, "%d", st.st_gid); // Convert GID to string
+    sprintf(header.arvik_mode, "%o", st.st_mode); // Convert mode to octal string
+    sprintf(header.arvik_size, "%ld", st.st_size); // Convert size to string
+    // Set terminator
+    header.arvik_term[0] = '+';
+    header.arvik_term[1] = '\n';
+
+    // Write the header to the archive
+    if (write(archive_fd, &header, sizeof(header)) != sizeof(header))
+    {
+        perror("Error writing header");
+    }
+    */
+
+// Remember where a member landed for the trailing index
+void index_add(arvik_index_t * index, arvik_header_t * header, off_t data_off, arvik_footer_t * footer)
+{
+    arvik_index_entry_t * entry;
+    char temp[32];
+
+    if (index->count == index->capacity)
+    {
+        index->capacity = index->capacity ? index->capacity * 2 : 256;
+        index->entries = realloc(index->entries, index->capacity * sizeof(arvik_index_entry_t));
+        if (index->entries == NULL)
+        {
+            perror("Error allocating member index");
+            exit(CREATE_FAIL);
+        }
+    }
+    entry = &index->entries[index->count++];
+    memset(entry, ' ', sizeof(*entry));
+    entry->arvik_header = *header;
+
+    sprintf(temp, "%ld", data_off);
+    memcpy(entry->arvik_data_off, temp, strlen(temp));
+    memcpy(entry->arvik_data_crc, footer->arvik_data_crc, sizeof(entry->arvik_data_crc));
+
+    entry->arvik_term[0] = '+';
+    entry->arvik_term[1] = '\n';
+}
+
+// Find the entry of the member whose data starts at data_off. Entries must
+// be in archive order, as index_add() leaves them. NULL if there is none.
+arvik_index_entry_t * index_find(arvik_index_t * index, off_t data_off)
+{
+    size_t low = 0;
+    size_t high = index->count;
+
+    while (low < high)
+    {
+        size_t mid = low + (high - low) / 2;
+        off_t mid_off = field_value(index->entries[mid].arvik_data_off
+                                    , sizeof(index->entries[mid].arvik_data_off), 10);
+
+        if (mid_off == data_off)
+        {
+            return &index->entries[mid];
+        }
+        if (mid_off < data_off)
+        {
+            low = mid + 1;
+        }
+        else
+        {
+            high = mid;
+        }
+    }
+    return NULL;
+}
+
+// Write the index member: entries, then the trailer that locates them
+void write_index_member(io_out_t * out, arvik_index_t * index, off_t index_off, arvik_csum_alg_t alg)
+{
+    arvik_header_t header;
+    arvik_index_trailer_t trailer;
+    size_t entries_len = index->count * sizeof(arvik_index_entry_t);
+    off_t data_len = entries_len + sizeof(trailer);
+    csum_t sum;
+    char temp[32];
+
+    memset(&trailer, ' ', sizeof(trailer));
+    memcpy(trailer.arvik_magic, ARVIK_INDEX_MAGIC, sizeof(trailer.arvik_magic));
+    sprintf(temp, "%zu", index->count);
+    memcpy(trailer.arvik_count, temp, strlen(temp));
+    sprintf(temp, "%ld", index_off);
+    memcpy(trailer.arvik_index_off, temp, strlen(temp));
+    trailer.arvik_term[0] = '+';
+    trailer.arvik_term[1] = '\n';
+
+    memset(&header, ' ', sizeof(header));
+    memcpy(header.arvik_name, ARVIK_INDEX_NAME, strlen(ARVIK_INDEX_NAME));
+    header.arvik_name[strlen(ARVIK_INDEX_NAME)] = '/';
+    sprintf(temp, "%ld", time(NULL));
+    memcpy(header.arvik_date, temp, strlen(temp));
+    header.arvik_uid[0] = '0';
+    header.arvik_gid[0] = '0';
+    sprintf(temp, "%o", S_IFREG | 0444);
+    memcpy(header.arvik_mode, temp, strlen(temp));
+    sprintf(temp, "%ld", data_len);
+    memcpy(header.arvik_size, temp, strlen(temp));
+    header.arvik_term[0] = '+';
+    header.arvik_term[1] = '\n';
+
+    csum_init(&sum, alg);
+    csum_update(&sum, index->entries, entries_len);
+    csum_update(&sum, &trailer, sizeof(trailer));
+
+    if (io_out_write(out, &header, sizeof(header)) < 0
+        || io_out_write(out, index->entries, entries_len) < 0
+        || io_out_write(out, &trailer, sizeof(trailer)) < 0)
+    {
+        perror("Error writing member index");
+        return;
+    }
+    write_footer(out, alg, sum.value, data_len);
+}
+
+// Read the trailing index of a seekable archive. Returns 0 and a malloc'd
+// entry array on success, -1 if the archive has no usable index.
+int load_index(int archive_fd, arvik_index_entry_t ** entries, size_t * count)
+{
+    struct stat st;
+    arvik_index_trailer_t trailer;
+    arvik_header_t header;
+    arvik_footer_t footer;
+    off_t trailer_off;
+    off_t index_off;
+    size_t entries_len;
+
+    if (fstat(archive_fd, &st) < 0 || !S_ISREG(st.st_mode))
+    {
+        return -1;
+    }
+    trailer_off = st.st_size - sizeof(footer) - sizeof(trailer);
+    if (trailer_off < (off_t) strlen(ARVIK_TAG))
+    {
+        return -1;
+    }
+    if (pread(archive_fd, &trailer, sizeof(trailer), trailer_off) != sizeof(trailer)
+        || pread(archive_fd, &footer, sizeof(footer), trailer_off + sizeof(trailer)) != sizeof(footer))
+    {
+        return -1;
+    }
+    if (memcmp(trailer.arvik_magic, ARVIK_INDEX_MAGIC, sizeof(trailer.arvik_magic)) != 0
+        || trailer.arvik_term[0] != '+' || trailer.arvik_term[1] != '\n'
+        || !footer_term_ok(&footer))
+    {
+        return -1;
+    }
+
+    *count = field_value(trailer.arvik_count, sizeof(trailer.arvik_count), 10);
+    entries_len = *count * sizeof(arvik_index_entry_t);
+    if ((off_t) *count < 0 || (off_t) entries_len > trailer_off)
+    {
+        return -1;
+    }
+
+    // A member's last bytes can look like a trailer. Only take it if it
+    // points at an index member that ends right where the trailer does.
+    index_off = field_value(trailer.arvik_index_off, sizeof(trailer.arvik_index_off), 10);
+    if (index_off < (off_t) strlen(ARVIK_TAG)
+        || index_off + (off_t) (sizeof(header) + entries_len) != trailer_off
+        || pread(archive_fd, &header, sizeof(header), index_off) != sizeof(header)
+        || !header_term_ok(&header) || !is_index_member(&header)
+        || field_value(header.arvik_size, sizeof(header.arvik_size), 10) != (off_t) (entries_len + sizeof(trailer)))
+    {
+        return -1;
+    }
+    *entries = malloc(entries_len ? entries_len : 1);
+    if (*entries == NULL)
+    {
+        return -1;
+    }
+    // One read for the whole table
+    if (pread(archive_fd, *entries, entries_len, trailer_off - entries_len) != (ssize_t) entries_len)
+    {
+        free(*entries);
+        return -1;
+    }
+    return 0;
+}
+
+// Write the long name record of a member about to be written at
+// header_off, and index it if index is not NULL. Returns the bytes
+// written, or -1.
+off_t write_long_name(io_out_t * out, char * filename, arvik_csum_alg_t alg, off_t header_off, arvik_index_t * index)
+{
+    record_out_t dest = { out_put, out };
+    off_t len = strlen(stored_name(filename));
+    arvik_header_t header;
+    arvik_footer_t footer;
+    uLong crc;
+
+    if (put_long_name(&dest, filename, alg, &header, &crc) < 0)
+    {
+        fprintf(stderr, "Error writing name of %s: %s\n", filename, strerror(errno));
+        return -1;
+    }
+    if (index != NULL)
+    {
+        build_footer(&footer, alg, crc);
+        index_add(index, &header, header_off + sizeof(header), &footer);
+    }
+    return sizeof(header) + len + (len % 2) + sizeof(footer);
+}
+
+// Read the name a long name record carries into long_name, which holds
+// ARVIK_PATH_MAX bytes, after its header was read. A record too long to be
+// a name is skipped and leaves long_name empty. Returns -1 if the archive
+// cannot be read.
+int read_long_name(archive_reader_t * in, arvik_header_t * header, char * long_name)
+{
+    off_t len = field_value(header->arvik_size, sizeof(header->arvik_size), 10);
+    arvik_footer_t footer;
+
+    long_name[0] = '\0';
+    if (!header_term_ok(header))
+    {
+        return -1;
+    }
+    if (len < 0 || len >= ARVIK_PATH_MAX)
+    {
+        skip_member(in, header);
+        return 0;
+    }
+    if (reader_read(in, long_name, len) != len || reader_skip(in, len % 2) < 0
+        || reader_read(in, &footer, sizeof(footer)) != sizeof(footer) || !footer_term_ok(&footer))
+    {
+        long_name[0] = '\0';
+        return -1;
+    }
+    long_name[len] = '\0';
+    return 0;
+}
+
+// Read the name an indexed long name record carries, as read_long_name()
+// does. A record that cannot be read leaves long_name empty.
+void entry_long_name(int archive_fd, arvik_index_entry_t * entry, char * long_name)
+{
+    off_t len = field_value(entry->arvik_header.arvik_size, sizeof(entry->arvik_header.arvik_size), 10);
+    off_t data_off = field_value(entry->arvik_data_off, sizeof(entry->arvik_data_off), 10);
+
+    long_name[0] = '\0';
+    if (len >= 0 && len < ARVIK_PATH_MAX && pread(archive_fd, long_name, len, data_off) == len)
+    {
+        long_name[len] = '\0';
+    }
+}
+
+// Write file footer to archive
+void write_footer(io_out_t * out, arvik_csum_alg_t alg, uLong crc, off_t file_size)
+{
+    record_out_t dest = { out_put, out };
+
+    if (put_footer(&dest, alg, crc, file_size) < 0)
+    {
+        perror("Error writing footer");
+    }
+}
+
+// Footer for a member that failed part way: its terminator is bad, so
+// every reader stops there instead of trusting the data
+void write_bad_footer(io_out_t * out, off_t file_size)
+{
+    arvik_footer_t footer;
+
+    memset(&footer, '!', sizeof(footer));
+    if (file_size % 2 != 0)
+    {
+        char padding = '\n';
+        io_out_write(out, &padding, 1);
+    }
+    io_out_write(out, &footer, sizeof(footer));
+}
+
+// Extract files from archive; returns the exit status
+int extract_archive(char * archive_name, int verbose, int validate, char ** patterns, int pattern_count, int jobs)
+{
+    arvik_header_t header;
+    int archive_fd; // File descriptor for the archive file
+    char buffer[100] = {'\0'};
+    ssize_t bytes_read = 0;
+    struct stat st;
+    char * map = NULL; // Read-only view of a regular-file archive
+    off_t map_size = 0;
+    arvik_index_entry_t * entries = NULL;
+    size_t entry_count = 0;
+    char * matched = NULL; // Which patterns found a member
+    int unmatched = 0;
+    archive_reader_t in;
+    char long_name[ARVIK_PATH_MAX] = {'\0'}; // from the record before the next member
+    int status = EXIT_SUCCESS;
+
+    if (pattern_count > 0)
+    {
+        matched = calloc(pattern_count, 1);
+        if (matched == NULL)
+        {
+            perror("Error allocating pattern table");
+            return EXTRACT_FAIL;
+        }
+    }
+
+    if (archive_name == NULL)
+    {
+        archive_fd = STDIN_FILENO; // Use standard input
+    }
+    else
+    {
+        archive_fd = open(archive_name, O_RDONLY);
+        if (archive_fd < 0)
+        {
+            perror("Error opening archive file for reading");
+            free(matched);
+            return EXTRACT_FAIL;
+        }
+    }
+    if (reader_open(&in, archive_fd) < 0)
+    {
+        perror("Error allocating read buffer");
+        free(matched);
+        close(archive_fd);
+        return EXTRACT_FAIL;
+    }
+        
+    bytes_read = reader_read(&in, buffer, strlen(ARVIK_TAG));
+    if (strncmp(buffer, ARVIK_TAG, strlen(ARVIK_TAG)) != 0)
+    {
+        fprintf(stderr, "Error, not a correct arvik archive file\n");
+        free(matched);
+        reader_close(&in);
+        close(archive_fd);
+        return BAD_TAG;
+    }
+
+    // Regular-file archives are mapped so member data can be copied and
+    // checksummed without going through a user buffer
+    if (fstat(archive_fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0)
+    {
+        map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, archive_fd, 0);
+        if (map == MAP_FAILED)
+        {
+            map = NULL;
+        }
+        else
+        {
+            map_size = st.st_size;
+            madvise(map, map_size, MADV_SEQUENTIAL);
+            reader_use_map(&in, map, map_size);
+        }
+    }
+    posix_fadvise(archive_fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    // A stream's footers come after the data, too late to compare with
+    if (skip_unchanged == SKIP_CRC && map == NULL)
+    {
+        fprintf(stderr, "--skip-unchanged=crc needs a seekable archive; comparing size and mtime only\n");
+        skip_unchanged = SKIP_STAT;
+    }
+
+    umask(0);
+    if (jobs > 1 && map != NULL)
+    {
+        extract_parallel(archive_fd, map, map_size, verbose, validate, jobs, patterns, pattern_count, matched);
+        bytes_read = 0;
+    }
+    else if (io_uring_wanted && !io_direct && map != NULL
+             && extract_uring(archive_fd, map, map_size, verbose, validate, patterns, pattern_count, matched) == 0)
+    {
+        bytes_read = 0;
+    }
+    else if (pattern_count > 0 && load_index(archive_fd, &entries, &entry_count) == 0)
+    {
+        // Seek straight to each selected member found in the index
+        for (size_t i = 0; i < entry_count; ++i)
+        {
+            off_t header_off;
+
+            if (is_long_name_member(&entries[i].arvik_header))
+            {
+                entry_long_name(archive_fd, &entries[i], long_name);
+                continue;
+            }
+            if (member_selected(&entries[i].arvik_header, long_name, patterns, pattern_count, matched))
+            {
+                header_off = strtoll(entries[i].arvik_data_off, NULL, 10) - sizeof(header);
+                if (reader_seek(&in, header_off) < 0
+                    || reader_read(&in, &header, sizeof(header)) != sizeof(header))
+                {
+                    fprintf(stderr, "Error: Failed to read header\n");
+                    status = READ_FAIL;
+                    break;
+                }
+                extract_file(&in, header, long_name, verbose, validate, map, map_size);
+            }
+            long_name[0] = '\0';
+        }
+        free(entries);
+        bytes_read = 0;
+    }
+    else
+    {
+        while ((bytes_read = reader_read(&in, &header, sizeof(header))) > 0)
+        {
+            if (is_long_name_member(&header))
+            {
+                if (read_long_name(&in, &header, long_name) < 0)
+                {
+                    fprintf(stderr, "Error reading member name\n");
+                    status = READ_FAIL;
+                    break;
+                }
+                continue;
+            }
+            if (pattern_count > 0 && !member_selected(&header, long_name, patterns, pattern_count, matched))
+            {
+                // Step over the data without reading it
+                skip_member(&in, &header);
+                long_name[0] = '\0';
+                continue;
+            }
+            // Keep walking after a match: a later member of the same
+            // name replaces it, as it would in a full extract
+            extract_file(&in, header, long_name, verbose, validate, map, map_size);
+            long_name[0] = '\0';
+        }
+    }
+    finish_dirs();
+    // Patterns are only known unmatched once the whole archive was read
+    for (int i = 0; status == EXIT_SUCCESS && i < pattern_count; ++i)
+    {
+        if (!matched[i])
+        {
+            fprintf(stderr, "%s: not found in archive\n", patterns[i]);
+            unmatched = 1;
+        }
+    }
+    free(matched);
+    reader_close(&in);
+    if (map != NULL)
+    {
+        munmap(map, map_size);
+    }
+    if (io_direct)
+    {
+        drop_cache(archive_fd);
+    }
+    
+    /*// Close file if not stdin
+    if (archive_fd != STDIN_FILENO)
+    {
+        close (archive_fd);
+    }
+    */
+    if (bytes_read < 0)
+    {
+        fprintf(stderr, "Error: Failed to read header\n");
+        status = READ_FAIL;
+    }
+
+    close (archive_fd);
+    if (unmatched)
+    {
+        status = EXTRACT_FAIL;
+    }
+    return status;
+}
+
+// Extract a mapped archive with several threads. The member list comes
+// from walking the headers in the mapping; workers take members in order,
+// pread and write them independently, and check their own CRCs. The main
+// thread prints each member's output in archive order, and stops at the
+// first fatal error just like the serial path.
+void extract_parallel(int archive_fd, const char * map, off_t map_size, int verbose, int validate, int jobs
+                      , char ** patterns, int pattern_count, char * matched)
+{
+    extract_pool_t pool;
+    pthread_t * threads;
+    char ** names;
+    int thread_count;
+
+    memset(&pool, 0, sizeof(pool));
+    pool.archive_fd = archive_fd;
+    pool.map = map;
+    pool.map_size = map_size;
+    pool.validate = validate;
+
+    pool.job_count = scan_jobs(map, map_size, patterns, pattern_count, matched, &pool.jobs);
+    prepare_dirs(pool.jobs, pool.job_count);
+
+    // A name stored twice must be written in order, so leave that to the
+    // serial path
+    names = malloc((pool.job_count + 1) * sizeof(char *));
+    if (names == NULL)
+    {
+        perror("Error allocating member list");
+        exit(EXTRACT_FAIL);
+    }
+    for (size_t i = 0; i < pool.job_count; ++i)
+    {
+        names[i] = pool.jobs[i].name;
+    }
+    qsort(names, pool.job_count, sizeof(char *), compare_names);
+    for (size_t i = 1; i < pool.job_count; ++i)
+    {
+        if (strcmp(names[i - 1], names[i]) == 0)
+        {
+            jobs = 1;
+            break;
+        }
+    }
+    free(names);
+
+    pthread_mutex_init(&pool.lock, NULL);
+    pthread_cond_init(&pool.job_done, NULL);
+    thread_count = MIN((size_t) jobs, pool.job_count);
+    threads = malloc((thread_count + 1) * sizeof(pthread_t));
+    if (threads == NULL)
+    {
+        perror("Error allocating threads");
+        exit(EXTRACT_FAIL);
+    }
+    for (int i = 0; i < thread_count; ++i)
+    {
+        if (pthread_create(&threads[i], NULL, extract_worker, &pool) != 0)
+        {
+            fprintf(stderr, "Error starting extract thread\n");
+            exit(EXTRACT_FAIL);
+        }
+    }
+
+    // Report in member order as results come in
+    for (size_t i = 0; i < pool.job_count; ++i)
+    {
+        extract_job_t * job = &pool.jobs[i];
+
+        pthread_mutex_lock(&pool.lock);
+        while (!job->done)
+        {
+            pthread_cond_wait(&pool.job_done, &pool.lock);
+        }
+        pthread_mutex_unlock(&pool.lock);
+        report_job(job, verbose);
+    }
+
+    for (int i = 0; i < thread_count; ++i)
+    {
+        pthread_join(threads[i], NULL);
+    }
+    free(threads);
+    free_jobs(pool.jobs, pool.job_count);
+    pthread_mutex_destroy(&pool.lock);
+    pthread_cond_destroy(&pool.job_done);
+}
+
+// Quick scan of the headers of a mapped archive, no data is touched.
+// Returns the number of members selected by the patterns (all, with no
+// patterns), set up as jobs in archive order.
+size_t scan_jobs(const char * map, off_t map_size, char ** patterns, int pattern_count, char * matched
+                 , extract_job_t ** jobs_out)
+{
+    extract_job_t * jobs = NULL;
+    size_t count = 0;
+    size_t capacity = 0;
+    record_walk_t walk;
+    int result;
+
+    record_walk_start(&walk, map, -1, map_size);
+    while ((result = record_next(&walk)) > 0)
+    {
+        extract_job_t * job;
+
+        if (is_hidden_member(&walk.header)
+            || (pattern_count > 0 && !member_selected(&walk.header, walk.long_name, patterns, pattern_count, matched)))
+        {
+            continue;
+        }
+        if (count == capacity)
+        {
+            capacity = capacity ? capacity * 2 : 256;
+            jobs = realloc(jobs, capacity * sizeof(extract_job_t));
+            if (jobs == NULL)
+            {
+                perror("Error allocating member list");
+                exit(EXTRACT_FAIL);
+            }
+        }
+        job = &jobs[count++];
+        memset(job, 0, sizeof(*job));
+        job->header = walk.header;
+        job->name = strdup(walk.name);
+        if (job->name == NULL)
+        {
+            perror("Error allocating member list");
+            exit(EXTRACT_FAIL);
+        }
+        job->data_off = walk.data_off;
+        job->file_size = walk.stored;
+        job->dir = S_ISDIR(strtol(walk.header.arvik_mode, NULL, 8));
+    }
+    if (result < 0)
+    {
+        if (walk.damage == WALK_BAD_HEADER)
+        {
+            fprintf(stderr, "Error: Header terminator invalid - assuming data corruption\n");
+            exit(CRC_DATA_ERROR);
+        }
+        fprintf(stderr, "Error: %s\n", walk.damage == WALK_SHORT_HEADER ? "Incomplete header read" : "archive truncated");
+        exit(READ_FAIL);
+    }
+    *jobs_out = jobs;
+    return count;
+}
+
+// Extract a mapped archive in io_uring batches. The opens, writes and
+// closes of small plain members in a batch each go to the kernel as one
+// submission; io_uring has no chmod or utimes, so those stay one call
+// each. Other members are extracted as in -j mode, in their turn. Results
+// are reported in member order. Returns -1 before doing anything if
+// io_uring is not available.
+int extract_uring(int archive_fd, const char * map, off_t map_size, int verbose, int validate
+                  , char ** patterns, int pattern_count, char * matched)
+{
+    uring_t ring;
+    extract_pool_t pool;
+    int fds[URING_BATCH];
+    int writes[URING_BATCH];
+    int closes[URING_BATCH];
+    int small[URING_BATCH];
+    size_t count;
+    stats_mark_t mark; // when the batch was started, for --stats
+
+    if (uring_init(&ring, URING_BATCH) < 0)
+    {
+        return -1;
+    }
+    memset(&pool, 0, sizeof(pool));
+    pool.archive_fd = archive_fd;
+    pool.map = map;
+    pool.map_size = map_size;
+    pool.validate = validate;
+    pool.job_count = scan_jobs(map, map_size, patterns, pattern_count, matched, &pool.jobs);
+    prepare_dirs(pool.jobs, pool.job_count);
+
+    for (size_t first = 0; first < pool.job_count; first += count)
+    {
+        // A name stored twice ends the batch, so its copies are written in order
+        count = 0;
+        while (first + count < pool.job_count && count < URING_BATCH)
+        {
+            int repeated = 0;
+
+            for (size_t k = 0; k < count && !repeated; ++k)
+            {
+                repeated = strcmp(pool.jobs[first + k].name, pool.jobs[first + count].name) == 0;
+            }
+            if (repeated)
+            {
+                break;
+            }
+            count++;
+        }
+
+        stats_mark(&mark);
+        for (size_t k = 0; k < count; ++k)
+        {
+            extract_job_t * job = &pool.jobs[first + k];
+
+            fds[k] = -1;
+            job->unchanged = skip_unchanged && !job->dir
+                             && file_unchanged(job->name, &job->header, map + job->data_off, map_size - job->data_off);
+            small[k] = !job->dir && !job->unchanged && !is_extended_member(&job->header)
+                       && job->file_size <= URING_SMALL;
+            if (small[k])
+            {
+                struct io_uring_sqe * sqe = uring_sqe(&ring, IORING_OP_OPENAT, AT_FDCWD, k);
+
+                sqe->addr = (uintptr_t) job->name;
+                sqe->open_flags = O_WRONLY | O_CREAT | O_TRUNC;
+                sqe->len = 0644;
+            }
+        }
+        if (uring_run(&ring, fds) < 0)
+        {
+            perror("Error creating files");
+            exit(EXTRACT_FAIL);
+        }
+
+        for (size_t k = 0; k < count; ++k)
+        {
+            extract_job_t * job = &pool.jobs[first + k];
+
+            writes[k] = 0;
+            if (small[k] && fds[k] >= 0 && job->file_size > 0)
+            {
+                struct io_uring_sqe * sqe = uring_sqe(&ring, IORING_OP_WRITE, fds[k], k);
+
+                sqe->addr = (uintptr_t) (map + job->data_off);
+                sqe->len = job->file_size;
+                sqe->off = 0;
+            }
+        }
+        if (uring_run(&ring, writes) < 0)
+        {
+            perror("Error writing files");
+            exit(EXTRACT_FAIL);
+        }
+
+        for (size_t k = 0; k < count; ++k)
+        {
+            extract_job_t * job = &pool.jobs[first + k];
+            csum_t sum;
+
+            if (!small[k])
+            {
+                extract_job_run(&pool, job);
+                continue;
+            }
+            if (fds[k] < 0)
+            {
+                job_note(job, "Error creating file %s: %s\n", job->name, strerror(-fds[k]));
+                continue;
+            }
+            job->created = 1;
+            if (writes[k] != job->file_size)
+            {
+                job_note(job, "Error writing data to %s: %s\n", job->name
+                         , writes[k] < 0 ? strerror(-writes[k]) : "short write");
+                job->status = EXTRACT_FAIL;
+                continue;
+            }
+            job_sum_init(&pool, job, &sum);
+            if (validate)
+            {
+                csum_update(&sum, map + job->data_off, job->file_size);
+            }
+            extract_job_finish(&pool, job, fds[k], &sum);
+            stats_member(job->name, job->file_size, &mark);
+        }
+
+        for (size_t k = 0; k < count; ++k)
+        {
+            if (fds[k] >= 0)
+            {
+                uring_sqe(&ring, IORING_OP_CLOSE, fds[k], k);
+            }
+        }
+        if (uring_run(&ring, closes) < 0)
+        {
+            perror("Error closing files");
+            exit(EXTRACT_FAIL);
+        }
+
+        for (size_t k = 0; k < count; ++k)
+        {
+            report_job(&pool.jobs[first + k], verbose);
+        }
+    }
+    free_jobs(pool.jobs, pool.job_count);
+    uring_exit(&ring);
+    return 0;
+}
+
+// Worker thread: take the next member until none are left
+void * extract_worker(void * arg)
+{
+    extract_pool_t * pool = (extract_pool_t *) arg;
+
+    for (;;)
+    {
+        extract_job_t * job;
+        stats_mark_t mark;
+
+        pthread_mutex_lock(&pool->lock);
+        if (pool->next_job == pool->job_count)
+        {
+            pthread_mutex_unlock(&pool->lock);
+            break;
+        }
+        job = &pool->jobs[pool->next_job++];
+        pthread_mutex_unlock(&pool->lock);
+
+        if (pool->verify)
+        {
+            stats_mark(&mark);
+            verify_job_run(pool, job);
+            // A long name record is part of the member after it
+            if (!is_hidden_member(&job->header))
+            {
+                stats_member(job->name, job->file_size, &mark);
+            }
+        }
+        else
+        {
+            extract_job_run(pool, job);
+        }
+
+        pthread_mutex_lock(&pool->lock);
+        job->done = 1;
+        pthread_cond_broadcast(&pool->job_done);
+        pthread_mutex_unlock(&pool->lock);
+    }
+    return NULL;
+}
+
+// Extract one member at its recorded offset. Never exits; problems are
+// left in the job for the main thread to report.
+void extract_job_run(extract_pool_t * pool, extract_job_t * job)
+{
+    int file_fd;
+    csum_t sum;
+    io_out_t out;
+    stats_mark_t mark; // When this member was started, for --stats
+
+    // Already made, and finished last
+    if (job->dir)
+    {
+        return;
+    }
+    stats_mark(&mark);
+    if (job->unchanged || (skip_unchanged && file_unchanged(job->name, &job->header, pool->map + job->data_off
+                                                            , pool->map_size - job->data_off)))
+    {
+        // Counted, as the serial extract does
+        job->unchanged = 1;
+        stats_member(job->name, job->file_size, &mark);
+        return;
+    }
+    job_sum_init(pool, job, &sum);
+    file_fd = stats_open(job->name, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (file_fd < 0)
+    {
+        job_note(job, "Error creating file %s: %s\n", job->name, strerror(errno));
+        return;
+    }
+    job->created = 1;
+    if (io_out_start(&out, file_fd) < 0)
+    {
+        job_note(job, "Error setting up output for %s: %s\n", job->name, strerror(errno));
+        job->status = EXTRACT_FAIL;
+        close(file_fd);
+        return;
+    }
+
+    if (is_extended_member(&job->header))
+    {
+        int restored = restore_extended(&out, pool->archive_fd, pool->map, pool->map_size, job->data_off, &sum);
+
+        if (restored < 0)
+        {
+            job_note(job, "Error restoring data for %s: %s\n", job->name
+                     , restored == -2 ? "corrupt member data" : strerror(errno));
+            job->status = restored == -2 ? CRC_DATA_ERROR : EXTRACT_FAIL;
+            close(file_fd);
+            return;
+        }
+    }
+    else if (job->file_size > 0
+             && copy_range_direct(&out, pool->archive_fd, job->data_off, pool->map + job->data_off
+                                  , job->file_size, pool->validate ? &sum : NULL) < 0)
+    {
+        job_note(job, "Error writing data to %s: %s\n", job->name, strerror(errno));
+        job->status = EXTRACT_FAIL;
+        close(file_fd);
+        return;
+    }
+    if (io_out_finish(&out) < 0)
+    {
+        job_note(job, "Error writing data to %s: %s\n", job->name, strerror(errno));
+        job->status = EXTRACT_FAIL;
+        close(file_fd);
+        return;
+    }
+    extract_job_finish(pool, job, file_fd, &sum);
+    stats_close(file_fd);
+    stats_member(job->name, job->file_size, &mark);
+}
+
+// Start the checksum of a job with the algorithm its footer names. The
+// footer is already mapped.
+void job_sum_init(extract_pool_t * pool, extract_job_t * job, csum_t * sum)
+{
+    arvik_footer_t footer;
+    arvik_csum_alg_t alg = ARVIK_CSUM_CRC32;
+    uLong stored_crc;
+
+    memcpy(&footer, pool->map + job->data_off + job->file_size + (job->file_size % 2), sizeof(footer));
+    parse_footer(&footer, &alg, &stored_crc);
+    csum_init(sum, alg);
+}
+
+// Check the footer of a job whose data is written, and its CRC if asked,
+// then give the file its mode and times. The caller closes file_fd.
+void extract_job_finish(extract_pool_t * pool, extract_job_t * job, int file_fd, csum_t * sum)
+{
+    arvik_footer_t footer;
+    arvik_csum_alg_t alg;
+    uLong stored_crc = 0;
+    struct timespec times[2];
+    stats_mark_t mark;
+
+    memcpy(&footer, pool->map + job->data_off + job->file_size + (job->file_size % 2), sizeof(footer));
+    if (!footer_term_ok(&footer))
+    {
+        job_note(job, "Error: Footer terminator invalid - assuming data corruption\n");
+        job->status = CRC_DATA_ERROR;
+        return;
+    }
+
+    if (pool->validate)
+    {
+        if (parse_footer(&footer, &alg, &stored_crc) < 0)
+        {
+            job_note(job, "Error parsing CRC value\n");
+            job->status = CRC_DATA_ERROR;
+            return;
+        }
+        if (sum->value != stored_crc)
+        {
+            job_note(job, "CRC check failed for %s\n", job->name);
+            job->status = CRC_DATA_ERROR;
+            return;
+        }
+        job->crc_passed = 1;
+    }
+
+    stats_mark(&mark);
+    if (fchmod(file_fd, strtol(job->header.arvik_mode, NULL, 8)) < 0)
+    {
+        job_note(job, "Error setting permissions for %s: %s\n", job->name, strerror(errno));
+    }
+    times[0].tv_sec = 0;
+    times[0].tv_nsec = UTIME_NOW;
+    times[1].tv_sec = strtol(job->header.arvik_date, NULL, 10);
+    times[1].tv_nsec = 0;
+    if (futimens(file_fd, times) < 0)
+    {
+        job_note(job, "Error setting file times for %s: %s\n", job->name, strerror(errno));
+    }
+    stats_add(PHASE_META, &mark, 0, 2);
+}
+
+// Print what happened to a finished job, and stop at a fatal error
+void report_job(extract_job_t * job, int verbose)
+{
+    if (verbose && job->created)
+    {
+        printf("x - %s\n", job->name);
+    }
+    else if (verbose && job->unchanged)
+    {
+        printf("s - %s\n", job->name);
+    }
+    if (job->message[0] != '\0')
+    {
+        fflush(stdout);
+        fputs(job->message, stderr);
+    }
+    if (job->status != 0)
+    {
+        exit(job->status);
+    }
+    if (verbose && job->crc_passed)
+    {
+        printf("CRC check passed for %s\n", job->name);
+    }
+}
+
+// Append a line to the job's message for later, ordered printing
+void job_note(extract_job_t * job, const char * fmt, ...)
+{
+    size_t used = strlen(job->message);
+    va_list args;
+
+    va_start(args, fmt);
+    vsnprintf(job->message + used, sizeof(job->message) - used, fmt, args);
+    va_end(args);
+}
+
+// qsort comparator for an array of names
+int compare_names(const void * a, const void * b)
+{
+    return strcmp(*(char * const *) a, *(char * const *) b);
+}
+
+// Make the directories jobs will write into before any worker starts:
+// directory members themselves, and the parents of other members, which
+// may have been selected without them
+void prepare_dirs(extract_job_t * jobs, size_t count)
+{
+    const char * parent = ""; // parent of the last member made
+    size_t parent_len = 0;
+
+    for (size_t i = 0; i < count; ++i)
+    {
+        extract_job_t * job = &jobs[i];
+        const char * slash = strrchr(job->name, '/');
+
+        if (job->dir)
+        {
+            job->created = extract_dir(job->name, &job->header) == 0;
+            if (!job->created)
+            {
+                job_note(job, "Error creating directory %s: %s\n", job->name, strerror(errno));
+            }
+        }
+        else if (slash != NULL && ((size_t) (slash - job->name) != parent_len
+                                   || strncmp(job->name, parent, parent_len) != 0))
+        {
+            make_parents(job->name);
+            parent = job->name;
+            parent_len = slash - job->name;
+        }
+    }
+}
+
+void free_jobs(extract_job_t * jobs, size_t count)
+{
+    for (size_t i = 0; i < count; ++i)
+    {
+        free(jobs[i].name);
+    }
+    free(jobs);
+}
+
+// Make the missing directories above name, as mkdir -p would
+int make_parents(const char * name)
+{
+    char path[ARVIK_PATH_MAX];
+    char * slash;
+
+    snprintf(path, sizeof(path), "%s", name);
+    for (slash = strchr(path + 1, '/'); slash != NULL; slash = strchr(slash + 1, '/'))
+    {
+        *slash = '\0';
+        if (mkdir(path, 0755) < 0 && errno != EEXIST)
+        {
+            return -1;
+        }
+        *slash = '/';
+    }
+    return 0;
+}
+
+// Make a directory member, or take over one that is already there. Its
+// mode and mtime are left to finish_dirs(). Returns -1 with errno set if
+// there is no directory under that name afterwards.
+int extract_dir(const char * name, arvik_header_t * header)
+{
+    struct stat st;
+    dir_fixup_t * fixup;
+    int made;
+
+    if (!safe_name(name))
+    {
+        errno = EINVAL;
+        return -1;
+    }
+    made = mkdir(name, 0700);
+    if (made < 0 && errno == ENOENT && make_parents(name) == 0)
+    {
+        made = mkdir(name, 0700);
+    }
+    if (made < 0 && errno != EEXIST)
+    {
+        return -1;
+    }
+    if (made < 0 && (stat(name, &st) < 0 || !S_ISDIR(st.st_mode)))
+    {
+        errno = EEXIST;
+        return -1;
+    }
+
+    if (extracted_dirs.count == extracted_dirs.capacity)
+    {
+        extracted_dirs.capacity = extracted_dirs.capacity ? extracted_dirs.capacity * 2 : 64;
+        extracted_dirs.dirs = realloc(extracted_dirs.dirs, extracted_dirs.capacity * sizeof(dir_fixup_t));
+        if (extracted_dirs.dirs == NULL)
+        {
+            perror("Error allocating directory list");
+            exit(EXTRACT_FAIL);
+        }
+    }
+    fixup = &extracted_dirs.dirs[extracted_dirs.count++];
+    fixup->name = strdup(name);
+    fixup->mode = strtol(header->arvik_mode, NULL, 8) & 07777;
+    fixup->mtime = strtol(header->arvik_date, NULL, 10);
+    if (fixup->name == NULL)
+    {
+        perror("Error allocating directory list");
+        exit(EXTRACT_FAIL);
+    }
+    return 0;
+}
+
+// Give the extracted directories their mode and mtime, innermost first
+void finish_dirs(void)
+{
+    for (size_t i = extracted_dirs.count; i > 0; --i)
+    {
+        dir_fixup_t * fixup = &extracted_dirs.dirs[i - 1];
+        struct timespec times[2];
+        stats_mark_t mark;
+
+        // A shard's child process leaves them to the parent, see run_shards()
+        if (dirs_deferred)
+        {
+            free(fixup->name);
+            continue;
+        }
+        stats_mark(&mark);
+        if (chmod(fixup->name, fixup->mode) < 0)
+        {
+            fprintf(stderr, "Error setting permissions for %s: %s\n", fixup->name, strerror(errno));
+        }
+        times[0].tv_sec = 0;
+        times[0].tv_nsec = UTIME_NOW;
+        times[1].tv_sec = fixup->mtime;
+        times[1].tv_nsec = 0;
+        if (utimensat(AT_FDCWD, fixup->name, times, 0) < 0)
+        {
+            fprintf(stderr, "Error setting file times for %s: %s\n", fixup->name, strerror(errno));
+        }
+        stats_add(PHASE_META, &mark, 0, 2);
+        free(fixup->name);
+    }
+    free(extracted_dirs.dirs);
+    memset(&extracted_dirs, 0, sizeof(extracted_dirs));
+}
+
+// read() until len bytes arrive or the input ends
+ssize_t read_full(int fd, void * buffer, size_t len)
+{
+    size_t total = 0;
+
+    while (total < len)
+    {
+        ssize_t bytes_read = stats_read(fd, (char *) buffer + total, len - total);
+
+        if (bytes_read < 0)
+        {
+            return -1;
+        }
+        if (bytes_read == 0)
+        {
+            break;
+        }
+        total += bytes_read;
+    }
+    return total;
+}
+
+void restore_to_start(restore_to_t * to, io_out_t * out, csum_t * sum, int archive_fd, const char * map
+                      , off_t map_size)
+{
+    to->sink.data = restore_to_data;
+    to->sink.hole = restore_to_hole;
+    to->sink.inflate = restore_inflate;
+    to->sink.arg = to;
+    to->out = out;
+    to->sum = sum;
+    to->archive_fd = archive_fd;
+    to->map = map;
+    to->map_size = map_size;
+}
+
+int restore_to_data(restore_sink_t * sink, const char * data, size_t len)
+{
+    restore_to_t * to = sink->arg;
+
+    if (to->map != NULL && data >= to->map && data + len <= to->map + to->map_size)
+    {
+        return copy_range_direct(to->out, to->archive_fd, data - to->map, data, len, to->sum);
+    }
+    csum_update(to->sum, data, len);
+    return io_out_write(to->out, data, len);
+}
+
+int restore_to_hole(restore_sink_t * sink, off_t len)
+{
+    restore_to_t * to = sink->arg;
+
+    csum_zeros(to->sum, len);
+    return io_out_hole(to->out, len);
+}
+
+// uncompress(), timed for --stats
+int restore_inflate(char * dest, uLongf * dest_len, const char * src, size_t len)
+{
+    stats_mark_t mark;
+    int status;
+
+    stats_mark(&mark);
+    status = uncompress((Bytef*) dest, dest_len, (const Bytef*) src, len);
+    stats_add(PHASE_ZLIB, &mark, *dest_len, 1);
+    return status;
+}
+
+// A member's stored bytes as they go by on a stream
+ssize_t restore_read(restore_source_t * source, const char ** data, size_t max)
+{
+    return reader_next(source->arg, data, max);
+}
+
+// A library restore result as callers here take it: -1 when the output
+// failed, with errno set, and -2 when the member cannot be restored
+int restore_result(int result)
+{
+    if (result == ARVIK_ERR_NOMEM)
+    {
+        errno = ENOMEM;
+        return -1;
+    }
+    if (result == ARVIK_ERR_IO)
+    {
+        return -1;
+    }
+    return result < 0 ? -2 : 0;
+}
+
+// Restore an extended member of a mapped archive, whatever its type.
+// data_off is where its stored bytes start.
+int restore_extended(io_out_t * out, int archive_fd, const char * map, off_t map_size, off_t data_off, csum_t * sum)
+{
+    restore_to_t to;
+
+    restore_to_start(&to, out, sum, archive_fd, map, map_size);
+    return restore_result(restore_at(map, map_size, data_off - sizeof(arvik_header_t), &to.sink));
+}
+
+// Restore a compressed or sparse member read from the archive as it goes
+// by. Its extension header has been read already.
+int restore_stream(archive_reader_t * in, io_out_t * out, const arvik_xheader_t * xheader, off_t stored, csum_t * sum)
+{
+    restore_to_t to;
+    restore_source_t source;
+
+    restore_to_start(&to, out, sum, in->fd, NULL, 0);
+    source.next = restore_read;
+    source.arg = in;
+    if (is_sparse_xheader(xheader))
+    {
+        return restore_result(restore_sparse(&source, xheader, stored, &to.sink));
+    }
+    return restore_result(restore_zlib(&source, xheader, stored, &to.sink));
+}
+
+// Open the file a dref member of a stream was extracted to. extracted
+// lists the members written so far, in archive order, and names the paths
+// they went to.
+// Returns the descriptor, -2 for a corrupt member, or -3 when the target
+// was not extracted, or its file has changed.
+int copy_source(arvik_index_t * extracted, char ** names, const arvik_xheader_t * xheader, off_t stored
+                , off_t ref_off)
+{
+    arvik_index_entry_t * target;
+    off_t raw_size;
+    off_t target_off;
+    struct stat st;
+    int fd;
+
+    if (check_ref(xheader, stored, ref_off, &raw_size, &target_off) < 0)
+    {
+        return -2;
+    }
+    target = index_find(extracted, target_off + sizeof(arvik_header_t));
+    if (target == NULL)
+    {
+        return -3;
+    }
+    fd = open(names[target - extracted->entries], O_RDONLY);
+    if (fd < 0)
+    {
+        return -3;
+    }
+    // A later member of the same name may have replaced it
+    if (fstat(fd, &st) < 0 || st.st_size != raw_size
+        || st.st_mtime != field_value(target->arvik_header.arvik_date, sizeof(target->arvik_header.arvik_date), 10))
+    {
+        close(fd);
+        return -3;
+    }
+    return fd;
+}
+
+// Restore a dref member of a stream from fd, opened by copy_source(), and
+// close it
+int restore_copy(io_out_t * out, int fd, csum_t * sum)
+{
+    char * buffer;
+    ssize_t bytes_read;
+    int result = 0;
+
+    buffer = io_alloc(io_block_size);
+    if (buffer == NULL)
+    {
+        close(fd);
+        return -1;
+    }
+    while (result == 0 && (bytes_read = stats_read(fd, buffer, io_block_size)) > 0)
+    {
+        csum_update(sum, buffer, bytes_read);
+        result = io_out_write(out, buffer, bytes_read);
+    }
+    if (bytes_read < 0)
+    {
+        result = -1;
+    }
+    free(buffer);
+    close(fd);
+    return result;
+}
+
+// Does the member name match any of the patterns? Marks the ones that do.
+int member_selected(arvik_header_t * header, const char * long_name, char ** patterns, int pattern_count
+                    , char * matched)
+{
+    char name[ARVIK_PATH_MAX];
+    int selected = 0;
+
+    if (is_hidden_member(header))
+    {
+        return 0;
+    }
+    member_name(header, long_name, name);
+    for (int i = 0; i < pattern_count; ++i)
+    {
+        if (fnmatch(patterns[i], name, 0) == 0)
+        {
+            matched[i] = 1;
+            selected = 1;
+        }
+    }
+    return selected;
+}
+
+// Skip a member's data, padding and footer after its header was read
+void skip_member(archive_reader_t * in, arvik_header_t * header)
+{
+    off_t file_size = strtoll(header->arvik_size, NULL, 10);
+
+    if (reader_skip(in, file_size + (file_size % 2) + sizeof(arvik_footer_t)) < 0)
+    {
+        perror("Error skipping file data");
+        exit(READ_FAIL);
+    }
+}
+
+// Extract single file from archive
+void extract_file(archive_reader_t * in, arvik_header_t header, const char * long_name, int verbose, int validate
+                  , const char * map, off_t map_size)
+{
+    int file_fd; // File descriptor for the extracted file
+    size_t file_size; //size of file
+    const char * data; //file data, in the reader's buffer
+    ssize_t bytes_read; //number of bytes read in one op
+    size_t total_bytes_read;
+    static arvik_csum_alg_t predicted = ARVIK_CSUM_CRC32; // algorithm of the last footer read
+    static arvik_index_t extracted = { NULL, 0, 0 }; // members written from a stream, for dref
+    static char ** extracted_names = NULL; // where each of those went
+    off_t header_off = in->offset - sizeof(header);
+    int is_ref = 0;
+    arvik_xheader_t xheader; // read ahead on a stream, see below
+    int have_xheader = 0;
+    int copy_fd = -1; // a stream dref's data, in the file its target went to
+    int in_place = 0; // ... which is the file being extracted
+    struct stat copy_st;
+    struct stat out_st;
+    csum_t sum; // running checksum
+    arvik_csum_alg_t footer_alg = ARVIK_CSUM_CRC32;
+    uLong stored_crc = 0;
+    arvik_footer_t footer; // Footer struct
+    time_t mtime; // For setting file times
+    mode_t mode;    // file mode
+    int has_padding = 0;
+    int unchanged; // --skip-unchanged leaves the file as it is
+    struct utimbuf times;
+    io_out_t out; // the extracted file
+    char name[ARVIK_PATH_MAX]; // path to extract to
+    stats_mark_t start; // for --stats
+    stats_mark_t mark;
+
+    stats_mark(&start);
+    if (!header_term_ok(&header))
+    {
+        fprintf(stderr, "Error: Header terminator invalid - assuming data corruption\n");
+        exit(CRC_DATA_ERROR);
+    }
+
+    // convert size string to num
+    file_size = strtol(header.arvik_size, NULL, 10);
+    
+    if (file_size % 2 != 0)
+        has_padding = 1;
+
+    // Nothing to extract for the member index or a replaced member
+    if (is_hidden_member(&header))
+    {
+        skip_member(in, &header);
+        return;
+    }
+
+    member_name(&header, long_name, name);
+
+    // Directories have no data; their mode and times wait for the end
+    if (S_ISDIR(strtol(header.arvik_mode, NULL, 8)))
+    {
+        skip_member(in, &header);
+        if (extract_dir(name, &header) < 0)
+        {
+            fprintf(stderr, "Error creating directory %s: %s\n", name, strerror(errno));
+        }
+        else if (verbose)
+        {
+            printf("x - %s\n", name);
+        }
+        return;
+    }
+
+    unchanged = skip_unchanged && file_unchanged(name, &header, map != NULL ? map + in->offset : NULL
+                                                 , map != NULL ? map_size - in->offset : 0);
+    if (unchanged && map != NULL)
+    {
+        // Step over it without reading it
+        skip_member(in, &header);
+        if (verbose)
+        {
+            printf("s - %s\n", name);
+        }
+        return;
+    }
+
+    // A stream dref copies an earlier extracted file. Find it before the
+    // output is opened: failing later would leave the file truncated.
+    if (map == NULL && is_extended_member(&header))
+    {
+        if (file_size < sizeof(xheader) || reader_read(in, &xheader, sizeof(xheader)) != sizeof(xheader))
+        {
+            fprintf(stderr, "Error restoring data for %s: corrupt member data\n", name);
+            exit(CRC_DATA_ERROR);
+        }
+        have_xheader = 1;
+        if (is_ref_xheader(&xheader))
+        {
+            is_ref = 1;
+            copy_fd = copy_source(&extracted, extracted_names, &xheader, file_size, header_off);
+            if (copy_fd == -3)
+            {
+                fprintf(stderr, "Error restoring data for %s: it repeats a member that was not extracted"
+                        ", which needs a seekable archive\n", name);
+                exit(EXTRACT_FAIL);
+            }
+            if (copy_fd < 0)
+            {
+                fprintf(stderr, "Error restoring data for %s: corrupt member data\n", name);
+                exit(CRC_DATA_ERROR);
+            }
+            // A member of the same name repeated: the data is already there
+            in_place = !unchanged && stat(name, &out_st) == 0 && fstat(copy_fd, &copy_st) == 0
+                       && out_st.st_dev == copy_st.st_dev && out_st.st_ino == copy_st.st_ino;
+        }
+    }
+
+    // open output file
+    {
+        char *ch = strchr(header.arvik_name, '/');
+
+        if (ch) {
+            *ch = '\0';
+        }
+    }
+    fprintf(stderr, "%d: >>%s<<\n", __LINE__, header.arvik_name);
+    // Validating may need to read the output back, see below
+    file_fd = -1;
+    if (unchanged)
+    {
+        // A stream still has to be read past, and a later dref may copy it
+        validate = 0;
+        io_out_discard(&out);
+    }
+    else if (in_place)
+    {
+        // Only read back: copy_fd sums what is there
+        file_fd = stats_open(name, validate ? O_RDWR : O_WRONLY, 0644);
+        io_out_discard(&out);
+    }
+    else if (safe_name(name))
+    {
+        file_fd = stats_open(name, (validate ? O_RDWR : O_WRONLY) | O_CREAT | O_TRUNC, 0644);
+        // Selected without its directory, or stored without one
+        if (file_fd < 0 && errno == ENOENT && make_parents(name) == 0)
+        {
+            file_fd = stats_open(name, (validate ? O_RDWR : O_WRONLY) | O_CREAT | O_TRUNC, 0644);
+        }
+    }
+    else
+    {
+        errno = EINVAL;
+    }
+    if (file_fd < 0 && !unchanged)
+    {
+        fprintf(stderr, "Error creating file %s: %s\n", name, strerror(errno));
+        if (copy_fd >= 0)
+        {
+            close(copy_fd);
+        }
+
+        // skip file data, padding and footer
+        skip_member(in, &header);
+        return;
+    }
+
+    // Verbose check
+    if (verbose)
+    {
+        printf("%s - %s\n", unchanged ? "s" : "x", name);
+    }
+
+    if (!unchanged && !in_place && io_out_start(&out, file_fd) < 0)
+    {
+        fprintf(stderr, "Error setting up output for %s: %s\n", name, strerror(errno));
+        close(file_fd);
+        exit(EXTRACT_FAIL);
+    }
+
+    total_bytes_read = 0;
+
+    // Sum with the algorithm the footer names. A mapped footer can be read
+    // now; on a stream it comes later, so guess the last one seen.
+    footer_alg = predicted;
+    if (map != NULL)
+    {
+        off_t footer_off = in->offset + file_size + has_padding;
+
+        if (footer_off > 0 && footer_off + (off_t) sizeof(footer) <= map_size)
+        {
+            memcpy(&footer, map + footer_off, sizeof(footer));
+            parse_footer(&footer, &footer_alg, &stored_crc);
+        }
+    }
+    csum_init(&sum, footer_alg);
+
+    // Extended members are restored rather than copied
+    if (is_extended_member(&header))
+    {
+        off_t data_off = map != NULL ? in->offset : -1;
+        int restored;
+
+        if (data_off >= 0 && data_off + (off_t) file_size <= map_size)
+        {
+            restored = restore_extended(&out, in->fd, map, map_size, data_off, &sum);
+            if (restored == 0 && reader_skip(in, file_size) < 0)
+            {
+                restored = -1;
+            }
+        }
+        else if (!have_xheader)
+        {
+            restored = -2;
+        }
+        else if (is_ref)
+        {
+            // A stream cannot go back for the data; use the file it went to
+            restored = restore_copy(&out, copy_fd, &sum);
+        }
+        else
+        {
+            restored = restore_stream(in, &out, &xheader, file_size, &sum);
+        }
+        if (restored < 0)
+        {
+            fprintf(stderr, "Error restoring data for %s: %s\n", name
+                    , restored == -2 ? "corrupt member data" : strerror(errno));
+            close(file_fd);
+            exit(restored == -2 ? CRC_DATA_ERROR : EXTRACT_FAIL);
+        }
+        total_bytes_read = file_size;
+    }
+
+    // Copy file data straight out of the mapped archive when we have one
+    if (map != NULL && total_bytes_read < file_size)
+    {
+        off_t data_off = in->offset;
+
+        if (data_off + (off_t) file_size > map_size)
+        {
+            fprintf(stderr, "Error reading file data for %s: archive truncated\n", name);
+            close(file_fd);
+            exit(READ_FAIL);
+        }
+        if (copy_range_direct(&out, in->fd, data_off, map + data_off, file_size, validate ? &sum : NULL) < 0)
+        {
+            fprintf(stderr, "Error writing data to %s: %s\n", name, strerror(errno));
+            close(file_fd);
+            exit(EXTRACT_FAIL);
+        }
+        if (reader_skip(in, file_size) < 0)
+        {
+            perror("Error skipping file data");
+            close(file_fd);
+            exit(READ_FAIL);
+        }
+        total_bytes_read = file_size;
+    }
+    while (total_bytes_read < file_size)
+    {
+        bytes_read = reader_next(in, &data, file_size - total_bytes_read);
+
+        if (bytes_read <= 0)
+        {
+            fprintf(stderr, "Error reading file data for %s: %s\n", name, strerror(errno));
+            close(file_fd);
+            exit(READ_FAIL);
+        }
+
+        // update CRC
+        csum_update(&sum, data, bytes_read);
+        // write data to output file
+        if (io_out_write(&out, data, bytes_read) < 0)
+        {
+            fprintf(stderr, "Error writing data to %s: %s\n", name, strerror(errno));
+            close(file_fd);
+            exit(EXTRACT_FAIL);
+        }
+        
+        total_bytes_read += bytes_read;
+    }
+    if (io_out_finish(&out) < 0)
+    {
+        fprintf(stderr, "Error writing data to %s: %s\n", name, strerror(errno));
+        close(file_fd);
+        exit(EXTRACT_FAIL);
+    }
+    if(has_padding == 1)
+    {
+        if(reader_skip(in, 1) < 0)
+        {
+            fprintf(stderr, "Error reading padding bytes for %s\n", name);
+        }
+    }
+
+    //close(file_fd);
+    // read footer
+    if (reader_read(in, &footer, sizeof(footer)) != sizeof(footer))
+    {
+        fprintf(stderr, "Error reading footer for %s: %s\n", name, strerror(errno));
+        close (file_fd);
+        exit(READ_FAIL);
+    }
+
+    if (!footer_term_ok(&footer))
+    {
+        fprintf(stderr, "Error: Footer terminator invalid - assuming data corruption\n");
+        close(file_fd);
+        exit(CRC_DATA_ERROR);
+    }
+    if (map == NULL && !is_ref)
+    {
+        index_add(&extracted, &header, header_off + sizeof(header), &footer);
+        extracted_names = realloc(extracted_names, extracted.capacity * sizeof(char *));
+        if (extracted_names == NULL
+            || (extracted_names[extracted.count - 1] = strdup(name)) == NULL)
+        {
+            perror("Error allocating member list");
+            exit(EXTRACT_FAIL);
+        }
+    }
+
+    // validate CRC if req
+    if (validate)
+    {
+        if (parse_footer(&footer, &footer_alg, &stored_crc) < 0)
+        {
+            fprintf(stderr, "Error parsing CRC value\n");
+            close(file_fd);
+            exit(CRC_DATA_ERROR);
+        }
+        predicted = footer_alg;
+
+        // Guessed wrong on a stream: sum what we wrote with the right one
+        if (footer_alg != sum.alg
+            && csum_file(file_fd, footer_alg, lseek(file_fd, 0, SEEK_END), &sum) < 0)
+        {
+            fprintf(stderr, "Error reading back %s: %s\n", name, strerror(errno));
+            close(file_fd);
+            exit(EXTRACT_FAIL);
+        }
+
+        if (sum.value != stored_crc)
+        {
+            fprintf(stderr, "CRC check failed for %s\n", name);
+            close(file_fd);
+            exit(CRC_DATA_ERROR);
+        }
+        else if (verbose)
+        {
+            printf("CRC check passed for %s\n", name);
+        }
+    }
+
+    if (unchanged)
+    {
+        stats_member(name, file_size, &start);
+        return;
+    }
+
+    // set file perms
+    mode = strtol(header.arvik_mode, NULL, 8); // convert octal str to num
+    stats_mark(&mark);
+    if (fchmod(file_fd, mode) < 0)
+    {
+        fprintf(stderr, "Error setting permissions for %s: %s\n", name, strerror(errno));
+    }
+    stats_add(PHASE_META, &mark, 0, 1);
+
+    mtime = strtol(header.arvik_date, NULL, 10);
+    times.actime = time(NULL);
+    times.modtime = mtime;
+
+    // close output
+    stats_close(file_fd);
+    stats_mark(&mark);
+    if (utime(name, & times) < 0)
+    {
+        fprintf(stderr, "Error setting file times for %s: %s\n", name, strerror(errno));
+    }
+    stats_add(PHASE_META, &mark, 0, 1);
+    stats_member(name, file_size, &start);
+}
+
+// Does the file at name already hold what the member would restore, going
+// by skip_unchanged? data is the member's data in the mapped archive, with
+// available bytes from there on; NULL on a stream, where only the size and
+// mtime of a plain member can be compared up front.
+int file_unchanged(const char * name, arvik_header_t * header, const char * data, off_t available)
+{
+    off_t stored = field_value(header->arvik_size, sizeof(header->arvik_size), 10);
+    off_t size = stored;
+    arvik_xheader_t xheader;
+    arvik_footer_t footer;
+    arvik_csum_alg_t alg;
+    uLong stored_crc;
+    csum_t sum;
+    struct stat st;
+    int fd;
+    int same;
+
+    // Only the extension header knows the restored size
+    if (is_extended_member(header))
+    {
+        if (data == NULL || stored < (off_t) sizeof(xheader) || available < (off_t) sizeof(xheader))
+        {
+            return 0;
+        }
+        memcpy(&xheader, data, sizeof(xheader));
+        size = field_value(xheader.arvik_xsize, sizeof(xheader.arvik_xsize), 10);
+    }
+    if (!safe_name(name) || lstat(name, &st) < 0 || !S_ISREG(st.st_mode) || st.st_size != size
+        || st.st_mtime != field_value(header->arvik_date, sizeof(header->arvik_date), 10))
+    {
+        return 0;
+    }
+    if (skip_unchanged != SKIP_CRC)
+    {
+        return 1;
+    }
+
+    // The footer has to be seen before the data
+    if (data == NULL || stored + (stored % 2) + (off_t) sizeof(footer) > available)
+    {
+        return 0;
+    }
+    memcpy(&footer, data + stored + (stored % 2), sizeof(footer));
+    if (!footer_term_ok(&footer) || parse_footer(&footer, &alg, &stored_crc) < 0)
+    {
+        return 0;
+    }
+    fd = stats_open(name, O_RDONLY, 0);
+    if (fd < 0)
+    {
+        return 0;
+    }
+    same = csum_file(fd, alg, size, &sum) == 0 && sum.value == stored_crc;
+    stats_close(fd);
+    return same;
+}
+
+// Is the file a --shards manifest rather than an archive?
+int is_manifest(const char * archive_name)
+{
+    char tag[sizeof(SHARD_TAG)] = {'\0'};
+    struct stat st;
+    int found;
+    int fd;
+
+    // Reading a pipe would take the bytes from the archive
+    if (stat(archive_name, &st) < 0 || !S_ISREG(st.st_mode) || (fd = open(archive_name, O_RDONLY)) < 0)
+    {
+        return 0;
+    }
+    found = read(fd, tag, strlen(SHARD_TAG)) == (ssize_t) strlen(SHARD_TAG) && strcmp(tag, SHARD_TAG) == 0;
+    close(fd);
+    return found;
+}
+
+// Load a manifest written by write_manifest(). Shards are found next to it.
+void read_manifest(const char * archive_name, manifest_t * manifest)
+{
+    const char * slash = strrchr(archive_name, '/');
+    int dir_len = slash != NULL ? slash - archive_name + 1 : 0;
+    size_t capacity = 0;
+    char * line = NULL;
+    size_t line_size = 0;
+    ssize_t len;
+    FILE * file = fopen(archive_name, "r");
+
+    memset(manifest, 0, sizeof(*manifest));
+    if (file == NULL)
+    {
+        perror("Error opening archive file for reading");
+        exit(READ_FAIL);
+    }
+    // Past the tag, checked by is_manifest()
+    getline(&line, &line_size, file);
+    while ((len = getline(&line, &line_size, file)) > 0)
+    {
+        manifest_entry_t * entry;
+        long long header_off;
+        char kind;
+        int shard;
+        int used = 0;
+        char * out;
+
+        if (line[len - 1] == '\n')
+        {
+            line[--len] = '\0';
+        }
+        if (strncmp(line, "shard ", 6) == 0 && manifest->count == 0 && manifest->shard_count < SHARD_MAX)
+        {
+            if (manifest->shards == NULL)
+            {
+                manifest->shards = malloc(SHARD_MAX * sizeof(char *));
+            }
+            if (manifest->shards == NULL
+                || (manifest->shards[manifest->shard_count] = malloc(dir_len + len)) == NULL)
+            {
+                perror("Error allocating shard list");
+                exit(READ_FAIL);
+            }
+            sprintf(manifest->shards[manifest->shard_count++], "%.*s%s", dir_len, archive_name, line + 6);
+            continue;
+        }
+        if (sscanf(line, "%d %lld %c %n", &shard, &header_off, &kind, &used) < 3 || used == 0
+            || shard < 0 || shard >= manifest->shard_count || header_off < (long long) strlen(ARVIK_TAG))
+        {
+            fprintf(stderr, "Error, damaged shard manifest %s\n", archive_name);
+            exit(READ_FAIL);
+        }
+        if (manifest->count == capacity)
+        {
+            capacity = capacity ? capacity * 2 : 256;
+            manifest->entries = realloc(manifest->entries, capacity * sizeof(manifest_entry_t));
+            if (manifest->entries == NULL)
+            {
+                perror("Error allocating shard list");
+                exit(READ_FAIL);
+            }
+        }
+        entry = &manifest->entries[manifest->count++];
+        entry->shard = shard;
+        entry->header_off = header_off;
+        entry->dir = kind == 'd';
+        entry->name = out = strdup(line + used);
+        if (entry->name == NULL)
+        {
+            perror("Error allocating shard list");
+            exit(READ_FAIL);
+        }
+        // Undo the escapes
+        for (const char * ch = line + used; *ch != '\0'; ++ch)
+        {
+            if (*ch == '\\' && ch[1] != '\0')
+            {
+                ch++;
+                *out++ = *ch == 'n' ? '\n' : *ch;
+            }
+            else
+            {
+                *out++ = *ch;
+            }
+        }
+        *out = '\0';
+    }
+    free(line);
+    fclose(file);
+    if (manifest->shard_count == 0)
+    {
+        fprintf(stderr, "Error, damaged shard manifest %s\n", archive_name);
+        exit(READ_FAIL);
+    }
+}
+
+void free_manifest(manifest_t * manifest)
+{
+    for (int i = 0; i < manifest->shard_count; ++i)
+    {
+        free(manifest->shards[i]);
+    }
+    for (size_t i = 0; i < manifest->count; ++i)
+    {
+        free(manifest->entries[i].name);
+    }
+    free(manifest->shards);
+    free(manifest->entries);
+}
+
+// List (-t) or extract (-x) the shards of a manifest, each in a child
+// process running the usual list_archive() or extract_archive() on it.
+// What they print is held in a temporary file per shard and passed on in
+// shard order. The parent makes the selected directories first and sets
+// their mode and times last, so no child closes off a directory another
+// one still writes into. The first shard to fail decides the exit status.
+void run_shards(char * archive_name, int extract, int verbose, int validate, char ** patterns, int pattern_count
+                , int jobs)
+{
+    manifest_t manifest;
+    char * matched = NULL; // Which patterns found a member
+    char * wanted; // Which shards hold a selected member
+    pid_t * children;
+    FILE ** outputs;
+    int result = 0;
+    char buffer[BUFSIZ];
+    size_t len;
+
+    read_manifest(archive_name, &manifest);
+    wanted = calloc(manifest.shard_count, 1);
+    children = calloc(manifest.shard_count, sizeof(pid_t));
+    outputs = calloc(manifest.shard_count, sizeof(FILE *));
+    matched = calloc(pattern_count + 1, 1);
+    if (wanted == NULL || children == NULL || outputs == NULL || matched == NULL)
+    {
+        perror("Error allocating shard list");
+        exit(EXTRACT_FAIL);
+    }
+    memset(wanted, pattern_count == 0, manifest.shard_count);
+
+    umask(0);
+    for (size_t i = 0; i < manifest.count; ++i)
+    {
+        manifest_entry_t * entry = &manifest.entries[i];
+
+        if (entry_selected(entry, patterns, pattern_count, matched))
+        {
+            wanted[entry->shard] = 1;
+            if (extract && entry->dir)
+            {
+                shard_dir(&manifest, entry);
+            }
+        }
+    }
+
+    fflush(stdout);
+    for (int i = 0; i < manifest.shard_count; ++i)
+    {
+        if (!wanted[i])
+        {
+            continue;
+        }
+        outputs[i] = tmpfile();
+        if (outputs[i] == NULL)
+        {
+            perror("Error making shard output file");
+            exit(extract ? EXTRACT_FAIL : TOC_FAIL);
+        }
+        children[i] = fork();
+        if (children[i] < 0)
+        {
+            perror("Error starting shard process");
+            exit(extract ? EXTRACT_FAIL : TOC_FAIL);
+        }
+        if (children[i] == 0)
+        {
+            char ** shard_patterns = malloc((pattern_count + 1) * sizeof(char *));
+            int shard_pattern_count = 0;
+
+            if (shard_patterns == NULL || dup2(fileno(outputs[i]), STDOUT_FILENO) < 0)
+            {
+                perror("Error starting shard process");
+                _exit(extract ? EXTRACT_FAIL : TOC_FAIL);
+            }
+            // Only the patterns this shard has a member for, or it would
+            // report the others as not found
+            for (int j = 0; j < pattern_count; ++j)
+            {
+                for (size_t k = 0; k < manifest.count; ++k)
+                {
+                    if (manifest.entries[k].shard == i && fnmatch(patterns[j], manifest.entries[k].name, 0) == 0)
+                    {
+                        shard_patterns[shard_pattern_count++] = patterns[j];
+                        break;
+                    }
+                }
+            }
+            stats_wanted = 0;
+            dirs_deferred = 1;
+            if (extract)
+            {
+                exit(extract_archive(manifest.shards[i], verbose, validate, shard_patterns, shard_pattern_count, jobs));
+            }
+            exit(list_archive(manifest.shards[i], verbose, validate, jobs));
+        }
+    }
+
+    for (int i = 0; i < manifest.shard_count; ++i)
+    {
+        int status;
+
+        if (!wanted[i])
+        {
+            continue;
+        }
+        if (waitpid(children[i], &status, 0) < 0 || !WIFEXITED(status))
+        {
+            status = extract ? EXTRACT_FAIL : TOC_FAIL;
+        }
+        else
+        {
+            status = WEXITSTATUS(status);
+        }
+        if (result == 0)
+        {
+            result = status;
+        }
+        rewind(outputs[i]);
+        while ((len = fread(buffer, 1, sizeof(buffer), outputs[i])) > 0)
+        {
+            fwrite(buffer, 1, len, stdout);
+        }
+        fclose(outputs[i]);
+    }
+    fflush(stdout);
+
+    if (extract)
+    {
+        finish_dirs();
+    }
+    for (int i = 0; i < pattern_count; ++i)
+    {
+        if (!matched[i])
+        {
+            fprintf(stderr, "%s: not found in archive\n", patterns[i]);
+            result = result ? result : EXTRACT_FAIL;
+        }
+    }
+    free(matched);
+    free(wanted);
+    free(children);
+    free(outputs);
+    free_manifest(&manifest);
+    if (result != 0)
+    {
+        exit(result);
+    }
+}
+
+// Like member_selected(), for a manifest line
+int entry_selected(manifest_entry_t * entry, char ** patterns, int pattern_count, char * matched)
+{
+    int selected = pattern_count == 0;
+
+    for (int i = 0; i < pattern_count; ++i)
+    {
+        if (fnmatch(patterns[i], entry->name, 0) == 0)
+        {
+            matched[i] = 1;
+            selected = 1;
+        }
+    }
+    return selected;
+}
+
+// Make a directory member of a shard ahead of its child process; its mode
+// and times are set by finish_dirs() once all of them are done
+void shard_dir(manifest_t * manifest, manifest_entry_t * entry)
+{
+    arvik_header_t header;
+    int fd = open(manifest->shards[entry->shard], O_RDONLY);
+
+    if (fd < 0 || pread(fd, &header, sizeof(header), entry->header_off) != sizeof(header)
+        || !header_term_ok(&header))
+    {
+        fprintf(stderr, "Error reading header of %s in %s\n", entry->name, manifest->shards[entry->shard]);
+        exit(READ_FAIL);
+    }
+    close(fd);
+    if (extract_dir(entry->name, &header) < 0)
+    {
+        fprintf(stderr, "Error creating directory %s: %s\n", entry->name, strerror(errno));
+    }
+}
+
+// List contents of an archive. With validate, every member is also
+// checked, and the run fails at the end if any of them is corrupt.
+// Returns the exit status.
+int list_archive(char * archive_name, int verbose, int validate, int jobs)
+{
+    int archive_fd = STDIN_FILENO;
+    char buffer[100] = {'\0'};
+    ssize_t bytes_read;
+    arvik_index_entry_t * entries = NULL;
+    size_t entry_count = 0;
+    archive_reader_t in;
+    char long_name[ARVIK_PATH_MAX] = {'\0'};
+    struct stat st;
+    size_t failed = 0; // members that did not verify
+
+    if (archive_name != NULL)
+    {
+        archive_fd = open(archive_name, O_RDONLY);
+        if (archive_fd < 0)
+        {
+            perror("Error opening archive file for reading");
+            return TOC_FAIL;
+        }
+    }
+    if (reader_open(&in, archive_fd) < 0)
+    {
+        perror("Error allocating read buffer");
+        if (archive_name != NULL)
+        {
+            close(archive_fd);
+        }
+        return TOC_FAIL;
+    }
+
+    // check if file has correct tag
+    bytes_read = reader_read(&in, buffer, strlen(ARVIK_TAG));
+    if (bytes_read != (ssize_t) strlen(ARVIK_TAG) || strncmp(buffer, ARVIK_TAG, strlen(ARVIK_TAG)) != 0)
+    {
+        fprintf(stderr, "Error, not a correct arvik archive file\n");
+        reader_close(&in);
+        if (archive_name != NULL)
+        {
+            close(archive_fd);
+        }
+        return BAD_TAG;
+    }
+
+    // Verifying reads every member anyway, so the index is no help. A
+    // regular file is mapped and checked on all cores.
+    if (validate && fstat(archive_fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0)
+    {
+        char * map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, archive_fd, 0);
+
+        if (map == MAP_FAILED)
+        {
+            failed = process_archive(&in, verbose, 0, validate);
+        }
+        else
+        {
+            failed = verify_parallel(archive_fd, map, st.st_size, verbose
+                                     , jobs ? jobs : (int) sysconf(_SC_NPROCESSORS_ONLN));
+            munmap(map, st.st_size);
+        }
+    }
+    else if (validate)
+    {
+        failed = process_archive(&in, verbose, 0, validate);
+    }
+    // With an index the whole table comes from one read at the end
+    else if (load_index(archive_fd, &entries, &entry_count) == 0)
+    {
+        for (size_t i = 0; i < entry_count; ++i)
+        {
+            arvik_xheader_t xheader;
+            arvik_footer_t footer;
+            arvik_xheader_t * xp = NULL;
+
+            if (is_long_name_member(&entries[i].arvik_header))
+            {
+                entry_long_name(archive_fd, &entries[i], long_name);
+                continue;
+            }
+            // Restored size of an extended member lives in its data
+            if (verbose && is_extended_member(&entries[i].arvik_header)
+                && pread(archive_fd, &xheader, sizeof(xheader)
+                         , field_value(entries[i].arvik_data_off, sizeof(entries[i].arvik_data_off), 10))
+                   == sizeof(xheader))
+            {
+                xp = &xheader;
+            }
+            // The entry keeps the footer's text; its prefix tells the version
+            memcpy(footer.arvik_data_crc, entries[i].arvik_data_crc, sizeof(footer.arvik_data_crc));
+            footer.arvik_term[0] = strncmp(footer.arvik_data_crc, "0x", 2) == 0 ? '+' : ARVIK_FOOTER_V2;
+            footer.arvik_term[1] = '\n';
+            print_member(&entries[i].arvik_header, long_name, &footer, verbose, xp);
+            long_name[0] = '\0';
+        }
+        free(entries);
+    }
+    else
+    {
+        process_archive(&in, verbose, 0, validate);
+    }
+    reader_close(&in);
+
+    // close if not stdin
+    if (archive_name != NULL)
+    {
+        close (archive_fd);
+    }
+    if (failed > 0)
+    {
+        fflush(stdout);
+        fprintf(stderr, "%zu member%s failed verification\n", failed, failed == 1 ? "" : "s");
+        return CRC_DATA_ERROR;
+    }
+    return EXIT_SUCCESS;
+}
+
+// Print information about a file in the archive
+void print_member(arvik_header_t * header, const char * long_name, const arvik_footer_t * footer, int verbose
+                  , arvik_xheader_t * xheader)
+{
+    size_t file_size;
+    time_t mtime;
+    struct tm *tm_info;
+    char time_str[32];
+    mode_t mode;
+    char mode_str[11];
+    char * back_pos = NULL;
+    char buffer[ARVIK_PATH_MAX] = {'\0'};
+    arvik_csum_alg_t alg;
+    uLong crc;
+
+    if (long_name_of(header, long_name))
+    {
+        snprintf(buffer, sizeof(buffer), "%s", long_name);
+    }
+    else
+    {
+        memcpy(buffer, header->arvik_name, 16);
+        if ((back_pos = strchr(buffer, '/')))
+        {
+            *back_pos = '\0';
+        }
+    }
+
+    if (verbose != 1)
+    {
+        printf("%s\n", buffer);
+        return;
+    }
+
+    file_size = strtol(header->arvik_size, NULL, 10);
+    if (xheader != NULL)
+    {
+        file_size = field_value(xheader->arvik_xsize, sizeof(xheader->arvik_xsize), 10);
+    }
+
+    // conert time string to time_t 
+    mtime = strtol(header->arvik_date, NULL, 10);
+    tm_info = localtime(&mtime);
+    strftime(time_str, sizeof(time_str), "%b %e %R %Y", tm_info);
+
+    // convert mode str to mode_t
+    mode = strtol(header->arvik_mode, NULL, 8);
+
+    // format mode string
+    mode_str[0] = S_ISDIR(mode) ? 'd' : ' ';
+    mode_str[1] = (mode & S_IRUSR) ? 'r' : '-';
+    mode_str[2] = (mode & S_IWUSR) ? 'w' : '-';
+    mode_str[3] = (mode & S_IXUSR) ? 'x' : '-';
+    mode_str[4] = (mode & S_IRGRP) ? 'r' : '-';
+    mode_str[5] = (mode & S_IWGRP) ? 'w' : '-';
+    mode_str[6] = (mode & S_IXGRP) ? 'x' : '-';
+    mode_str[7] = (mode & S_IROTH) ? 'r' : '-';
+    mode_str[8] = (mode & S_IWOTH) ? 'w' : '-';
+    mode_str[9] = (mode & S_IXOTH) ? 'x' : '-';
+    mode_str[10] = '\0';
+
+    printf("file name: %s\n", buffer);
+    printf("    mode:      %s\n", mode_str);
+    printf("    uid:             %.6s%s\n", header->arvik_uid, arvik_uname);
+    printf("    gid:              %.6s%s\n", header->arvik_gid, arvik_gname);
+    printf("    size:              %ld  bytes\n", file_size);
+    if (xheader != NULL)
+    {
+        printf("    stored:            %ld  bytes (%.4s)\n", (long) strtol(header->arvik_size, NULL, 10)
+               , xheader->arvik_xtype);
+    }
+    printf("    mtime:      %s\n", time_str);
+    if (parse_footer(footer, &alg, &crc) < 0)
+    {
+        printf("    data csc32: %.10s\n", footer->arvik_data_crc);
+    }
+    else
+    {
+        printf("    data %s: 0x%08lx\n", alg == ARVIK_CSUM_CRC32C ? "crc32c" : "csc32", crc);
+    }
+}
+
+// proccess archive file and call function for each member. With
+// validate, each member's data is checked against its footer as it goes
+// by; returns how many members failed.
+size_t process_archive(archive_reader_t * in, int verbose, int extract, int validate)
+{
+    arvik_header_t header;
+    arvik_footer_t footer;
+    arvik_xheader_t xheader;
+    int has_xheader;
+    off_t file_size;
+    off_t skip;
+    ssize_t bytes_read;
+    char long_name[ARVIK_PATH_MAX] = {'\0'}; // from the record before this member
+    arvik_index_t seen = { NULL, 0, 0 }; // members checked so far, for dref
+    char problem[512];
+    size_t failed = 0;
+    stats_mark_t mark; // for --stats
+    char name[ARVIK_PATH_MAX];
+    (void) extract;
+    // process each file in archive
+    stats_mark(&mark);
+    while ((bytes_read = reader_read(in, &header, sizeof(header))) > 0)
+    {
+        if (bytes_read != sizeof(header))
+        {
+            fprintf(stderr, "Error: Incomplete header read\n");
+            exit(READ_FAIL);
+        }
 
-            bytes_read = read(archive_fd, &footer, sizeof(footer));
+        if(!header_term_ok(&header))
+        {
+            fprintf(stderr, "Error: Invalid header terminator\n");
+            exit(BAD_TAG);
+        }
+
+        file_size = strtoll(header.arvik_size, NULL, 10);
+        skip = file_size + (file_size % 2);
+        has_xheader = 0;
+        problem[0] = '\0';
+        if (validate)
+        {
+            // Reads through the footer
+            if (verify_stream_member(in, &header, long_name, &xheader, &seen, &footer, problem, sizeof(problem)) < 0)
+            {
+                failed++;
+            }
+            has_xheader = is_extended_member(&header) && file_size >= (off_t) sizeof(xheader);
+        }
+        else if (is_long_name_member(&header) && file_size >= 0 && file_size < ARVIK_PATH_MAX)
+        {
+            if (reader_read(in, long_name, file_size) != file_size)
+            {
+                fprintf(stderr, "Error reading member name\n");
+                exit(READ_FAIL);
+            }
+            long_name[file_size] = '\0';
+            skip -= file_size;
+        }
+        else if (verbose && is_extended_member(&header) && file_size >= (off_t) sizeof(xheader))
+        {
+            if (reader_read(in, &xheader, sizeof(xheader)) != sizeof(xheader))
+            {
+                fprintf(stderr, "Error reading extension header\n");
+                exit(READ_FAIL);
+            }
+            has_xheader = 1;
+            skip -= sizeof(xheader);
+        }
+        if (!validate)
+        {
+            if (reader_skip(in, skip) < 0)
+            {
+                fprintf(stderr, "Error skipping file data\n");
+                exit(READ_FAIL);
+            }
+            bytes_read = reader_read(in, &footer, sizeof(footer));
             if (bytes_read != sizeof(footer))
             {
                 fprintf(stderr, "Error reading footer\n");
                 exit(READ_FAIL);
             }
-            if (footer.arvik_term[0] != '+' || footer.arvik_term[1] != '\n')
+            if (!footer_term_ok(&footer))
             {
                 fprintf(stderr, "Error reading footer\n");
                 exit(READ_FAIL);
             }
         }
+
+        if (!is_hidden_member(&header))
+        {
+            print_member(&header, long_name, &footer, verbose, has_xheader ? &xheader : NULL);
+            if (stats_wanted)
+            {
+                member_name(&header, long_name, name);
+                stats_member(name, file_size, &mark);
+            }
+        }
+        if (problem[0] != '\0')
+        {
+            fflush(stdout);
+            fputs(problem, stderr);
+        }
+        if (!is_long_name_member(&header))
+        {
+            long_name[0] = '\0';
+        }
+        stats_mark(&mark);
+    }
+    free(seen.entries);
+    return failed;
+}
+
+// Check a mapped archive without extracting it. Members are spread over
+// jobs threads, each checking its own CRCs; the main thread lists them and
+// reports problems in archive order. Unlike extraction, a corrupt member
+// does not stop the run. Returns how many members failed.
+size_t verify_parallel(int archive_fd, const char * map, off_t map_size, int verbose, int jobs)
+{
+    extract_pool_t pool;
+    pthread_t * threads;
+    int thread_count;
+    char problem[512]; // why the scan stopped early, if it did
+    char long_name[ARVIK_PATH_MAX] = {'\0'};
+    size_t failed = 0;
+
+    memset(&pool, 0, sizeof(pool));
+    pool.archive_fd = archive_fd;
+    pool.map = map;
+    pool.map_size = map_size;
+    pool.validate = 1;
+    pool.verify = 1;
+    pool.job_count = scan_verify(map, map_size, &pool.jobs, problem, sizeof(problem));
+
+    pthread_mutex_init(&pool.lock, NULL);
+    pthread_cond_init(&pool.job_done, NULL);
+    thread_count = MIN((size_t) jobs, pool.job_count);
+    threads = malloc((thread_count + 1) * sizeof(pthread_t));
+    if (threads == NULL)
+    {
+        perror("Error allocating threads");
+        exit(TOC_FAIL);
+    }
+    for (int i = 0; i < thread_count; ++i)
+    {
+        if (pthread_create(&threads[i], NULL, extract_worker, &pool) != 0)
+        {
+            fprintf(stderr, "Error starting verify thread\n");
+            exit(TOC_FAIL);
+        }
+    }
+
+    for (size_t i = 0; i < pool.job_count; ++i)
+    {
+        extract_job_t * job = &pool.jobs[i];
+        arvik_footer_t footer;
+        arvik_xheader_t xheader;
+        arvik_xheader_t * xp = NULL;
+
+        pthread_mutex_lock(&pool.lock);
+        while (!job->done)
+        {
+            pthread_cond_wait(&pool.job_done, &pool.lock);
+        }
+        pthread_mutex_unlock(&pool.lock);
+
+        memcpy(&footer, map + job->data_off + job->file_size + (job->file_size % 2), sizeof(footer));
+        if (is_long_name_member(&job->header))
+        {
+            long_name[0] = '\0';
+            if (job->file_size < ARVIK_PATH_MAX)
+            {
+                memcpy(long_name, map + job->data_off, job->file_size);
+                long_name[job->file_size] = '\0';
+            }
+        }
+        else if (!is_hidden_member(&job->header))
+        {
+            if (verbose && is_extended_member(&job->header) && job->file_size >= (off_t) sizeof(xheader))
+            {
+                memcpy(&xheader, map + job->data_off, sizeof(xheader));
+                xp = &xheader;
+            }
+            print_member(&job->header, long_name, &footer, verbose, xp);
+            long_name[0] = '\0';
+        }
+        if (job->message[0] != '\0')
+        {
+            fflush(stdout);
+            fputs(job->message, stderr);
+        }
+        if (job->status != 0)
+        {
+            failed++;
+        }
+    }
+    if (problem[0] != '\0')
+    {
+        fflush(stdout);
+        fputs(problem, stderr);
+        failed++;
+    }
+
+    for (int i = 0; i < thread_count; ++i)
+    {
+        pthread_join(threads[i], NULL);
+    }
+    free(threads);
+    free_jobs(pool.jobs, pool.job_count);
+    pthread_mutex_destroy(&pool.lock);
+    pthread_cond_destroy(&pool.job_done);
+    return failed;
+}
+
+// Walk the headers of a mapped archive for verify_parallel(): every member,
+// hidden ones included, as jobs in archive order. A bad header or a member
+// running past the end leaves no way to find the ones after it, so the
+// walk stops there and says why in problem.
+size_t scan_verify(const char * map, off_t map_size, extract_job_t ** jobs_out, char * problem, size_t problem_len)
+{
+    extract_job_t * jobs = NULL;
+    size_t count = 0;
+    size_t capacity = 0;
+    record_walk_t walk;
+    int result;
+    char name[ARVIK_PATH_MAX];
+
+    problem[0] = '\0';
+    record_walk_start(&walk, map, -1, map_size);
+    while ((result = record_next(&walk)) > 0)
+    {
+        extract_job_t * job;
+
+        if (count == capacity)
+        {
+            capacity = capacity ? capacity * 2 : 256;
+            jobs = realloc(jobs, capacity * sizeof(extract_job_t));
+            if (jobs == NULL)
+            {
+                perror("Error allocating member list");
+                exit(TOC_FAIL);
+            }
+        }
+        job = &jobs[count++];
+        memset(job, 0, sizeof(*job));
+        job->header = walk.header;
+        verify_name(&walk.header, walk.long_name, walk.off, name);
+        job->name = strdup(name);
+        if (job->name == NULL)
+        {
+            perror("Error allocating member list");
+            exit(TOC_FAIL);
+        }
+        job->data_off = walk.data_off;
+        job->file_size = walk.stored;
+    }
+    if (result < 0 && walk.damage == WALK_SHORT_HEADER)
+    {
+        snprintf(problem, problem_len, "Error: archive truncated at offset %lld\n", (long long) walk.off);
+    }
+    else if (result < 0 && walk.damage == WALK_BAD_HEADER)
+    {
+        snprintf(problem, problem_len, "Error: Header terminator invalid at offset %lld"
+                 " - cannot check the members after it\n", (long long) walk.off);
+    }
+    else if (result < 0)
+    {
+        verify_name(&walk.header, walk.long_name, walk.off, name);
+        snprintf(problem, problem_len, "Error: archive truncated in %s\n", name);
+    }
+    *jobs_out = jobs;
+    return count;
+}
+
+// Check one member of a mapped archive: its footer terminator and its CRC,
+// over the restored data for an extended member. Never exits; problems are
+// left in the job.
+void verify_job_run(extract_pool_t * pool, extract_job_t * job)
+{
+    arvik_footer_t footer;
+    arvik_csum_alg_t alg;
+    uLong stored_crc;
+    csum_t sum;
+    io_out_t out; // restored data goes nowhere
+
+    memcpy(&footer, pool->map + job->data_off + job->file_size + (job->file_size % 2), sizeof(footer));
+    if (!footer_term_ok(&footer))
+    {
+        job_note(job, "Error: Footer terminator invalid for %s\n", job->name);
+        job->status = CRC_DATA_ERROR;
+        return;
+    }
+    if (parse_footer(&footer, &alg, &stored_crc) < 0)
+    {
+        job_note(job, "Error parsing CRC value for %s\n", job->name);
+        job->status = CRC_DATA_ERROR;
+        return;
+    }
+    csum_init(&sum, alg);
+    if (is_extended_member(&job->header))
+    {
+        int restored;
+
+        io_out_discard(&out);
+        restored = restore_extended(&out, pool->archive_fd, pool->map, pool->map_size, job->data_off, &sum);
+        if (restored < 0)
+        {
+            job_note(job, "Error restoring data for %s: %s\n", job->name
+                     , restored == -2 ? "corrupt member data" : strerror(errno));
+            job->status = CRC_DATA_ERROR;
+            return;
+        }
+    }
+    else
+    {
+        csum_update(&sum, pool->map + job->data_off, job->file_size);
+    }
+    if (sum.value != stored_crc)
+    {
+        job_note(job, "CRC check failed for %s\n", job->name);
+        job->status = CRC_DATA_ERROR;
+    }
+}
+
+// The name problems with a member are reported under, into name, which
+// holds ARVIK_PATH_MAX bytes. Hidden members have no name of their own, so
+// they go by what they are and where.
+void verify_name(arvik_header_t * header, const char * long_name, off_t header_off, char * name)
+{
+    const char * kind = NULL;
+
+    if (is_index_member(header))
+    {
+        kind = "member index";
+    }
+    else if (is_deleted_member(header))
+    {
+        kind = "replaced member";
+    }
+    else if (is_long_name_member(header))
+    {
+        kind = "long name record";
+    }
+    if (kind != NULL)
+    {
+        snprintf(name, ARVIK_PATH_MAX, "%s at offset %lld", kind, (long long) header_off);
+        return;
+    }
+    member_name(header, long_name, name);
+}
+
+// Check one member of a stream as it goes by, after its header was read:
+// its CRC and its footer terminator. Reads through the footer, into
+// footer; a long name record's name goes to long_name, and an extended
+// member's extension header to xheader. The footer that says which CRC to
+// expect comes last, so both are computed. A dref is checked against the
+// footer of the member it repeats, found in seen. Returns -1 with the
+// reason in problem if the member is corrupt, and exits if the archive
+// cannot be read.
+int verify_stream_member(archive_reader_t * in, arvik_header_t * header, char * long_name, arvik_xheader_t * xheader
+                         , arvik_index_t * seen, arvik_footer_t * footer, char * problem, size_t problem_len)
+{
+    off_t header_off = in->offset - sizeof(*header);
+    off_t data_end;
+    off_t file_size = field_value(header->arvik_size, sizeof(header->arvik_size), 10);
+    csum_t sum;
+    csum_t sum_c;
+    arvik_csum_alg_t alg;
+    uLong stored_crc;
+    io_out_t out; // restored data goes nowhere
+    arvik_index_entry_t * target = NULL;
+    int is_ref = 0;
+    int restored = 0;
+    char name[ARVIK_PATH_MAX];
+
+    verify_name(header, long_name, header_off, name);
+    data_end = in->offset + file_size;
+    csum_init(&sum, ARVIK_CSUM_CRC32);
+    csum_init(&sum_c, ARVIK_CSUM_CRC32C);
+    sum.also = &sum_c;
+    io_out_discard(&out);
+
+    if (is_long_name_member(header) && file_size < ARVIK_PATH_MAX)
+    {
+        if (reader_read(in, long_name, file_size) != file_size)
+        {
+            restored = -1;
+        }
+        else
+        {
+            long_name[file_size] = '\0';
+            csum_update(&sum, long_name, file_size);
+        }
+    }
+    else if (is_extended_member(header) && file_size >= (off_t) sizeof(*xheader))
+    {
+        if (reader_read(in, xheader, sizeof(*xheader)) != sizeof(*xheader))
+        {
+            restored = -1;
+        }
+        else if (is_ref_xheader(xheader))
+        {
+            off_t raw_size;
+            off_t target_off;
+
+            is_ref = 1;
+            if (check_ref(xheader, file_size, header_off, &raw_size, &target_off) < 0)
+            {
+                restored = -2;
+            }
+            else
+            {
+                target = index_find(seen, target_off + sizeof(*header));
+            }
+        }
+        else
+        {
+            restored = restore_stream(in, &out, xheader, file_size, &sum);
+        }
+    }
+    else
+    {
+        while (in->offset < data_end)
+        {
+            const char * data;
+            ssize_t bytes_read = reader_next(in, &data, data_end - in->offset);
+
+            if (bytes_read <= 0)
+            {
+                restored = -1;
+                break;
+            }
+            csum_update(&sum, data, bytes_read);
+        }
+    }
+
+    // Whatever was made of the data, carry on after it
+    if (restored == -1 || in->offset > data_end
+        || reader_skip(in, data_end - in->offset + (file_size % 2)) < 0
+        || reader_read(in, footer, sizeof(*footer)) != sizeof(*footer))
+    {
+        fflush(stdout);
+        fprintf(stderr, "Error reading data of %s: archive truncated or unreadable\n", name);
+        exit(READ_FAIL);
+    }
+
+    if (!footer_term_ok(footer))
+    {
+        snprintf(problem, problem_len, "Error: Footer terminator invalid for %s\n", name);
+        return -1;
+    }
+    if (restored < 0)
+    {
+        snprintf(problem, problem_len, "Error restoring data for %s: corrupt member data\n", name);
+        return -1;
+    }
+    if (parse_footer(footer, &alg, &stored_crc) < 0)
+    {
+        snprintf(problem, problem_len, "Error parsing CRC value for %s\n", name);
+        return -1;
+    }
+    if (is_ref)
+    {
+        // Same data, so the same footer CRC; the data itself was checked there
+        if (target == NULL)
+        {
+            snprintf(problem, problem_len, "Error restoring data for %s: it repeats a member that"
+                     " is missing or corrupt\n", name);
+            return -1;
+        }
+        if (memcmp(target->arvik_data_crc, footer->arvik_data_crc, sizeof(footer->arvik_data_crc)) != 0)
+        {
+            snprintf(problem, problem_len, "CRC check failed for %s\n", name);
+            return -1;
         }
+        return 0;
+    }
+    if ((alg == ARVIK_CSUM_CRC32C ? sum_c.value : sum.value) != stored_crc)
+    {
+        snprintf(problem, problem_len, "CRC check failed for %s\n", name);
+        return -1;
+    }
+    index_add(seen, header, header_off + sizeof(*header), footer);
+    return 0;
 }
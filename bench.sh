@@ -0,0 +1,170 @@
+#!/bin/bash
+# Throughput benchmark for arvik. Builds reproducible synthetic corpora,
+# times -c, -t, -x and -x -V on each and prints one JSON object per
+# corpus and operation (JSON Lines), so runs of different releases can be
+# compared with -C.
+#
+#   bench.sh arvik-binary work-dir
+#   bench.sh -C old.json new.json
+#
+# Sizes come from the environment; the defaults are the full suite:
+#   BENCH_TINY_FILES   tiny files, 0..1K of text          (100000)
+#   BENCH_BIG_FILES    large incompressible files          (2)
+#   BENCH_BIG_SIZE     size of each large file             (2G)
+#   BENCH_TEXT_SIZE    size of the one large log file      (1G)
+#   BENCH_ODD_FILES    random files of 1..4M, about half of
+#                      them odd-sized for the padding path (500)
+#   BENCH_REPS         runs of each operation, best kept   (3)
+#   BENCH_FLAGS        extra arvik flags for every run, e.g. "-j 8"
+#   BENCH_TOLERANCE    percent slower that -C reports as a regression (5)
+#
+# Corpora are kept in work-dir and only made again when the sizes change;
+# what arvik prints on stderr goes to work-dir/arvik.log.
+# The page cache is not dropped between runs, so the numbers are for warm
+# input.
+
+set -e
+
+compare()
+{
+    awk -v tolerance="${BENCH_TOLERANCE:-5}" '
+        function field(line, name,    m)
+        {
+            if (match(line, "\"" name "\":\"?[^,\"}]*"))
+            {
+                m = substr(line, RSTART, RLENGTH)
+                sub("\"" name "\":\"?", "", m)
+                return m
+            }
+            return ""
+        }
+        FNR == NR { old[field($0, "corpus") " " field($0, "op")] = field($0, "mb_per_s"); next }
+        {
+            key = field($0, "corpus") " " field($0, "op")
+            if (!(key in old) || old[key] <= 0)
+            {
+                printf "%-22s %10s %10.1f MB/s\n", key, "-", field($0, "mb_per_s")
+                next
+            }
+            change = (field($0, "mb_per_s") - old[key]) * 100 / old[key]
+            flag = change < -tolerance ? "  REGRESSION" : ""
+            printf "%-22s %10.1f %10.1f MB/s %+7.1f%%%s\n", key, old[key], field($0, "mb_per_s"), change, flag
+            if (flag != "")
+            {
+                regressed = 1
+            }
+        }
+        END { exit regressed }
+    ' "$1" "$2"
+}
+
+if [ "$1" = "-C" ]
+then
+    [ $# -eq 3 ] || { echo "Usage: bench.sh -C old.json new.json" >&2; exit 2; }
+    compare "$2" "$3"
+    exit
+fi
+if [ $# -ne 2 ]
+then
+    echo "Usage: bench.sh arvik-binary work-dir" >&2
+    exit 2
+fi
+
+ARVIK=$(cd "$(dirname "$1")" && pwd)/$(basename "$1")
+WORK=$2
+TOOL=$(cd "$(dirname "$0")" && pwd)/benchtool
+TINY_FILES=${BENCH_TINY_FILES:-100000}
+BIG_FILES=${BENCH_BIG_FILES:-2}
+BIG_SIZE=${BENCH_BIG_SIZE:-2G}
+TEXT_SIZE=${BENCH_TEXT_SIZE:-1G}
+ODD_FILES=${BENCH_ODD_FILES:-500}
+REPS=${BENCH_REPS:-3}
+FLAGS=${BENCH_FLAGS:-}
+VERSION=$(cd "$(dirname "$0")" && git describe --always --dirty 2>/dev/null || echo unknown)
+
+mkdir -p "$WORK"
+WORK=$(cd "$WORK" && pwd)
+: > "$WORK/arvik.log"
+
+# make_corpus name count min max kind seed: files in $WORK/name, with
+# their count and total bytes in $WORK/name.size
+make_corpus()
+{
+    local spec="$2 $3 $4 $5 $6"
+
+    if [ "$(cat "$WORK/$1.spec" 2>/dev/null)" != "$spec" ]
+    then
+        echo "making corpus $1" >&2
+        rm -rf "${WORK:?}/$1" "$WORK/$1.spec"
+        "$TOOL" files "$WORK/$1" $spec > "$WORK/$1.size"
+        echo "$spec" > "$WORK/$1.spec"
+    fi
+}
+
+# measure corpus op dir arvik-args...: best of $REPS runs of arvik in dir,
+# printed as one JSON line
+measure()
+{
+    local corpus=$1 op=$2 dir=$3
+    local files bytes best="" result
+
+    shift 3
+    read -r files bytes < "$WORK/$corpus.size"
+    for ((rep = 0; rep < REPS; ++rep))
+    do
+        case $op in
+            extract*)
+                rm -rf "$dir"
+                mkdir -p "$dir"
+                ;;
+        esac
+        result=$(cd "$dir" && "$TOOL" run "$ARVIK" $FLAGS "$@" 2>> "$WORK/arvik.log")
+        if [ "${result##* }" != 0 ]
+        then
+            echo "arvik $* failed in $dir (exit ${result##* }), see $WORK/arvik.log" >&2
+            exit 1
+        fi
+        if [ -z "$best" ] || awk -v a="$result" -v b="$best" 'BEGIN { split(a, x, " "); split(b, y, " ");
+                                                                        exit !(x[1] < y[1]) }'
+        then
+            best=$result
+        fi
+    done
+    echo "$best" | awk -v corpus="$corpus" -v op="$op" -v files="$files" -v bytes="$bytes" \
+                       -v version="$VERSION" -v flags="$FLAGS" '{
+        wall = $1 > 0 ? $1 : 1e-6
+        printf "{\"version\":\"%s\",\"corpus\":\"%s\",\"op\":\"%s\",\"flags\":\"%s\",\"files\":%d,\"bytes\":%.0f" \
+               ",\"wall_s\":%.3f,\"user_s\":%.3f,\"sys_s\":%.3f,\"mb_per_s\":%.1f,\"files_per_s\":%.0f" \
+               ",\"max_rss_kb\":%d}\n", version, corpus, op, flags, files, bytes, $1, $2, $3,
+               bytes / 1048576 / wall, files / wall, $4
+    }'
+}
+
+# run_suite corpus: every operation on one corpus; $WORK/corpus.arv is
+# kept for the next run to overwrite
+run_suite()
+{
+    local corpus=$1 archive=$WORK/$1.arv
+
+    measure "$corpus" create "$WORK" -c -R -f "$archive" "$corpus"
+    measure "$corpus" list "$WORK" -t -f "$archive"
+    measure "$corpus" extract "$WORK/$corpus.out" -x -f "$archive"
+    measure "$corpus" extract-verify "$WORK/$corpus.out" -x -V -f "$archive"
+    measure "$corpus" verify "$WORK" -t -V -f "$archive"
+    if [ "$2" = compress ]
+    then
+        measure "$corpus" create-z "$WORK" -c -z -R -f "$archive" "$corpus"
+        measure "$corpus" extract-z "$WORK/$corpus.out" -x -V -f "$archive"
+    fi
+    rm -rf "${WORK:?}/$corpus.out" "$archive"
+}
+
+make_corpus tiny "$TINY_FILES" 0 1K text 1
+make_corpus big "$BIG_FILES" "$BIG_SIZE" "$BIG_SIZE" random 2
+make_corpus text 1 "$TEXT_SIZE" "$TEXT_SIZE" text 3
+make_corpus odd "$ODD_FILES" 1 4M random 4
+
+run_suite tiny
+run_suite big compress
+run_suite text compress
+run_suite odd
@@ -0,0 +1,292 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <errno.h>
+#include <time.h>
+#include <stdint.h>
+
+// Helper for bench.sh: makes the synthetic corpora and times arvik runs.
+//
+//   benchtool files dir count min max kind seed
+//       write count files of min..max bytes below dir, 1000 to a
+//       subdirectory; kind is "random" (incompressible) or "text" (log
+//       lines). The same seed always gives the same files. Prints the
+//       number of files and bytes written.
+//   benchtool run command args...
+//       run command with its output thrown away. Prints wall, user and
+//       system seconds, peak RSS in KiB and the exit status.
+
+#define FILES_PER_DIR 1000
+#define GEN_BLOCK (1024 * 1024)
+
+typedef struct rng_s {
+    uint64_t state;
+} rng_t;
+
+uint64_t rng_next(rng_t * rng);
+void fill_random(rng_t * rng, char * buffer, size_t len);
+size_t fill_text(rng_t * rng, char * buffer, size_t len);
+int write_file(const char * name, off_t size, int text, rng_t * rng, char * buffer);
+int make_files(const char * dir, long count, off_t min_size, off_t max_size, int text, uint64_t seed);
+int run_command(char ** argv);
+int parse_count(const char * text, off_t * value);
+void usage(void);
+
+// xorshift64*: fast, and the same stream on every machine
+uint64_t rng_next(rng_t * rng)
+{
+    rng->state ^= rng->state >> 12;
+    rng->state ^= rng->state << 25;
+    rng->state ^= rng->state >> 27;
+    return rng->state * 2685821657736338717ULL;
+}
+
+void fill_random(rng_t * rng, char * buffer, size_t len)
+{
+    size_t pos = 0;
+
+    while (pos + sizeof(uint64_t) <= len)
+    {
+        uint64_t word = rng_next(rng);
+
+        memcpy(buffer + pos, &word, sizeof(word));
+        pos += sizeof(word);
+    }
+    while (pos < len)
+    {
+        buffer[pos++] = (char) rng_next(rng);
+    }
+}
+
+// Log lines that compress about as well as real service logs. Only
+// whole lines are written; returns the bytes used, at most len.
+size_t fill_text(rng_t * rng, char * buffer, size_t len)
+{
+    static const char * levels[] = { "INFO", "INFO", "INFO", "DEBUG", "WARN", "ERROR" };
+    static const char * verbs[] = { "GET", "GET", "POST", "PUT", "DELETE" };
+    static const char * paths[] = { "/api/v1/users", "/api/v1/orders", "/health", "/static/app.js"
+                                    , "/api/v2/search", "/login" };
+    size_t pos = 0;
+
+    for (;;)
+    {
+        char line[256];
+        uint64_t r = rng_next(rng);
+        int n;
+
+        n = snprintf(line, sizeof(line), "2024-%02d-%02dT%02d:%02d:%02d.%03dZ %-5s host%02d svc[%d]: %s %s"
+                     " id=%08x status=%d took=%dms\n"
+                     , (int) (r % 12) + 1, (int) ((r >> 4) % 28) + 1, (int) ((r >> 9) % 24)
+                     , (int) ((r >> 14) % 60), (int) ((r >> 20) % 60), (int) ((r >> 26) % 1000)
+                     , levels[(r >> 36) % 6], (int) ((r >> 39) % 32), 1000 + (int) ((r >> 44) % 64)
+                     , verbs[(r >> 50) % 5], paths[(r >> 53) % 6], (unsigned) rng_next(rng)
+                     , (r >> 56) % 8 ? 200 : 500, (int) (r >> 58) * 7 + 1);
+        if (pos + n > len)
+        {
+            return pos;
+        }
+        memcpy(buffer + pos, line, n);
+        pos += n;
+    }
+}
+
+// Write one file of exactly size bytes
+int write_file(const char * name, off_t size, int text, rng_t * rng, char * buffer)
+{
+    int fd = open(name, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    off_t written = 0;
+
+    if (fd < 0)
+    {
+        fprintf(stderr, "Error creating %s: %s\n", name, strerror(errno));
+        return -1;
+    }
+    while (written < size)
+    {
+        size_t len = size - written < GEN_BLOCK ? (size_t) (size - written) : GEN_BLOCK;
+
+        if (text)
+        {
+            size_t used = fill_text(rng, buffer, len);
+
+            // Pad a tail too short for a whole line
+            memset(buffer + used, '.', len - used);
+            if (len > used)
+            {
+                buffer[len - 1] = '\n';
+            }
+        }
+        else
+        {
+            fill_random(rng, buffer, len);
+        }
+        if (write(fd, buffer, len) != (ssize_t) len)
+        {
+            fprintf(stderr, "Error writing %s: %s\n", name, strerror(errno));
+            close(fd);
+            return -1;
+        }
+        written += len;
+    }
+    close(fd);
+    return 0;
+}
+
+int make_files(const char * dir, long count, off_t min_size, off_t max_size, int text, uint64_t seed)
+{
+    rng_t rng = { seed * 0x9e3779b97f4a7c15ULL + 1 };
+    char * buffer = malloc(GEN_BLOCK);
+    char name[4096];
+    off_t total = 0;
+
+    if (buffer == NULL)
+    {
+        perror("Error allocating buffer");
+        return -1;
+    }
+    if (mkdir(dir, 0755) < 0 && errno != EEXIST)
+    {
+        fprintf(stderr, "Error creating %s: %s\n", dir, strerror(errno));
+        free(buffer);
+        return -1;
+    }
+    for (long i = 0; i < count; ++i)
+    {
+        off_t size = min_size;
+
+        if (max_size > min_size)
+        {
+            size += rng_next(&rng) % (uint64_t) (max_size - min_size + 1);
+        }
+        snprintf(name, sizeof(name), "%s/d%03ld", dir, i / FILES_PER_DIR);
+        if (i % FILES_PER_DIR == 0 && mkdir(name, 0755) < 0 && errno != EEXIST)
+        {
+            fprintf(stderr, "Error creating %s: %s\n", name, strerror(errno));
+            free(buffer);
+            return -1;
+        }
+        snprintf(name, sizeof(name), "%s/d%03ld/f%06ld", dir, i / FILES_PER_DIR, i);
+        if (write_file(name, size, text, &rng, buffer) < 0)
+        {
+            free(buffer);
+            return -1;
+        }
+        total += size;
+    }
+    free(buffer);
+    printf("%ld %lld\n", count, (long long) total);
+    return 0;
+}
+
+// Run a command to completion with its output discarded
+int run_command(char ** argv)
+{
+    struct timespec start;
+    struct timespec end;
+    struct rusage usage;
+    int status;
+    pid_t pid;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    pid = fork();
+    if (pid < 0)
+    {
+        perror("Error starting command");
+        return -1;
+    }
+    if (pid == 0)
+    {
+        int null_fd = open("/dev/null", O_WRONLY);
+
+        if (null_fd >= 0)
+        {
+            dup2(null_fd, STDOUT_FILENO);
+            close(null_fd);
+        }
+        execvp(argv[0], argv);
+        fprintf(stderr, "Error running %s: %s\n", argv[0], strerror(errno));
+        _exit(127);
+    }
+    if (wait4(pid, &status, 0, &usage) < 0)
+    {
+        perror("Error waiting for command");
+        return -1;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    printf("%.6f %.6f %.6f %ld %d\n"
+           , (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9
+           , usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6
+           , usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6
+           , usage.ru_maxrss
+           , WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status));
+    return 0;
+}
+
+// Parse a count or size such as 100000, 64K or 2G
+int parse_count(const char * text, off_t * value)
+{
+    char * end;
+    long long number = strtoll(text, &end, 10);
+
+    switch (*end)
+    {
+        case 'G': case 'g':
+            number *= 1024;
+            // fall through
+        case 'M': case 'm':
+            number *= 1024;
+            // fall through
+        case 'K': case 'k':
+            number *= 1024;
+            end++;
+            break;
+        default:
+            break;
+    }
+    if (end == text || *end != '\0' || number < 0)
+    {
+        return -1;
+    }
+    *value = number;
+    return 0;
+}
+
+void usage(void)
+{
+    fprintf(stderr, "Usage: benchtool files dir count min max random|text seed\n");
+    fprintf(stderr, "       benchtool run command args...\n");
+    exit(2);
+}
+
+int main(int argc, char * argv[])
+{
+    off_t count;
+    off_t min_size;
+    off_t max_size;
+
+    if (argc >= 3 && strcmp(argv[1], "run") == 0)
+    {
+        return run_command(&argv[2]) < 0 ? 1 : 0;
+    }
+    if (argc != 8 || strcmp(argv[1], "files") != 0)
+    {
+        usage();
+    }
+    if (parse_count(argv[3], &count) < 0 || parse_count(argv[4], &min_size) < 0
+        || parse_count(argv[5], &max_size) < 0 || max_size < min_size
+        || (strcmp(argv[6], "random") != 0 && strcmp(argv[6], "text") != 0))
+    {
+        usage();
+    }
+    return make_files(argv[2], count, min_size, max_size, strcmp(argv[6], "text") == 0
+                      , strtoull(argv[7], NULL, 10)) < 0 ? 1 : 0;
+}
@@ -0,0 +1,1635 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <zlib.h>
+#if defined(__x86_64__)
+# include <immintrin.h>
+#endif
+
+#include "libarvik_private.h"
+
+// Output is staged here and written in pieces this big, so a run of small
+// members costs one write() instead of four each
+#define WRITER_BUFFER (1024 * 1024)
+
+struct arvik_writer_s {
+    int fd;
+    record_out_t dest;      // writer_dest(), for the put_*() record writers
+    arvik_csum_alg_t alg;
+    char * buffer;          // WRITER_BUFFER bytes of staged output
+    size_t len;
+    int failed;             // a member was left half written; the archive is unusable
+};
+
+struct arvik_reader_s {
+    int fd;
+    int own_fd;             // opened by arvik_reader_open(), so closed with the reader
+    const char * map;       // whole archive, mapped read-only
+    off_t size;
+    record_walk_t walk;     // at the member last returned
+};
+
+// Where arvik_member_write() and arvik_member_verify() restore to: an fd,
+// or nowhere when only checking
+typedef struct restore_out_s {
+    restore_sink_t sink;    // out_data() and out_hole(), pointed back here
+    int fd;                 // -1 to discard
+    arvik_csum_alg_t alg;
+    uLong crc;
+    int seeked;             // a hole was made with lseek, so the end may need ftruncate
+} restore_out_t;
+
+static uint32_t crc32c_sw(uint32_t crc, const unsigned char * buffer, size_t len);
+static uLong gf2_matrix_times(const uLong * mat, uLong vec);
+static void gf2_matrix_square(uLong * square, const uLong * mat);
+static void csum_setup(void);
+#if defined(__x86_64__)
+static uint32_t crc32c_sse42(uint32_t crc, const unsigned char * buffer, size_t len);
+static uint32_t crc32_pclmul(uint32_t crc, const unsigned char * buffer, size_t len);
+#endif
+static int write_all(int fd, const void * data, size_t len);
+static int writer_put(arvik_writer_t * writer, const void * data, size_t len);
+static int writer_flush(arvik_writer_t * writer);
+static int writer_dest(record_out_t * dest, const void * data, size_t len);
+static int writer_member(arvik_writer_t * writer, const char * name, struct stat * st, int fd, const char * data);
+static int walk_read(record_walk_t * walk, void * data, size_t len, off_t off);
+static int member_of(record_walk_t * walk, arvik_member_t * member);
+static int member_at(const char * map, off_t map_size, off_t off, arvik_member_t * member);
+static int restore_member(const char * map, off_t map_size, const arvik_member_t * member, restore_sink_t * sink);
+static ssize_t source_next(restore_source_t * source, const char ** data, size_t max);
+static const char * source_take(restore_source_t * source, size_t len, char * spare);
+static int sink_hole(restore_sink_t * sink, off_t len);
+static void out_start(restore_out_t * out, int fd, arvik_csum_alg_t alg);
+static int out_data(restore_sink_t * sink, const char * data, size_t len);
+static int out_hole(restore_sink_t * sink, off_t len);
+
+// CRC32C table for CPUs without the crc32 instruction
+static uint32_t crc32c_table[256];
+// Fastest CRC32C for this CPU, picked by csum_setup()
+static uint32_t (* crc32c_impl)(uint32_t, const unsigned char *, size_t) = crc32c_sw;
+// PCLMULQDQ folding is available for the IEEE CRC
+static int crc32_use_pclmul = 0;
+static pthread_once_t csum_once = PTHREAD_ONCE_INIT;
+
+const char * arvik_strerror(int error)
+{
+    switch (error)
+    {
+        case ARVIK_OK:
+            return "Success";
+        case ARVIK_ERR_IO:
+            return strerror(errno);
+        case ARVIK_ERR_NOMEM:
+            return "Out of memory";
+        case ARVIK_ERR_FORMAT:
+            return "Not an arvik archive, or a damaged one";
+        case ARVIK_ERR_CRC:
+            return "Member data does not match its CRC";
+        case ARVIK_ERR_UNSUPPORTED:
+            return "Member is stored in a way this version cannot restore";
+        case ARVIK_ERR_NOT_FOUND:
+            return "No such member";
+        case ARVIK_ERR_ARG:
+            return "Invalid argument";
+        case ARVIK_ERR_CHANGED:
+            return "File changed size while it was archived";
+        default:
+            return "Unknown error";
+    }
+}
+
+// Build the software table and pick hardware paths the CPU supports
+static void csum_setup(void)
+{
+    for (uint32_t n = 0; n < 256; ++n)
+    {
+        uint32_t c = n;
+
+        for (int k = 0; k < 8; ++k)
+        {
+            c = c & 1 ? (c >> 1) ^ 0x82f63b78 : c >> 1;
+        }
+        crc32c_table[n] = c;
+    }
+#if defined(__x86_64__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse4.2"))
+    {
+        crc32c_impl = crc32c_sse42;
+    }
+    crc32_use_pclmul = __builtin_cpu_supports("pclmul") && __builtin_cpu_supports("sse4.1");
+#endif
+}
+
+// Add bytes to a checksum value
+uLong csum_bytes(arvik_csum_alg_t alg, uLong crc, const void * buffer, size_t len)
+{
+    const unsigned char * bytes = buffer;
+
+    pthread_once(&csum_once, csum_setup);
+    if (alg == ARVIK_CSUM_CRC32C)
+    {
+        return crc32c_impl(crc, bytes, len);
+    }
+#if defined(__x86_64__)
+    // Fold whole 16-byte blocks with PCLMULQDQ, zlib does the tail
+    if (crc32_use_pclmul && len >= 64)
+    {
+        size_t folded = len & ~(size_t) 15;
+
+        crc = ~crc32_pclmul(~(uint32_t) crc, bytes, folded) & 0xffffffffUL;
+        bytes += folded;
+        len -= folded;
+    }
+#endif
+    while (len > 0)
+    {
+        uInt chunk = MIN(len, (size_t) 1 << 30);
+
+        crc = crc32(crc, bytes, chunk);
+        bytes += chunk;
+        len -= chunk;
+    }
+    return crc;
+}
+
+// Checksum of A followed by B, from the checksums of A and B
+uLong csum_combine(arvik_csum_alg_t alg, uLong crc1, uLong crc2, off_t len2)
+{
+    uLong even[32]; // operator for an even power of two zero bits
+    uLong odd[32];  // operator for an odd power of two zero bits
+    uLong row = 1;
+
+    if (alg == ARVIK_CSUM_CRC32)
+    {
+        return crc32_combine(crc1, crc2, len2);
+    }
+    if (len2 <= 0)
+    {
+        return crc1;
+    }
+
+    // Same method as zlib's crc32_combine, with the Castagnoli polynomial
+    odd[0] = 0x82f63b78UL;
+    for (int n = 1; n < 32; ++n)
+    {
+        odd[n] = row;
+        row <<= 1;
+    }
+    gf2_matrix_square(even, odd);
+    gf2_matrix_square(odd, even);
+    do
+    {
+        gf2_matrix_square(even, odd);
+        if (len2 & 1)
+        {
+            crc1 = gf2_matrix_times(even, crc1);
+        }
+        len2 >>= 1;
+        if (len2 == 0)
+        {
+            break;
+        }
+        gf2_matrix_square(odd, even);
+        if (len2 & 1)
+        {
+            crc1 = gf2_matrix_times(odd, crc1);
+        }
+        len2 >>= 1;
+    } while (len2 != 0);
+    return crc1 ^ crc2;
+}
+
+// Extend a checksum value over len zero bytes without reading them. The
+// checksum of 2^k zeros is built by doubling and combined in per set bit.
+uLong csum_zero_bytes(arvik_csum_alg_t alg, uLong crc, off_t len)
+{
+    uLong zeros = csum_bytes(alg, 0, "", 1);
+    off_t zeros_len = 1;
+    uLong run = 0;
+    off_t run_len = 0;
+
+    while (len > 0)
+    {
+        if (len & 1)
+        {
+            run = csum_combine(alg, run, zeros, zeros_len);
+            run_len += zeros_len;
+        }
+        len >>= 1;
+        if (len > 0)
+        {
+            zeros = csum_combine(alg, zeros, zeros, zeros_len);
+            zeros_len *= 2;
+        }
+    }
+    if (run_len > 0)
+    {
+        crc = csum_combine(alg, crc, run, run_len);
+    }
+    return crc;
+}
+
+static uLong gf2_matrix_times(const uLong * mat, uLong vec)
+{
+    uLong sum = 0;
+
+    while (vec)
+    {
+        if (vec & 1)
+        {
+            sum ^= *mat;
+        }
+        vec >>= 1;
+        mat++;
+    }
+    return sum;
+}
+
+static void gf2_matrix_square(uLong * square, const uLong * mat)
+{
+    for (int n = 0; n < 32; ++n)
+    {
+        square[n] = gf2_matrix_times(mat, mat[n]);
+    }
+}
+
+// Table-driven CRC32C
+static uint32_t crc32c_sw(uint32_t crc, const unsigned char * buffer, size_t len)
+{
+    crc = ~crc;
+    while (len--)
+    {
+        crc = crc32c_table[(crc ^ *buffer++) & 0xff] ^ (crc >> 8);
+    }
+    return ~crc;
+}
+
+#if defined(__x86_64__)
+// CRC32C with the SSE4.2 crc32 instruction, eight bytes at a time
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_sse42(uint32_t crc, const unsigned char * buffer, size_t len)
+{
+    uint64_t c = ~crc & 0xffffffffU;
+
+    while (len > 0 && ((uintptr_t) buffer & 7) != 0)
+    {
+        c = _mm_crc32_u8(c, *buffer++);
+        len--;
+    }
+    while (len >= 8)
+    {
+        uint64_t word;
+
+        memcpy(&word, buffer, sizeof(word));
+        c = _mm_crc32_u64(c, word);
+        buffer += 8;
+        len -= 8;
+    }
+    while (len > 0)
+    {
+        c = _mm_crc32_u8(c, *buffer++);
+        len--;
+    }
+    return ~(uint32_t) c;
+}
+
+// IEEE CRC32 by carry-less multiply folding, from Intel's "Fast CRC
+// Computation for Generic Polynomials Using PCLMULQDQ". Works on the
+// inverted CRC; len must be a multiple of 16 and at least 64.
+__attribute__((target("pclmul,sse4.1")))
+static uint32_t crc32_pclmul(uint32_t crc, const unsigned char * buffer, size_t len)
+{
+    static const uint64_t __attribute__((aligned(16))) k1k2[] = { 0x0154442bd4, 0x01c6e41596 };
+    static const uint64_t __attribute__((aligned(16))) k3k4[] = { 0x01751997d0, 0x00ccaa009e };
+    static const uint64_t __attribute__((aligned(16))) k5k0[] = { 0x0163cd6124, 0x0000000000 };
+    static const uint64_t __attribute__((aligned(16))) poly[] = { 0x01db710641, 0x01f7011641 };
+    __m128i x0, x1, x2, x3, x4, x5, x6, x7, x8, y5, y6, y7, y8;
+
+    x1 = _mm_loadu_si128((const __m128i *) (buffer + 0x00));
+    x2 = _mm_loadu_si128((const __m128i *) (buffer + 0x10));
+    x3 = _mm_loadu_si128((const __m128i *) (buffer + 0x20));
+    x4 = _mm_loadu_si128((const __m128i *) (buffer + 0x30));
+    x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128(crc));
+    x0 = _mm_load_si128((const __m128i *) k1k2);
+    buffer += 64;
+    len -= 64;
+
+    // Fold four blocks of 16 in parallel
+    while (len >= 64)
+    {
+        x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+        x6 = _mm_clmulepi64_si128(x2, x0, 0x00);
+        x7 = _mm_clmulepi64_si128(x3, x0, 0x00);
+        x8 = _mm_clmulepi64_si128(x4, x0, 0x00);
+        x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+        x2 = _mm_clmulepi64_si128(x2, x0, 0x11);
+        x3 = _mm_clmulepi64_si128(x3, x0, 0x11);
+        x4 = _mm_clmulepi64_si128(x4, x0, 0x11);
+        y5 = _mm_loadu_si128((const __m128i *) (buffer + 0x00));
+        y6 = _mm_loadu_si128((const __m128i *) (buffer + 0x10));
+        y7 = _mm_loadu_si128((const __m128i *) (buffer + 0x20));
+        y8 = _mm_loadu_si128((const __m128i *) (buffer + 0x30));
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, x5), y5);
+        x2 = _mm_xor_si128(_mm_xor_si128(x2, x6), y6);
+        x3 = _mm_xor_si128(_mm_xor_si128(x3, x7), y7);
+        x4 = _mm_xor_si128(_mm_xor_si128(x4, x8), y8);
+        buffer += 64;
+        len -= 64;
+    }
+
+    // Fold down to one 128-bit value
+    x0 = _mm_load_si128((const __m128i *) k3k4);
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x3), x5);
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x4), x5);
+
+    // Any remaining blocks of 16
+    while (len >= 16)
+    {
+        x2 = _mm_loadu_si128((const __m128i *) buffer);
+        x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+        x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+        buffer += 16;
+        len -= 16;
+    }
+
+    // 128 bits to 64
+    x2 = _mm_clmulepi64_si128(x1, x0, 0x10);
+    x3 = _mm_setr_epi32(~0, 0, ~0, 0);
+    x1 = _mm_srli_si128(x1, 8);
+    x1 = _mm_xor_si128(x1, x2);
+    x0 = _mm_loadl_epi64((const __m128i *) k5k0);
+    x2 = _mm_srli_si128(x1, 4);
+    x1 = _mm_and_si128(x1, x3);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_xor_si128(x1, x2);
+
+    // Barrett reduction to 32 bits
+    x0 = _mm_load_si128((const __m128i *) poly);
+    x2 = _mm_and_si128(x1, x3);
+    x2 = _mm_clmulepi64_si128(x2, x0, 0x10);
+    x2 = _mm_and_si128(x2, x3);
+    x2 = _mm_clmulepi64_si128(x2, x0, 0x00);
+    x1 = _mm_xor_si128(x1, x2);
+    return _mm_extract_epi32(x1, 1);
+}
+#endif
+
+// Put a decimal value left-aligned in a space-padded field
+void set_field(char * field, size_t field_len, long long value)
+{
+    char temp[32];
+
+    memset(field, ' ', field_len);
+    snprintf(temp, sizeof(temp), "%lld", value);
+    memcpy(field, temp, MIN(strlen(temp), field_len));
+}
+
+// Read a number out of a fixed-width field that is not NUL terminated
+off_t field_value(const char * field, size_t field_len, int base)
+{
+    char temp[32];
+
+    field_len = MIN(field_len, sizeof(temp) - 1);
+    memcpy(temp, field, field_len);
+    temp[field_len] = '\0';
+    return strtoll(temp, NULL, base);
+}
+
+// Fill in a member header from the file's name and stat information
+void build_header(arvik_header_t * header_out, const char * filename, struct stat * st_in)
+{
+    arvik_header_t header; // Header struct
+    struct stat st = *st_in;
+    char temp_buf[32];
+    size_t len;
+    size_t name_len;
+    const char * name = stored_name(filename);
+    // Initialize header with zeros
+    memset(&header, ' ', sizeof(header));
+
+    // Copy filename and add '/' terminator. A name that does not fit gets a
+    // stand-in, and its long name record carries the rest.
+    name_len = strlen(name);
+    if (needs_long_name(filename)) {
+        short_name(&header, name);
+    } else {
+        memcpy(header.arvik_name, name, name_len);
+        header.arvik_name[name_len]  = '/';
+    }
+
+    // Format the numeric fields with proper right alignment
+    // and ensure they're space-padded
+
+    // Date field
+
+    sprintf(temp_buf, "%ld", st.st_mtime);
+    len = strlen(temp_buf);
+    memcpy(header.arvik_date, temp_buf, len);
+
+    // UID field
+    sprintf(temp_buf, "%d", st.st_uid);
+    len = strlen(temp_buf);
+    memcpy(header.arvik_uid, temp_buf, len);
+
+    // GID field
+    sprintf(temp_buf, "%d", st.st_gid);
+    len = strlen(temp_buf);
+    memcpy(header.arvik_gid, temp_buf, len);
+
+    // Mode field
+    sprintf(temp_buf, "%o", st.st_mode);
+    len = strlen(temp_buf);
+    memcpy(header.arvik_mode, temp_buf, len);
+
+    // Size field; a directory has no data
+    sprintf(temp_buf, "%ld", S_ISDIR(st.st_mode) ? 0 : st.st_size);
+    len = strlen(temp_buf);
+    memcpy(header.arvik_size, temp_buf, len);
+
+    // Set terminator
+    header.arvik_term[0] = '+';
+    header.arvik_term[1] = '\n';
+
+    *header_out = header;
+}
+
+// What follows len bytes of member data: padding to an even length, then
+// the footer. Fills tail, which holds TAIL_MAX bytes, and returns how many
+// there are.
+size_t build_tail(char * tail, arvik_csum_alg_t alg, uLong crc, off_t len)
+{
+    arvik_footer_t footer;
+    size_t pad = len % 2;
+
+    build_footer(&footer, alg, crc);
+    tail[0] = '\n';
+    memcpy(tail + pad, &footer, sizeof(footer));
+    return pad + sizeof(footer);
+}
+
+// Fill in a member footer for the given checksum. CRC32 keeps the
+// version 1 layout so older readers still verify it.
+void build_footer(arvik_footer_t * footer, arvik_csum_alg_t alg, uLong crc)
+{
+    char temp[11];
+    
+    // Init footer with zeros
+    memset(footer, ' ', sizeof(*footer));
+
+    // Fill in footer fields
+    snprintf(temp, sizeof(temp), "%s%08lx", alg == ARVIK_CSUM_CRC32C ? ARVIK_CSUM_CRC32C_V2 : "0x", crc);
+    memcpy(footer->arvik_data_crc, temp, 10);
+
+    // Set Terminator
+    footer->arvik_term[0] = alg == ARVIK_CSUM_CRC32 ? '+' : ARVIK_FOOTER_V2;
+    footer->arvik_term[1] = '\n';
+}
+
+// Footers end in "+\n" (version 1) or "2\n" (version 2)
+int footer_term_ok(const arvik_footer_t * footer)
+{
+    return footer->arvik_term[1] == '\n'
+           && (footer->arvik_term[0] == '+' || footer->arvik_term[0] == ARVIK_FOOTER_V2);
+}
+
+// Pull the algorithm and value out of a footer. Returns -1 if it is bad.
+int parse_footer(const arvik_footer_t * footer, arvik_csum_alg_t * alg, uLong * crc)
+{
+    char text[sizeof(footer->arvik_data_crc) + 1];
+    char * end;
+
+    if (!footer_term_ok(footer))
+    {
+        return -1;
+    }
+    memcpy(text, footer->arvik_data_crc, sizeof(footer->arvik_data_crc));
+    text[sizeof(footer->arvik_data_crc)] = '\0';
+    if (footer->arvik_term[0] == '+')
+    {
+        if (strncmp(text, "0x", 2) != 0)
+        {
+            return -1;
+        }
+        *alg = ARVIK_CSUM_CRC32;
+    }
+    else if (strncmp(text, ARVIK_CSUM_CRC32C_V2, 2) == 0)
+    {
+        *alg = ARVIK_CSUM_CRC32C;
+    }
+    else if (strncmp(text, ARVIK_CSUM_CRC32_V2, 2) == 0)
+    {
+        *alg = ARVIK_CSUM_CRC32;
+    }
+    else
+    {
+        return -1;
+    }
+    *crc = strtoul(text + 2, &end, 16);
+    return end == text + 2 ? -1 : 0;
+}
+
+// Headers end in "+\n", or "*\n" for extended members
+int header_term_ok(arvik_header_t * header)
+{
+    return header->arvik_term[1] == '\n'
+           && (header->arvik_term[0] == '+' || header->arvik_term[0] == ARVIK_XTERM);
+}
+
+// Is the member data preceded by an extension header?
+int is_extended_member(arvik_header_t * header)
+{
+    return header->arvik_term[0] == ARVIK_XTERM;
+}
+
+// The index member is bookkeeping, not something to list or extract
+int is_index_member(arvik_header_t * header)
+{
+    return memcmp(header->arvik_name, ARVIK_INDEX_NAME "/", strlen(ARVIK_INDEX_NAME) + 1) == 0;
+}
+
+// A member replaced by -r or -u
+int is_deleted_member(arvik_header_t * header)
+{
+    return memcmp(header->arvik_name, ARVIK_DELETED_NAME "/", strlen(ARVIK_DELETED_NAME) + 1) == 0;
+}
+
+// Carries the full name of the member after it
+int is_long_name_member(arvik_header_t * header)
+{
+    return memcmp(header->arvik_name, ARVIK_LONG_NAME "/", strlen(ARVIK_LONG_NAME) + 1) == 0;
+}
+
+// Members under a reserved name are never listed or extracted
+int is_hidden_member(arvik_header_t * header)
+{
+    return is_index_member(header) || is_deleted_member(header) || is_long_name_member(header);
+}
+
+// The name a file is archived under: without any leading "/", "./" or
+// "../", so that it is extracted below the current directory
+const char * stored_name(const char * filename)
+{
+    for (;;)
+    {
+        if (filename[0] == '/')
+        {
+            filename++;
+        }
+        else if (strncmp(filename, "./", 2) == 0)
+        {
+            filename += 2;
+        }
+        else if (strncmp(filename, "../", 3) == 0)
+        {
+            filename += 3;
+        }
+        else
+        {
+            return filename;
+        }
+    }
+}
+
+// Does the stored name need a long name record
+int needs_long_name(const char * filename)
+{
+    const char * name = stored_name(filename);
+
+    return strchr(name, '/') != NULL || strlen(name) >= sizeof(((arvik_header_t *) 0)->arvik_name);
+}
+
+// Fill in the stand-in arvik_name of a member with a long name
+void short_name(arvik_header_t * header, const char * name)
+{
+    const char * base = strrchr(name, '/');
+    uint64_t hash = 14695981039346656037ULL; // FNV-1a
+    char temp[sizeof(header->arvik_name) + 1];
+
+    for (const char * ch = name; *ch != '\0'; ++ch)
+    {
+        hash = (hash ^ (unsigned char) *ch) * 1099511628211ULL;
+    }
+    snprintf(temp, sizeof(temp), "%.12s~%016llx/", base != NULL ? base + 1 : name, (unsigned long long) hash);
+    memset(header->arvik_name, ' ', sizeof(header->arvik_name));
+    memcpy(header->arvik_name, temp, strlen(temp));
+}
+
+// A name is only extracted as given if it stays below the current
+// directory: not absolute, and without ".." components
+int safe_name(const char * name)
+{
+    const char * part = name;
+
+    if (name[0] == '\0' || name[0] == '/')
+    {
+        return 0;
+    }
+    while (part != NULL)
+    {
+        if (part[0] == '.' && part[1] == '.' && (part[2] == '/' || part[2] == '\0'))
+        {
+            return 0;
+        }
+        part = strchr(part, '/');
+        if (part != NULL)
+        {
+            part++;
+        }
+    }
+    return 1;
+}
+
+// Is long_name the full name of this member. A stale or unsafe record is
+// ignored, and the member goes by its stand-in name.
+int long_name_of(arvik_header_t * header, const char * long_name)
+{
+    arvik_header_t expected;
+
+    if (long_name == NULL || long_name[0] == '\0' || !safe_name(long_name))
+    {
+        return 0;
+    }
+    short_name(&expected, long_name);
+    return memcmp(expected.arvik_name, header->arvik_name, sizeof(expected.arvik_name)) == 0;
+}
+
+// The name a member is listed and extracted under, into name, which holds
+// ARVIK_PATH_MAX bytes. long_name is what the record before it held, if any.
+void member_name(arvik_header_t * header, const char * long_name, char * name)
+{
+    char * term;
+
+    if (long_name_of(header, long_name))
+    {
+        snprintf(name, ARVIK_PATH_MAX, "%s", long_name);
+        return;
+    }
+    memcpy(name, header->arvik_name, sizeof(header->arvik_name));
+    name[sizeof(header->arvik_name)] = '\0';
+    if ((term = strchr(name, '/')))
+    {
+        *term = '\0';
+    }
+}
+
+// Check an extension header and pull out the sizes it carries.
+// Returns -2 for anything this version cannot restore.
+int check_xheader(const arvik_xheader_t * xheader, off_t * raw_size, off_t * block_size)
+{
+    if (xheader->arvik_xterm[0] != '+' || xheader->arvik_xterm[1] != '\n'
+        || memcmp(xheader->arvik_xtype, ARVIK_XTYPE_ZLIB, sizeof(xheader->arvik_xtype)) != 0)
+    {
+        return -2;
+    }
+    *raw_size = field_value(xheader->arvik_xsize, sizeof(xheader->arvik_xsize), 10);
+    *block_size = field_value(xheader->arvik_xarg, sizeof(xheader->arvik_xarg), 10);
+    if (*raw_size < 0 || *block_size <= 0 || *block_size > ZBLOCK_MAX)
+    {
+        return -2;
+    }
+    return 0;
+}
+
+int is_ref_xheader(const arvik_xheader_t * xheader)
+{
+    return memcmp(xheader->arvik_xtype, ARVIK_XTYPE_REF, sizeof(xheader->arvik_xtype)) == 0;
+}
+
+// Check a dref extension header stored in a member whose header is at
+// ref_off. References only point backwards, so they cannot form a loop.
+// Returns -2 for anything malformed.
+int check_ref(const arvik_xheader_t * xheader, off_t stored, off_t ref_off, off_t * raw_size, off_t * target_off)
+{
+    if (xheader->arvik_xterm[0] != '+' || xheader->arvik_xterm[1] != '\n' || !is_ref_xheader(xheader)
+        || stored != sizeof(*xheader))
+    {
+        return -2;
+    }
+    *raw_size = field_value(xheader->arvik_xsize, sizeof(xheader->arvik_xsize), 10);
+    *target_off = field_value(xheader->arvik_xarg, sizeof(xheader->arvik_xarg), 10);
+    if (*raw_size < 0 || *target_off < (off_t) strlen(ARVIK_TAG) || *target_off >= ref_off)
+    {
+        return -2;
+    }
+    return 0;
+}
+
+int is_sparse_xheader(const arvik_xheader_t * xheader)
+{
+    return memcmp(xheader->arvik_xtype, ARVIK_XTYPE_SPARSE, sizeof(xheader->arvik_xtype)) == 0;
+}
+
+// Check a sprs extension header. Returns -2 for anything malformed.
+int check_sparse(const arvik_xheader_t * xheader, off_t stored, off_t * raw_size, size_t * count)
+{
+    off_t extent_count = field_value(xheader->arvik_xarg, sizeof(xheader->arvik_xarg), 10);
+
+    if (xheader->arvik_xterm[0] != '+' || xheader->arvik_xterm[1] != '\n' || !is_sparse_xheader(xheader))
+    {
+        return -2;
+    }
+    *raw_size = field_value(xheader->arvik_xsize, sizeof(xheader->arvik_xsize), 10);
+    if (*raw_size < 0 || extent_count < 0
+        || extent_count > (stored - (off_t) sizeof(*xheader)) / (off_t) sizeof(arvik_extent_t))
+    {
+        return -2;
+    }
+    *count = extent_count;
+    return 0;
+}
+
+// Check one extent record. pos is where the previous extent ended and
+// remaining the stored data bytes not yet accounted for.
+int check_extent(const arvik_extent_t * record, off_t pos, off_t raw_size, off_t remaining, sparse_extent_t * extent)
+{
+    extent->offset = field_value(record->arvik_eoff, sizeof(record->arvik_eoff), 10);
+    extent->length = field_value(record->arvik_elen, sizeof(record->arvik_elen), 10);
+    if (record->arvik_eterm[0] != '+' || record->arvik_eterm[1] != '\n' || extent->offset < pos
+        || extent->length <= 0 || extent->length > remaining || extent->length > raw_size - extent->offset)
+    {
+        return -2;
+    }
+    return 0;
+}
+
+// write() all of len bytes
+static int write_all(int fd, const void * data, size_t len)
+{
+    while (len > 0)
+    {
+        ssize_t written = write(fd, data, len);
+
+        if (written < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (written <= 0)
+        {
+            return ARVIK_ERR_IO;
+        }
+        data = (const char *) data + written;
+        len -= written;
+    }
+    return 0;
+}
+
+// Start an archive on fd
+int arvik_writer_open(int fd, arvik_csum_alg_t alg, arvik_writer_t ** writer_out)
+{
+    arvik_writer_t * writer;
+
+    if (fd < 0 || (alg != ARVIK_CSUM_CRC32 && alg != ARVIK_CSUM_CRC32C))
+    {
+        return ARVIK_ERR_ARG;
+    }
+    writer = calloc(1, sizeof(*writer));
+    if (writer == NULL || (writer->buffer = malloc(WRITER_BUFFER)) == NULL)
+    {
+        free(writer);
+        return ARVIK_ERR_NOMEM;
+    }
+    writer->fd = fd;
+    writer->dest.put = writer_dest;
+    writer->dest.arg = writer;
+    writer->alg = alg;
+    writer_put(writer, ARVIK_TAG, strlen(ARVIK_TAG));
+    *writer_out = writer;
+    return 0;
+}
+
+// Stage bytes of output, writing out the buffer when it fills. Anything
+// at least as big as the buffer goes straight through.
+static int writer_put(arvik_writer_t * writer, const void * data, size_t len)
+{
+    if (writer->len + len > WRITER_BUFFER && writer_flush(writer) < 0)
+    {
+        return ARVIK_ERR_IO;
+    }
+    if (len >= WRITER_BUFFER)
+    {
+        return write_all(writer->fd, data, len);
+    }
+    memcpy(writer->buffer + writer->len, data, len);
+    writer->len += len;
+    return 0;
+}
+
+static int writer_dest(record_out_t * dest, const void * data, size_t len)
+{
+    return writer_put(dest->arg, data, len);
+}
+
+static int writer_flush(arvik_writer_t * writer)
+{
+    int result = write_all(writer->fd, writer->buffer, writer->len);
+
+    writer->len = 0;
+    return result;
+}
+
+// Add a member with the contents of an open file, read from its start.
+// name is the name to store; the file's mode, owner and mtime go with it.
+int arvik_writer_add_fd(arvik_writer_t * writer, const char * name, int fd)
+{
+    struct stat st;
+
+    if (fstat(fd, &st) < 0)
+    {
+        return ARVIK_ERR_IO;
+    }
+    if (!S_ISREG(st.st_mode))
+    {
+        return ARVIK_ERR_ARG;
+    }
+    return writer_member(writer, name, &st, fd, NULL);
+}
+
+// Add a member whose contents are in memory
+int arvik_writer_add_buffer(arvik_writer_t * writer, const char * name, const void * data, size_t len
+                            , mode_t mode, time_t mtime)
+{
+    struct stat st;
+
+    memset(&st, 0, sizeof(st));
+    st.st_mode = S_IFREG | (mode & 07777);
+    st.st_uid = getuid();
+    st.st_gid = getgid();
+    st.st_mtime = mtime;
+    st.st_size = len;
+    return writer_member(writer, name, &st, -1, data);
+}
+
+// Write one member, from fd when data is NULL. Once its header is out,
+// any failure leaves the archive unusable, and the writer refuses more.
+static int writer_member(arvik_writer_t * writer, const char * name, struct stat * st, int fd, const char * data)
+{
+    arvik_header_t header;
+    uLong crc = 0;
+    off_t done = 0;
+    char extra;
+    int result;
+
+    if (writer->failed)
+    {
+        return ARVIK_ERR_IO;
+    }
+    if (name == NULL || stored_name(name)[0] == '\0' || strlen(stored_name(name)) >= ARVIK_PATH_MAX)
+    {
+        return ARVIK_ERR_ARG;
+    }
+    writer->failed = 1;
+    if ((needs_long_name(name) && (result = put_long_name(&writer->dest, name, writer->alg, NULL, NULL)) < 0)
+        || (result = put_header(&writer->dest, name, st, &header)) < 0)
+    {
+        return result;
+    }
+    if (data != NULL)
+    {
+        crc = csum_bytes(writer->alg, 0, data, st->st_size);
+        if ((result = writer_put(writer, data, st->st_size)) < 0)
+        {
+            return result;
+        }
+        done = st->st_size;
+    }
+    while (done < st->st_size)
+    {
+        size_t room = WRITER_BUFFER - writer->len;
+        ssize_t bytes_read;
+
+        if (room < 64 * 1024 && writer_flush(writer) < 0)
+        {
+            return ARVIK_ERR_IO;
+        }
+        room = MIN((off_t) (WRITER_BUFFER - writer->len), st->st_size - done);
+        bytes_read = pread(fd, writer->buffer + writer->len, room, done);
+        if (bytes_read < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (bytes_read < 0)
+        {
+            return ARVIK_ERR_IO;
+        }
+        if (bytes_read == 0)
+        {
+            return ARVIK_ERR_CHANGED;
+        }
+        crc = csum_bytes(writer->alg, crc, writer->buffer + writer->len, bytes_read);
+        writer->len += bytes_read;
+        done += bytes_read;
+    }
+    // The file must not have grown either
+    if (fd >= 0 && pread(fd, &extra, 1, done) != 0)
+    {
+        return ARVIK_ERR_CHANGED;
+    }
+    if ((result = put_footer(&writer->dest, writer->alg, crc, done)) < 0)
+    {
+        return result;
+    }
+    writer->failed = 0;
+    return 0;
+}
+
+// Write the header of a member named filename with st's details. The
+// long name record it may need goes first; see put_long_name().
+int put_header(record_out_t * dest, const char * filename, struct stat * st, arvik_header_t * header_out)
+{
+    arvik_header_t header;
+
+    build_header(&header, filename, st);
+    if (header_out != NULL)
+    {
+        *header_out = header;
+    }
+    return dest->put(dest, &header, sizeof(header));
+}
+
+// Write the long name record that goes before a member named filename.
+// Its header and checksum are passed back for an index.
+int put_long_name(record_out_t * dest, const char * filename, arvik_csum_alg_t alg, arvik_header_t * header_out
+                  , uLong * crc_out)
+{
+    const char * name = stored_name(filename);
+    off_t len = strlen(name);
+    arvik_header_t header;
+    uLong crc = csum_bytes(alg, 0, name, len);
+    char temp[32];
+    int result;
+
+    memset(&header, ' ', sizeof(header));
+    memcpy(header.arvik_name, ARVIK_LONG_NAME "/", strlen(ARVIK_LONG_NAME) + 1);
+    header.arvik_date[0] = '0';
+    header.arvik_uid[0] = '0';
+    header.arvik_gid[0] = '0';
+    snprintf(temp, sizeof(temp), "%o", S_IFREG | 0444);
+    memcpy(header.arvik_mode, temp, strlen(temp));
+    set_field(header.arvik_size, sizeof(header.arvik_size), len);
+    header.arvik_term[0] = '+';
+    header.arvik_term[1] = '\n';
+    if (header_out != NULL)
+    {
+        *header_out = header;
+    }
+    if (crc_out != NULL)
+    {
+        *crc_out = crc;
+    }
+    if ((result = dest->put(dest, &header, sizeof(header))) < 0 || (result = dest->put(dest, name, len)) < 0)
+    {
+        return result;
+    }
+    return put_footer(dest, alg, crc, len);
+}
+
+// Padding for odd-sized data, then the footer
+int put_footer(record_out_t * dest, arvik_csum_alg_t alg, uLong crc, off_t len)
+{
+    char tail[TAIL_MAX];
+
+    return dest->put(dest, tail, build_tail(tail, alg, crc, len));
+}
+
+// Write out what is staged and free the writer. The fd is left open.
+int arvik_writer_close(arvik_writer_t * writer)
+{
+    int result = writer->failed ? ARVIK_ERR_IO : writer_flush(writer);
+
+    free(writer->buffer);
+    free(writer);
+    return result;
+}
+
+// Open an archive file for reading
+int arvik_reader_open(const char * path, arvik_reader_t ** reader_out)
+{
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    int result;
+
+    if (fd < 0)
+    {
+        return ARVIK_ERR_IO;
+    }
+    if ((result = arvik_reader_open_fd(fd, reader_out)) < 0)
+    {
+        close(fd);
+        return result;
+    }
+    (*reader_out)->own_fd = 1;
+    return 0;
+}
+
+// Read an archive from an open regular file, which the reader maps. The
+// fd is not closed with the reader.
+int arvik_reader_open_fd(int fd, arvik_reader_t ** reader_out)
+{
+    arvik_reader_t * reader;
+    struct stat st;
+    void * map;
+
+    if (fstat(fd, &st) < 0)
+    {
+        return ARVIK_ERR_IO;
+    }
+    if (!S_ISREG(st.st_mode))
+    {
+        return ARVIK_ERR_ARG;
+    }
+    if (st.st_size < (off_t) strlen(ARVIK_TAG))
+    {
+        return ARVIK_ERR_FORMAT;
+    }
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED)
+    {
+        return ARVIK_ERR_IO;
+    }
+    if (memcmp(map, ARVIK_TAG, strlen(ARVIK_TAG)) != 0)
+    {
+        munmap(map, st.st_size);
+        return ARVIK_ERR_FORMAT;
+    }
+    reader = calloc(1, sizeof(*reader));
+    if (reader == NULL)
+    {
+        munmap(map, st.st_size);
+        return ARVIK_ERR_NOMEM;
+    }
+    reader->fd = fd;
+    reader->map = map;
+    reader->size = st.st_size;
+    record_walk_start(&reader->walk, map, fd, st.st_size);
+    *reader_out = reader;
+    return 0;
+}
+
+// Go back to the first member
+void arvik_reader_rewind(arvik_reader_t * reader)
+{
+    record_walk_start(&reader->walk, reader->map, reader->fd, reader->size);
+}
+
+// Start a walk at the first record of an archive of size bytes: map, or
+// when that is NULL, fd
+void record_walk_start(record_walk_t * walk, const char * map, int fd, off_t size)
+{
+    walk->map = map;
+    walk->fd = fd;
+    walk->size = size;
+    walk->next = strlen(ARVIK_TAG);
+    walk->pending[0] = '\0';
+    walk->off = walk->next;
+    walk->damage = 0;
+}
+
+// Step to the next record. Returns 1, 0 at the end of the archive,
+// ARVIK_ERR_FORMAT at a damaged record (walk->damage says how), or
+// ARVIK_ERR_IO if the file cannot be read.
+int record_next(record_walk_t * walk)
+{
+    off_t footer_off;
+    int result;
+
+    if (walk->next >= walk->size)
+    {
+        return 0;
+    }
+    walk->off = walk->next;
+    walk->data_off = walk->off + sizeof(arvik_header_t);
+    if (walk->off < 0 || walk->data_off > walk->size)
+    {
+        walk->damage = WALK_SHORT_HEADER;
+        return ARVIK_ERR_FORMAT;
+    }
+    if ((result = walk_read(walk, &walk->header, sizeof(walk->header), walk->off)) < 0)
+    {
+        return result;
+    }
+    walk->stored = field_value(walk->header.arvik_size, sizeof(walk->header.arvik_size), 10);
+    if (!header_term_ok(&walk->header) || walk->stored < 0)
+    {
+        walk->damage = WALK_BAD_HEADER;
+        return ARVIK_ERR_FORMAT;
+    }
+
+    // A long name is for the record right after its own
+    strcpy(walk->long_name, walk->pending);
+    walk->pending[0] = '\0';
+    member_name(&walk->header, walk->long_name, walk->name);
+
+    footer_off = walk->data_off + walk->stored + (walk->stored % 2);
+    if (walk->stored > walk->size - walk->data_off
+        || footer_off > walk->size - (off_t) sizeof(arvik_footer_t))
+    {
+        walk->damage = WALK_SHORT_DATA;
+        return ARVIK_ERR_FORMAT;
+    }
+    if ((result = walk_read(walk, &walk->footer, sizeof(walk->footer), footer_off)) < 0)
+    {
+        return result;
+    }
+    if (is_long_name_member(&walk->header) && walk->stored < ARVIK_PATH_MAX)
+    {
+        if ((result = walk_read(walk, walk->pending, walk->stored, walk->data_off)) < 0)
+        {
+            return result;
+        }
+        walk->pending[walk->stored] = '\0';
+    }
+    walk->next = footer_off + sizeof(arvik_footer_t);
+    return 1;
+}
+
+// Read len bytes at off of the archive being walked. The caller has
+// checked they are inside it.
+static int walk_read(record_walk_t * walk, void * data, size_t len, off_t off)
+{
+    ssize_t bytes_read;
+
+    if (walk->map != NULL)
+    {
+        memcpy(data, walk->map + off, len);
+        return 0;
+    }
+    bytes_read = pread(walk->fd, data, len, off);
+    if (bytes_read == (ssize_t) len)
+    {
+        return 0;
+    }
+    // Cut short since the walk started
+    if (bytes_read >= 0)
+    {
+        errno = EIO;
+    }
+    return ARVIK_ERR_IO;
+}
+
+// Describe the record a walk over a mapped archive is at. Its name is
+// left to the caller.
+static int member_of(record_walk_t * walk, arvik_member_t * member)
+{
+    arvik_xheader_t xheader;
+
+    memset(member, 0, sizeof(*member));
+    if (parse_footer(&walk->footer, &member->csum, &member->crc) < 0)
+    {
+        return ARVIK_ERR_FORMAT;
+    }
+    member->mode = field_value(walk->header.arvik_mode, sizeof(walk->header.arvik_mode), 8);
+    member->uid = field_value(walk->header.arvik_uid, sizeof(walk->header.arvik_uid), 10);
+    member->gid = field_value(walk->header.arvik_gid, sizeof(walk->header.arvik_gid), 10);
+    member->mtime = field_value(walk->header.arvik_date, sizeof(walk->header.arvik_date), 10);
+    member->stored = walk->map + walk->data_off;
+    member->stored_size = walk->stored;
+    member->size = walk->stored;
+    member->data = member->stored;
+    member->header_off = walk->off;
+    if (is_extended_member(&walk->header))
+    {
+        if (walk->stored < (off_t) sizeof(xheader))
+        {
+            return ARVIK_ERR_FORMAT;
+        }
+        memcpy(&xheader, member->stored, sizeof(xheader));
+        member->extended = 1;
+        member->data = NULL;
+        memcpy(member->xtype, xheader.arvik_xtype, sizeof(xheader.arvik_xtype));
+        member->size = field_value(xheader.arvik_xsize, sizeof(xheader.arvik_xsize), 10);
+    }
+    return 0;
+}
+
+// Describe the member whose header is at off in a mapped archive
+static int member_at(const char * map, off_t map_size, off_t off, arvik_member_t * member)
+{
+    record_walk_t walk;
+    int result;
+
+    record_walk_start(&walk, map, -1, map_size);
+    walk.next = off;
+    result = record_next(&walk);
+    if (result <= 0)
+    {
+        return result < 0 ? result : ARVIK_ERR_FORMAT;
+    }
+    return member_of(&walk, member);
+}
+
+// The next member. Returns 1, 0 at the end of the archive, or an error.
+// The index, replaced members and long name records are passed over.
+int arvik_reader_next(arvik_reader_t * reader, arvik_member_t * member)
+{
+    int result;
+
+    while ((result = record_next(&reader->walk)) > 0)
+    {
+        if (is_hidden_member(&reader->walk.header))
+        {
+            continue;
+        }
+        if ((result = member_of(&reader->walk, member)) < 0)
+        {
+            return result;
+        }
+        member->name = reader->walk.name;
+        return 1;
+    }
+    return result;
+}
+
+// Look a member up by its full name, from the start of the archive.
+// Headers are read from the mapping, so passing over members is cheap.
+int arvik_reader_find(arvik_reader_t * reader, const char * name, arvik_member_t * member)
+{
+    int result;
+
+    arvik_reader_rewind(reader);
+    while ((result = arvik_reader_next(reader, member)) > 0)
+    {
+        if (strcmp(member->name, name) == 0)
+        {
+            return 0;
+        }
+    }
+    return result < 0 ? result : ARVIK_ERR_NOT_FOUND;
+}
+
+// Check a member's data against its CRC without writing it anywhere
+int arvik_member_verify(arvik_reader_t * reader, const arvik_member_t * member)
+{
+    restore_out_t out;
+    int result;
+
+    out_start(&out, -1, member->csum);
+    result = restore_member(reader->map, reader->size, member, &out.sink);
+    if (result == 0 && out.crc != member->crc)
+    {
+        return ARVIK_ERR_CRC;
+    }
+    return result;
+}
+
+// Write a member's contents to fd, restoring compressed, sparse and
+// dref members, and check its CRC on the way. ARVIK_ERR_CRC means what
+// was written is damaged.
+int arvik_member_write(arvik_reader_t * reader, const arvik_member_t * member, int fd)
+{
+    restore_out_t out;
+    int result;
+    off_t end;
+
+    if (fd < 0)
+    {
+        return ARVIK_ERR_ARG;
+    }
+    out_start(&out, fd, member->csum);
+    result = restore_member(reader->map, reader->size, member, &out.sink);
+    if (result == 0 && out.crc != member->crc)
+    {
+        return ARVIK_ERR_CRC;
+    }
+    // A file that ends in a hole gets its size back
+    if (result == 0 && out.seeked && ((end = lseek(fd, 0, SEEK_CUR)) < 0 || ftruncate(fd, end) < 0))
+    {
+        return ARVIK_ERR_IO;
+    }
+    return result;
+}
+
+// Restore the member whose header is at header_off in a mapped archive.
+// The caller checks the CRC, which sink has kept.
+int restore_at(const char * map, off_t map_size, off_t header_off, restore_sink_t * sink)
+{
+    arvik_member_t member;
+    int result = member_at(map, map_size, header_off, &member);
+
+    return result < 0 ? result : restore_member(map, map_size, &member, sink);
+}
+
+static int restore_member(const char * map, off_t map_size, const arvik_member_t * member, restore_sink_t * sink)
+{
+    restore_source_t source;
+    arvik_xheader_t xheader;
+
+    if (!member->extended)
+    {
+        return member->size > 0 ? sink->data(sink, member->data, member->size) : 0;
+    }
+    memcpy(&xheader, member->stored, sizeof(xheader));
+    restore_source_map(&source, member->stored + sizeof(xheader), member->stored_size - sizeof(xheader));
+    if (memcmp(member->xtype, ARVIK_XTYPE_ZLIB, 4) == 0)
+    {
+        return restore_zlib(&source, &xheader, member->stored_size, sink);
+    }
+    if (memcmp(member->xtype, ARVIK_XTYPE_SPARSE, 4) == 0)
+    {
+        return restore_sparse(&source, &xheader, member->stored_size, sink);
+    }
+    if (memcmp(member->xtype, ARVIK_XTYPE_REF, 4) == 0)
+    {
+        arvik_header_t target_header;
+        arvik_member_t target;
+        off_t raw_size;
+        off_t target_off;
+
+        // The earlier member holds the data, and its footer the same CRC.
+        // It may be stored any way but as another reference, and may since
+        // have been replaced by -r and kept only as ARVIK_DELETED_NAME.
+        if (check_ref(&xheader, member->stored_size, member->header_off, &raw_size, &target_off) < 0
+            || member_at(map, map_size, target_off, &target) < 0)
+        {
+            return ARVIK_ERR_FORMAT;
+        }
+        memcpy(&target_header, map + target_off, sizeof(target_header));
+        if (is_index_member(&target_header) || (target.extended && memcmp(target.xtype, ARVIK_XTYPE_REF, 4) == 0)
+            || target.size != raw_size || target.csum != member->csum || target.crc != member->crc)
+        {
+            return ARVIK_ERR_FORMAT;
+        }
+        return restore_member(map, map_size, &target, sink);
+    }
+    return ARVIK_ERR_UNSUPPORTED;
+}
+
+// Read a member's stored bytes from memory
+void restore_source_map(restore_source_t * source, const char * data, off_t len)
+{
+    source->next = NULL;
+    source->arg = NULL;
+    source->pos = data;
+    source->left = len;
+}
+
+// Up to max of the bytes that follow in source
+static ssize_t source_next(restore_source_t * source, const char ** data, size_t max)
+{
+    size_t len;
+
+    if (source->next != NULL)
+    {
+        return source->next(source, data, max);
+    }
+    len = MIN((off_t) max, source->left);
+    *data = source->pos;
+    source->pos += len;
+    source->left -= len;
+    return len;
+}
+
+// The next len bytes of source in one piece: in place when the source
+// has them that way, else copied to spare, which holds len bytes. NULL if
+// the input ends first. Memory sources never need spare.
+static const char * source_take(restore_source_t * source, size_t len, char * spare)
+{
+    const char * data;
+    size_t got = 0;
+
+    if (source->next == NULL)
+    {
+        return source->left < (off_t) len || source_next(source, &data, len) != (ssize_t) len ? NULL : data;
+    }
+    while (got < len)
+    {
+        ssize_t bytes = source_next(source, &data, len - got);
+
+        if (bytes <= 0)
+        {
+            return NULL;
+        }
+        if (bytes == (ssize_t) len)
+        {
+            return data;
+        }
+        memcpy(spare + got, data, bytes);
+        got += bytes;
+    }
+    return spare;
+}
+
+// A run of independently deflated blocks, after the extension header that
+// was read from source already. stored counts that header too.
+int restore_zlib(restore_source_t * source, const arvik_xheader_t * xheader, off_t stored, restore_sink_t * sink)
+{
+    off_t left = stored - sizeof(*xheader);
+    off_t raw_size;
+    off_t block_size;
+    off_t done = 0;
+    uLongf spare_len;
+    char * scratch;
+    char * spare = NULL;    // block data the source does not have in one piece
+    int result = 0;
+
+    if (left < 0 || check_xheader(xheader, &raw_size, &block_size) < 0)
+    {
+        return ARVIK_ERR_UNSUPPORTED;
+    }
+    spare_len = compressBound(block_size);
+    scratch = malloc(block_size);
+    if (scratch == NULL || (source->next != NULL && (spare = malloc(spare_len)) == NULL))
+    {
+        free(scratch);
+        return ARVIK_ERR_NOMEM;
+    }
+    while (result == 0 && done < raw_size)
+    {
+        arvik_zblock_t block;
+        uLongf raw_len = MIN(block_size, raw_size - done);
+        const char * data;
+        off_t len;
+
+        if (left < (off_t) sizeof(block) || (data = source_take(source, sizeof(block), (char *) &block)) == NULL)
+        {
+            result = ARVIK_ERR_FORMAT;
+            break;
+        }
+        memmove(&block, data, sizeof(block));
+        left -= sizeof(block);
+        len = field_value(block.arvik_zlen, sizeof(block.arvik_zlen), 10);
+        if (block.arvik_zterm[0] != '+' || block.arvik_zterm[1] != '\n' || len < 0 || len > left
+            || (uLongf) len > spare_len || (data = source_take(source, len, spare)) == NULL)
+        {
+            result = ARVIK_ERR_FORMAT;
+            break;
+        }
+        left -= len;
+        if (block.arvik_zkind[0] == 'z')
+        {
+            uLongf dest_len = raw_len;
+            int status = sink->inflate != NULL ? sink->inflate(scratch, &dest_len, data, len)
+                         : uncompress((Bytef *) scratch, &dest_len, (const Bytef *) data, len);
+
+            if (status != Z_OK || dest_len != raw_len)
+            {
+                result = ARVIK_ERR_FORMAT;
+            }
+            else
+            {
+                result = sink->data(sink, scratch, raw_len);
+            }
+        }
+        else if (block.arvik_zkind[0] == 'r' && len == (off_t) raw_len)
+        {
+            result = sink->data(sink, data, raw_len);
+        }
+        else
+        {
+            result = ARVIK_ERR_FORMAT;
+        }
+        done += raw_len;
+    }
+    if (result == 0 && left != 0)
+    {
+        result = ARVIK_ERR_FORMAT;
+    }
+    free(scratch);
+    free(spare);
+    return result;
+}
+
+// Extent records after the extension header that was read from source
+// already, then the data of each extent. stored counts that header too.
+int restore_sparse(restore_source_t * source, const arvik_xheader_t * xheader, off_t stored, restore_sink_t * sink)
+{
+    const char * records;
+    char * spare = NULL;    // the records, when the source does not have them in one piece
+    off_t raw_size;
+    off_t remaining;
+    off_t pos = 0;
+    size_t count;
+    int result = 0;
+
+    if (check_sparse(xheader, stored, &raw_size, &count) < 0)
+    {
+        return ARVIK_ERR_FORMAT;
+    }
+    if (source->next != NULL && (spare = malloc((count + 1) * sizeof(arvik_extent_t))) == NULL)
+    {
+        return ARVIK_ERR_NOMEM;
+    }
+    records = source_take(source, count * sizeof(arvik_extent_t), spare);
+    remaining = stored - sizeof(*xheader) - count * sizeof(arvik_extent_t);
+    for (size_t i = 0; result == 0 && i < count; ++i)
+    {
+        arvik_extent_t record;
+        sparse_extent_t extent;
+        off_t copied = 0;
+
+        if (records == NULL)
+        {
+            result = ARVIK_ERR_FORMAT;
+            break;
+        }
+        memcpy(&record, records + i * sizeof(record), sizeof(record));
+        if (check_extent(&record, pos, raw_size, remaining, &extent) < 0)
+        {
+            result = ARVIK_ERR_FORMAT;
+            break;
+        }
+        result = sink_hole(sink, extent.offset - pos);
+        while (result == 0 && copied < extent.length)
+        {
+            const char * data;
+            ssize_t bytes = source_next(source, &data, extent.length - copied);
+
+            if (bytes <= 0)
+            {
+                result = ARVIK_ERR_FORMAT;
+                break;
+            }
+            result = sink->data(sink, data, bytes);
+            copied += bytes;
+        }
+        remaining -= extent.length;
+        pos = extent.offset + extent.length;
+    }
+    free(spare);
+    if (result == 0 && (records == NULL || remaining != 0))
+    {
+        return ARVIK_ERR_FORMAT;
+    }
+    return result < 0 ? result : sink_hole(sink, raw_size - pos);
+}
+
+static int sink_hole(restore_sink_t * sink, off_t len)
+{
+    return len > 0 ? sink->hole(sink, len) : 0;
+}
+
+static void out_start(restore_out_t * out, int fd, arvik_csum_alg_t alg)
+{
+    out->sink.data = out_data;
+    out->sink.hole = out_hole;
+    out->sink.inflate = NULL;
+    out->sink.arg = out;
+    out->fd = fd;
+    out->alg = alg;
+    out->crc = 0;
+    out->seeked = 0;
+}
+
+static int out_data(restore_sink_t * sink, const char * data, size_t len)
+{
+    restore_out_t * out = sink->arg;
+
+    out->crc = csum_bytes(out->alg, out->crc, data, len);
+    return out->fd < 0 ? 0 : write_all(out->fd, data, len);
+}
+
+// len zero bytes: a hole where the output can seek, written out where not
+static int out_hole(restore_sink_t * sink, off_t len)
+{
+    static const char zeros[4096];
+    restore_out_t * out = sink->arg;
+
+    out->crc = csum_zero_bytes(out->alg, out->crc, len);
+    if (out->fd < 0)
+    {
+        return 0;
+    }
+    if (lseek(out->fd, len, SEEK_CUR) >= 0)
+    {
+        out->seeked = 1;
+        return 0;
+    }
+    while (len > 0)
+    {
+        size_t chunk = MIN(len, (off_t) sizeof(zeros));
+
+        if (write_all(out->fd, zeros, chunk) < 0)
+        {
+            return ARVIK_ERR_IO;
+        }
+        len -= chunk;
+    }
+    return 0;
+}
+
+// Unmap the archive, and close it if the reader opened it
+void arvik_reader_close(arvik_reader_t * reader)
+{
+    munmap((void *) reader->map, reader->size);
+    if (reader->own_fd)
+    {
+        close(reader->fd);
+    }
+    free(reader);
+}
@@ -0,0 +1,167 @@
+#ifndef _LIBARVIK_H
+# define _LIBARVIK_H
+
+// libarvik: the arvik archive format as a library, for programs that want
+// to read or write archives without running the arvik tool. The tool is
+// built on the same format code.
+//
+// Nothing in here exits or prints. Calls return 0 (or a count) on success
+// and a negative arvik_error_t on failure; for ARVIK_ERR_IO, errno says
+// which system call failed and why.
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <stdint.h>
+#include <zlib.h>
+
+#include "arvik.h"
+
+// Optional member index, stored as the last member of the archive under the
+// reserved name "/". Its data is an array of index entries followed by a
+// fixed-size trailer, so readers find it by reading backwards from the end.
+#define ARVIK_INDEX_NAME "/"
+#define ARVIK_INDEX_MAGIC "ARVIKIDX"
+
+// A member replaced by -r or -u keeps its bytes, but its name is overwritten
+// in place with this reserved name (stored as "/-/"), so readers skip it the
+// way they skip the index
+#define ARVIK_DELETED_NAME "/-"
+
+// A member whose name does not fit in arvik_name, or has a '/' in it (as
+// paths found by -R do), is preceded by a record under this reserved name
+// (stored "/L/") whose data is the full name. The member's own arvik_name
+// is a stand-in: the start of its last path component, '~' and a hash of
+// the full name, so stored names still compare equal only for equal names.
+#define ARVIK_LONG_NAME "/L"
+// Longest full name we store or restore, terminator included
+#define ARVIK_PATH_MAX 4096
+
+typedef struct arvik_index_entry_s {
+    arvik_header_t arvik_header;    // copy of the member header
+    char arvik_data_off[20];        // offset of member data in the archive
+    char arvik_data_crc[10];        // same text as the member footer
+    char arvik_term[2];
+} arvik_index_entry_t;
+
+typedef struct arvik_index_trailer_s {
+    char arvik_magic[8];            // ARVIK_INDEX_MAGIC
+    char arvik_count[12];           // number of index entries
+    char arvik_index_off[20];       // offset of the index member header
+    char arvik_term[2];
+} arvik_index_trailer_t;
+
+// Index entries collected while writing an archive
+typedef struct arvik_index_s {
+    arvik_index_entry_t * entries;
+    size_t count;
+    size_t capacity;
+} arvik_index_t;
+
+// Extended members have '*' in place of '+' in the header terminator. Their
+// data starts with an extension header that says how to restore them, and
+// arvik_size counts the stored bytes, extension header included, so every
+// member is skipped the same way. The footer CRC covers the restored data.
+#define ARVIK_XTERM '*'
+#define ARVIK_XTYPE_ZLIB "zlib"
+// A dref member has the same content as an earlier member in the archive.
+// It stores nothing but its extension header, whose arvik_xarg is the
+// archive offset of the earlier member's header; its footer repeats the
+// earlier member's CRC.
+#define ARVIK_XTYPE_REF "dref"
+// A sprs member stores only the data extents of a sparse file. arvik_xarg
+// is the number of extents; their records follow the extension header, and
+// the data of each extent follows the records, in file order. Everything
+// between extents, and after the last one, is a hole.
+#define ARVIK_XTYPE_SPARSE "sprs"
+
+typedef struct arvik_xheader_s {
+    char arvik_xtype[4];    // how the data is stored
+    char arvik_xsize[20];   // size of the member once restored
+    char arvik_xarg[20];    // depends on type; block size for zlib
+    char arvik_xterm[2];
+} arvik_xheader_t;
+
+// zlib members are a run of independently deflated blocks, each covering
+// arvik_xarg bytes of the member (the last may be shorter), so blocks can
+// be compressed on separate threads
+typedef struct arvik_zblock_s {
+    char arvik_zkind[2];    // "z " deflated, "r " stored as is
+    char arvik_zlen[10];    // bytes of block data that follow
+    char arvik_zterm[2];
+} arvik_zblock_t;
+
+typedef struct arvik_extent_s {
+    char arvik_eoff[20];    // offset of the extent in the file
+    char arvik_elen[20];    // bytes of data in it
+    char arvik_eterm[2];
+} arvik_extent_t;
+
+// Checksums a footer can carry. Version 1 footers hold a CRC32 as
+// "0x%08lx" and end in "+\n". Version 2 footers start the field with a
+// two-letter algorithm code in place of "0x" and end in "2\n".
+typedef enum {
+    ARVIK_CSUM_CRC32 = 0    // zlib crc32, IEEE polynomial
+    , ARVIK_CSUM_CRC32C     // Castagnoli polynomial
+} arvik_csum_alg_t;
+
+#define ARVIK_FOOTER_V2 '2'
+#define ARVIK_CSUM_CRC32_V2 "ie"
+#define ARVIK_CSUM_CRC32C_V2 "cc"
+
+typedef enum {
+    ARVIK_OK = 0
+    , ARVIK_ERR_IO = -1             // a system call failed, see errno
+    , ARVIK_ERR_NOMEM = -2
+    , ARVIK_ERR_FORMAT = -3         // not an archive, or a damaged one
+    , ARVIK_ERR_CRC = -4            // member data does not match its footer
+    , ARVIK_ERR_UNSUPPORTED = -5    // stored in a way this version cannot restore
+    , ARVIK_ERR_NOT_FOUND = -6
+    , ARVIK_ERR_ARG = -7            // bad name, size or descriptor
+    , ARVIK_ERR_CHANGED = -8        // a file changed size while it was archived
+} arvik_error_t;
+
+// Writes an archive to an fd, a member at a time. The fd must be at the
+// start of an empty file or a pipe; it is not closed.
+typedef struct arvik_writer_s arvik_writer_t;
+
+// Reads members out of an archive mapped into memory. Member data is a
+// view into the mapping, so nothing is copied until the caller asks.
+typedef struct arvik_reader_s arvik_reader_t;
+
+// A member as the reader sees it. Pointers stay valid until the reader is
+// closed, except name, which the next arvik_reader_next() overwrites.
+typedef struct arvik_member_s {
+    const char * name;      // full name, long names resolved
+    mode_t mode;
+    uid_t uid;
+    gid_t gid;
+    time_t mtime;
+    off_t size;             // bytes once restored
+    const char * data;      // the content, or NULL for an extended member
+    const char * stored;    // the bytes as stored, extension header included
+    off_t stored_size;
+    int extended;           // compressed, sparse or a dref; see xtype
+    char xtype[5];          // ARVIK_XTYPE_*, empty for a plain member
+    arvik_csum_alg_t csum;
+    uLong crc;              // from the footer
+    off_t header_off;       // offset of the member header in the archive
+} arvik_member_t;
+
+const char * arvik_strerror(int error);
+
+int arvik_writer_open(int fd, arvik_csum_alg_t alg, arvik_writer_t ** writer_out);
+int arvik_writer_add_fd(arvik_writer_t * writer, const char * name, int fd);
+int arvik_writer_add_buffer(arvik_writer_t * writer, const char * name, const void * data, size_t len
+                            , mode_t mode, time_t mtime);
+int arvik_writer_close(arvik_writer_t * writer);
+
+int arvik_reader_open(const char * path, arvik_reader_t ** reader_out);
+int arvik_reader_open_fd(int fd, arvik_reader_t ** reader_out);
+int arvik_reader_next(arvik_reader_t * reader, arvik_member_t * member);
+int arvik_reader_find(arvik_reader_t * reader, const char * name, arvik_member_t * member);
+void arvik_reader_rewind(arvik_reader_t * reader);
+int arvik_member_verify(arvik_reader_t * reader, const arvik_member_t * member);
+int arvik_member_write(arvik_reader_t * reader, const arvik_member_t * member, int fd);
+void arvik_reader_close(arvik_reader_t * reader);
+
+#endif
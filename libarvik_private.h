@@ -0,0 +1,132 @@
+#ifndef _LIBARVIK_PRIVATE_H
+# define _LIBARVIK_PRIVATE_H
+
+// The parts of libarvik the arvik tool shares but other programs should
+// not count on: field and header helpers, checksums, and the decoders the
+// tool restores members with. Programs using the library include
+// libarvik.h alone.
+
+#include "libarvik.h"
+
+#define ZBLOCK_SIZE (1024 * 1024)
+#define ZBLOCK_MAX (64 * 1024 * 1024)   // largest block size we will restore
+// Padding and footer after a member's data, see build_tail()
+#define TAIL_MAX (1 + sizeof(arvik_footer_t))
+
+// A data extent of a sparse member file, as found by SEEK_DATA/SEEK_HOLE
+typedef struct sparse_extent_s {
+    off_t offset;
+    off_t length;
+} sparse_extent_t;
+
+// Why record_next() stopped at a damaged record
+typedef enum {
+    WALK_BAD_HEADER = 1     // no header terminator, or a negative size
+    , WALK_SHORT_HEADER     // the archive ends inside the header
+    , WALK_SHORT_DATA       // ... or after it, in the data or footer
+} walk_damage_t;
+
+// A walk over the records of an archive in order: members, long name
+// records and hidden ones alike. A mapped archive is read in place, any
+// other with pread(); either way only headers, footers and long names are
+// read. arvik_reader_next() and the arvik tool's scans of seekable
+// archives are built on it.
+typedef struct record_walk_s {
+    const char * map;       // the archive, or NULL to read fd
+    int fd;
+    off_t size;
+    off_t next;             // header of the next record
+    char pending[ARVIK_PATH_MAX];   // from a long name record, for the record after it
+    // The record record_next() found, or stopped at
+    off_t off;              // of its header
+    arvik_header_t header;
+    arvik_footer_t footer;
+    off_t data_off;
+    off_t stored;           // bytes of data, extension header included
+    char long_name[ARVIK_PATH_MAX]; // the record before it gave, or ""
+    char name[ARVIK_PATH_MAX];      // full name of a member
+    walk_damage_t damage;
+} record_walk_t;
+
+// Where a decoder reads a member's stored bytes from: memory, such as a
+// mapped archive (set up with restore_source_map()), or next(), which
+// points data at up to max of the bytes that follow and returns how many,
+// 0 at the end of the input.
+typedef struct restore_source_s restore_source_t;
+struct restore_source_s {
+    ssize_t (*next)(restore_source_t * source, const char ** data, size_t max);
+    void * arg;             // for next()
+    const char * pos;       // bytes left in memory when next is NULL
+    off_t left;
+};
+
+// Where a decoder puts a member's data, in order. data() takes bytes and
+// hole() a run of zeros it may leave as a hole; both fold what they get
+// into the caller's checksum and return 0 or a negative arvik_error_t.
+// inflate(), when not NULL, is called in place of zlib's uncompress().
+typedef struct restore_sink_s restore_sink_t;
+struct restore_sink_s {
+    int (*data)(restore_sink_t * sink, const char * data, size_t len);
+    int (*hole)(restore_sink_t * sink, off_t len);
+    int (*inflate)(char * dest, uLongf * dest_len, const char * src, size_t len);
+    void * arg;             // for the callbacks
+};
+
+// Where a writer puts archive bytes, in order: the staging buffer of a
+// libarvik writer, or the arvik tool's output. put() returns 0 or a
+// negative arvik_error_t.
+typedef struct record_out_s record_out_t;
+struct record_out_s {
+    int (*put)(record_out_t * dest, const void * data, size_t len);
+    void * arg;             // for put()
+};
+
+// Checksums
+uLong csum_bytes(arvik_csum_alg_t alg, uLong crc, const void * buffer, size_t len);
+uLong csum_combine(arvik_csum_alg_t alg, uLong crc1, uLong crc2, off_t len2);
+uLong csum_zero_bytes(arvik_csum_alg_t alg, uLong crc, off_t len);
+
+// Headers, footers and names
+void set_field(char * field, size_t field_len, long long value);
+off_t field_value(const char * field, size_t field_len, int base);
+void build_header(arvik_header_t * header_out, const char * filename, struct stat * st_in);
+void build_footer(arvik_footer_t * footer, arvik_csum_alg_t alg, uLong crc);
+size_t build_tail(char * tail, arvik_csum_alg_t alg, uLong crc, off_t len);
+int parse_footer(const arvik_footer_t * footer, arvik_csum_alg_t * alg, uLong * crc);
+int header_term_ok(arvik_header_t * header);
+int footer_term_ok(const arvik_footer_t * footer);
+int is_extended_member(arvik_header_t * header);
+int is_index_member(arvik_header_t * header);
+int is_deleted_member(arvik_header_t * header);
+int is_long_name_member(arvik_header_t * header);
+int is_hidden_member(arvik_header_t * header);
+const char * stored_name(const char * filename);
+int needs_long_name(const char * filename);
+void short_name(arvik_header_t * header, const char * name);
+int safe_name(const char * name);
+int long_name_of(arvik_header_t * header, const char * long_name);
+void member_name(arvik_header_t * header, const char * long_name, char * name);
+int check_xheader(const arvik_xheader_t * xheader, off_t * raw_size, off_t * block_size);
+int is_ref_xheader(const arvik_xheader_t * xheader);
+int check_ref(const arvik_xheader_t * xheader, off_t stored, off_t ref_off, off_t * raw_size, off_t * target_off);
+int is_sparse_xheader(const arvik_xheader_t * xheader);
+int check_sparse(const arvik_xheader_t * xheader, off_t stored, off_t * raw_size, size_t * count);
+int check_extent(const arvik_extent_t * record, off_t pos, off_t raw_size, off_t remaining, sparse_extent_t * extent);
+
+// Writing records
+int put_header(record_out_t * dest, const char * filename, struct stat * st, arvik_header_t * header_out);
+int put_long_name(record_out_t * dest, const char * filename, arvik_csum_alg_t alg, arvik_header_t * header_out
+                  , uLong * crc_out);
+int put_footer(record_out_t * dest, arvik_csum_alg_t alg, uLong crc, off_t len);
+
+// Walking records
+void record_walk_start(record_walk_t * walk, const char * map, int fd, off_t size);
+int record_next(record_walk_t * walk);
+
+// Restoring members
+void restore_source_map(restore_source_t * source, const char * data, off_t len);
+int restore_at(const char * map, off_t map_size, off_t header_off, restore_sink_t * sink);
+int restore_zlib(restore_source_t * source, const arvik_xheader_t * xheader, off_t stored, restore_sink_t * sink);
+int restore_sparse(restore_source_t * source, const arvik_xheader_t * xheader, off_t stored, restore_sink_t * sink);
+
+#endif